@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hashtable.h"
+
+/*
+ * Hashtable microbenchmark: the byte at a time CRC32 the table used to
+ * hash keys with against the hashes it picks from now, then whole table
+ * operations with each of them, on client ids and topic names.
+ *
+ *     bench_hashtable [keys] [rounds]
+ */
+
+#define DEFAULT_KEYS 100000
+#define DEFAULT_ROUNDS 20
+
+static uint32_t crc32_tab[256];
+
+static void crc32_init(void)
+{
+   for(uint32_t i = 0; i < 256; i++)
+   {
+	uint32_t c = i;
+	for(int k = 0; k < 8; k++)
+		c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+	crc32_tab[i] = c;
+   }
+}
+
+/* The previous hashtable_hash_init, less the final modulo */
+static uint64_t hash_legacy(const char *key, size_t len)
+{
+   (void)len;
+   size_t n = strlen(key);
+   uint64_t h = 0;
+   for(size_t i = 0; i < n; i++)
+	   h = crc32_tab[(h ^ (uint8_t) key[i]) & 0xff] ^ (h >> 8);
+
+   h += (h << 12);
+   h ^= (h >> 22);
+   h += (h << 4);
+   h ^= (h >> 9);
+   h += (h << 10);
+   h ^= (h >> 2);
+   h += (h << 7);
+   h ^= (h >> 12);
+   return (h >> 3) * 2654435761UL;
+}
+
+struct backend
+{
+   const char *name;
+   hashtable_hash_fn *hash;
+};
+
+static double now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char **make_keys(size_t n, int topics)
+{
+   char **keys = malloc(n * sizeof(*keys));
+   for(size_t i = 0; i < n; i++)
+   {
+	char buf[128];
+	if(topics)
+		snprintf(buf, sizeof(buf), "sensors/building-%zu/floor-%zu/room-%zu/temperature",
+			 i % 97, i % 31, i);
+	else
+		snprintf(buf, sizeof(buf), "client-%08zx-%04zx-4%03zx-a%03zx",
+			 i * 2654435761UL, i & 0xffff, i % 0xfff, (i * 7) % 0xfff);
+	keys[i] = strdup(buf);
+   }
+   return keys;
+}
+
+static volatile uint64_t sink;
+
+static void bench_hash(const struct backend *b, char **keys,
+		       size_t n, int rounds)
+{
+   uint64_t acc = 0;
+   double start = now_ns();
+   for(int r = 0; r < rounds; r++)
+	   for(size_t i = 0; i < n; i++)
+		   acc += b->hash(keys[i], strlen(keys[i]));
+   double ns = (now_ns() - start) / ((double) n * rounds);
+   sink = acc;
+   printf("  %-8s hash %8.2f ns/key\n", b->name, ns);
+}
+
+static int no_destroy(struct hashtable_entry *e)
+{
+   (void)e;
+   return HASHTABLE_OK;
+}
+
+static void bench_table(const struct backend *b, char **keys,
+			size_t n, int rounds)
+{
+   double put = 0, get = 0, del = 0;
+   for(int r = 0; r < rounds; r++)
+   {
+	HashTable *t = hashtable_create(no_destroy);
+	hashtable_set_hash(t, b->hash);
+
+	double start = now_ns();
+	for(size_t i = 0; i < n; i++)
+		hashtable_put(t, keys[i], keys[i]);
+	double mid = now_ns();
+	for(size_t i = 0; i < n; i++)
+		sink += (uintptr_t) hashtable_get(t, keys[(i * 7919) % n]);
+	double end = now_ns();
+	for(size_t i = 0; i < n; i++)
+		hashtable_del(t, keys[i]);
+	del += now_ns() - end;
+	put += mid - start;
+	get += end - mid;
+
+	hashtable_release(t);
+   }
+   double ops = (double) n * rounds;
+   printf("  %-8s put %8.2f  get %8.2f  del %8.2f ns/op\n",
+	  b->name, put / ops, get / ops, del / ops);
+}
+
+int main(int argc, char **argv)
+{
+   size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_KEYS;
+   int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+   if(n == 0 || rounds <= 0)
+   {
+	fprintf(stderr, "usage: %s [keys] [rounds]\n", argv[0]);
+	return 1;
+   }
+
+   crc32_init();
+   struct backend backends[] = {
+	{ "legacy", hash_legacy },
+	{ "words", hashtable_hash_words },
+#if defined(__x86_64__)
+	{ "crc32c", hashtable_hash_crc32c },
+#endif
+   };
+   size_t nbackends = sizeof(backends) / sizeof(backends[0]);
+#if defined(__x86_64__)
+   __builtin_cpu_init();
+   if(!__builtin_cpu_supports("sse4.2"))
+	   nbackends--;
+#endif
+
+   const char *sets[] = { "client ids", "topics" };
+   for(int s = 0; s < 2; s++)
+   {
+	char **keys = make_keys(n, s);
+	printf("%s, %zu keys, %d rounds\n", sets[s], n, rounds);
+	for(size_t b = 0; b < nbackends; b++)
+		bench_hash(&backends[b], keys, n, rounds);
+	for(size_t b = 0; b < nbackends; b++)
+		bench_table(&backends[b], keys, n, rounds);
+	for(size_t i = 0; i < n; i++)
+		free(keys[i]);
+	free(keys);
+   }
+   return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdio.h>
+
+#define VERSION "0.0.1"
+
+#define DEFAULT_NREACTORS 0
+
+struct config
+{
+   const char *version;
+   int loglevel;
+   int socket_family;
+   char logpath[0xFF];
+   char hostname[0xFF];
+   char port[0xFF];
+   size_t max_memory;
+   size_t max_request_size;
+   int stats_pub_interval;
+   int tcp_backlog;
+   int accept_batch;
+   int nreactors;
+   int io_backend;
+   int read_budget;
+   size_t outq_hwm;
+   size_t outq_lwm;
+   int outq_max_factor;
+   int outq_drop_qos0;
+   int connect_timeout;
+   int slab_hugepages;
+   size_t clients_hint;
+   int clients_shards;
+   size_t match_cache_size;
+   size_t fanout_chunk;
+   int share_strategy;
+};
+
+extern struct config *conf;
+
+#endif
@@ -0,0 +1,662 @@
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+#include "epoch.h"
+#include "config.h"
+
+
+struct topic *topic_create(const char *name, size_t len)
+{
+   const struct interned *in = topic_intern(name, len);
+   if(!in)
+	   return NULL;
+   struct topic *t = malloc(sizeof(*t));
+   if(!t)
+   {
+	topic_release(in);
+	return NULL;
+   }
+   t->id = in->id;
+   t->name = in->name;
+   t->subscribers = NULL;
+   t->groups = NULL;
+   return t;
+}
+
+/* Gives the interned name back, the topic must be in no trie */
+void topic_free(struct topic *t)
+{
+   topic_release(topic_by_id(t->id));
+   free(t);
+}
+
+/* One allocation, the arrays laid after the struct */
+static struct subscriber_set *subscriber_set_create(size_t capacity)
+{
+   struct subscriber_set *set = malloc(sizeof(*set) + capacity *
+		   (sizeof(uint64_t) + sizeof(unsigned short) + 2));
+   if(!set)
+	   return NULL;
+   set->len = 0;
+   set->capacity = capacity;
+   set->handles = (uint64_t *)(set + 1);
+   set->reactors = (unsigned short *)(set->handles + capacity);
+   set->qos = (unsigned char *)(set->reactors + capacity);
+   set->flags = set->qos + capacity;
+   return set;
+}
+
+static void subscriber_set_copy(struct subscriber_set *dst,
+				const struct subscriber_set *src)
+{
+   memcpy(dst->handles, src->handles, src->len * sizeof(*src->handles));
+   memcpy(dst->reactors, src->reactors, src->len * sizeof(*src->reactors));
+   memcpy(dst->qos, src->qos, src->len);
+   memcpy(dst->flags, src->flags, src->len);
+   dst->len = src->len;
+}
+
+static void subscriber_set_publish(struct subscriber_set **setp,
+				   struct subscriber_set *set)
+{
+   struct subscriber_set *old = *setp;
+   __atomic_store_n(setp, set, __ATOMIC_RELEASE);
+   if(old)
+	   epoch_retire(old, free);
+}
+
+static long long subscriber_set_find(const struct subscriber_set *set,
+				     uint64_t handle)
+{
+   for(size_t i = 0; set && i < set->len; i++)
+	   if(set->handles[i] == handle)
+		   return i;
+   return -1;
+}
+
+/*
+ * Subscribing again to the same filter only updates QoS and flags; 1 is
+ * returned when that leaves the set as it was. To be called with
+ * topics_lock held.
+ */
+int subscriber_set_add(struct subscriber_set **setp, const struct subscriber *sub)
+{
+   struct subscriber_set *set = *setp;
+   long long i = subscriber_set_find(set, sub->client->handle);
+   if(i >= 0 && set->qos[i] == sub->qos && set->flags[i] == sub->flags)
+	   return 1;
+
+   if(i < 0 && set && set->len < set->capacity)
+   {
+	i = set->len;
+	set->handles[i] = sub->client->handle;
+	set->reactors[i] = sub->client->reactor;
+	set->qos[i] = sub->qos;
+	set->flags[i] = sub->flags;
+	__atomic_store_n(&set->len, set->len + 1, __ATOMIC_RELEASE);
+	return 0;
+   }
+
+   size_t capacity = !set ? 4 : i < 0 ? set->capacity * 2 : set->capacity;
+   struct subscriber_set *copy = subscriber_set_create(capacity);
+   if(!copy)
+	   return -1;
+   if(set)
+	   subscriber_set_copy(copy, set);
+   if(i < 0)
+   {
+	i = copy->len++;
+	copy->handles[i] = sub->client->handle;
+	copy->reactors[i] = sub->client->reactor;
+   }
+   copy->qos[i] = sub->qos;
+   copy->flags[i] = sub->flags;
+   subscriber_set_publish(setp, copy);
+   return 0;
+}
+
+/* The last subscriber is swapped in on a copy, readers never see a move */
+int subscriber_set_del(struct subscriber_set **setp, uint64_t handle)
+{
+   struct subscriber_set *set = *setp;
+   long long i = subscriber_set_find(set, handle);
+   if(i < 0)
+	   return -1;
+   struct subscriber_set *copy = subscriber_set_create(set->capacity);
+   if(!copy)
+	   return -1;
+   subscriber_set_copy(copy, set);
+   size_t last = --copy->len;
+   copy->handles[i] = copy->handles[last];
+   copy->reactors[i] = copy->reactors[last];
+   copy->qos[i] = copy->qos[last];
+   copy->flags[i] = copy->flags[last];
+   subscriber_set_publish(setp, copy);
+   return 0;
+}
+
+/*
+ * Subscriptions of a client, a short list walked on SUBSCRIBE, UNSUBSCRIBE
+ * and disconnection only. To be called with topics_lock held.
+ */
+int sol_client_subscribe(struct sol_client *client,
+			 struct topic *t,
+			 struct share_group *g)
+{
+   for(struct subscription *s = client->subscriptions; s; s = s->next)
+	   if(s->topic == t && s->group == g)
+		   return 0;
+   struct subscription *s = malloc(sizeof(*s));
+   if(!s)
+	   return -1;
+   s->topic = t;
+   s->group = g;
+   s->next = client->subscriptions;
+   client->subscriptions = s;
+   return 0;
+}
+
+void sol_client_unsubscribe(struct sol_client *client,
+			    struct topic *t,
+			    struct share_group *g)
+{
+   for(struct subscription **s = &client->subscriptions; *s; s = &(*s)->next)
+   {
+	if((*s)->topic != t || (*s)->group != g)
+		continue;
+	struct subscription *next = (*s)->next;
+	free(*s);
+	*s = next;
+	return;
+   }
+}
+
+/*
+ * The client is dropped from the subscribers or group of each of its
+ * filters, topics left unused are pruned. The epoch keeps a topic pruned
+ * on the way valid for the subscriptions still to go.
+ */
+void sol_client_unsubscribe_all(struct sol *sol, struct sol_client *client)
+{
+   struct subscription *s = client->subscriptions;
+   epoch_enter();
+   while(s)
+   {
+	struct subscription *next = s->next;
+	subscriber_set_del(s->group ? &s->group->members : &s->topic->subscribers,
+			   client->handle);
+	sol_topic_prune(sol, s->topic);
+	free(s);
+	s = next;
+   }
+   epoch_exit();
+   client->subscriptions = NULL;
+}
+
+/*
+ * Split "$share/<group>/<filter>" into its group name and the offset of
+ * filter. Returns 1 for a shared filter, 0 for a plain one and -1 when
+ * malformed: empty group or filter, or a wildcard in the group name.
+ */
+int share_filter_parse(const char *filter,
+		       size_t len,
+		       const char **group,
+		       size_t *grouplen,
+		       size_t *offset)
+{
+   if(len < SHARE_PREFIX_LEN ||
+		   memcmp(filter, SHARE_PREFIX, SHARE_PREFIX_LEN) != 0)
+	   return 0;
+   const char *name = filter + SHARE_PREFIX_LEN;
+   const char *end = memchr(name, '/', len - SHARE_PREFIX_LEN);
+   if(!end || end == name || (size_t)(end - filter) + 1 >= len)
+	   return -1;
+   for(const char *c = name; c < end; c++)
+	   if(*c == '+' || *c == '#')
+		   return -1;
+   *group = name;
+   *grouplen = end - name;
+   *offset = end - filter + 1;
+   return 1;
+}
+
+/*
+ * Groups have names of their own, apart from topic names: the same
+ * group name on two filters makes two unrelated groups.
+ */
+struct share_group *topic_share_group_find(const struct topic *t,
+					   const char *name,
+					   size_t len)
+{
+   for(struct share_group *g = __atomic_load_n(&t->groups, __ATOMIC_ACQUIRE);
+		   g; g = g->next)
+	   if(g->namelen == len && memcmp(g->name, name, len) == 0)
+		   return g;
+   return NULL;
+}
+
+/*
+ * Group name of t, created on first use with strategy, or the configured
+ * one when negative. To be called with topics_lock held.
+ */
+struct share_group *topic_share_group(struct topic *t,
+				      const char *name,
+				      size_t len,
+				      int strategy)
+{
+   struct share_group *g = topic_share_group_find(t, name, len);
+   if(g)
+	   return g;
+
+   g = calloc(1, sizeof(*g) + len + 1);
+   if(!g)
+	   return NULL;
+   memcpy(g->name, name, len);
+   g->namelen = len;
+   g->strategy = strategy >= 0 ? strategy : conf->share_strategy;
+   g->next = t->groups;
+   __atomic_store_n(&t->groups, g, __ATOMIC_RELEASE);
+   return g;
+}
+
+static __thread uint64_t pick_seed = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t pick_random(void)
+{
+   pick_seed ^= pick_seed << 13;
+   pick_seed ^= pick_seed >> 7;
+   pick_seed ^= pick_seed << 17;
+   return pick_seed;
+}
+
+/*
+ * Member of g to send a message on topic to; -1 if no member is left.
+ * Sticky hashing keeps a topic on the same member as long as membership
+ * does not change. A member whose connection is gone, but not yet
+ * removed from the group, is passed over for the next one.
+ */
+int share_group_pick(struct share_group *g,
+		     const struct interned *topic,
+		     share_backlog_fn *backlog,
+		     struct share_pick *pick)
+{
+   int rc = -1;
+
+   epoch_enter();
+   const struct subscriber_set *set =
+	   __atomic_load_n(&g->members, __ATOMIC_ACQUIRE);
+   size_t len = set ? __atomic_load_n(&set->len, __ATOMIC_ACQUIRE) : 0;
+   if(len == 0)
+	   goto out;
+
+   size_t i;
+   if(g->strategy == SHARE_STICKY)
+	   i = topic->hash % len;
+   else if(g->strategy == SHARE_LEAST_QUEUE && len > 1)
+   {
+	uint64_t r = pick_random();
+	size_t a = r % len;
+	size_t b = (r >> 32) % len;
+	i = backlog(set->handles[b]) < backlog(set->handles[a]) ? b : a;
+   }
+   else
+	   i = __atomic_fetch_add(&g->cursor, 1, __ATOMIC_RELAXED) % len;
+
+   size_t tries = 0;
+   while(backlog(set->handles[i]) == SIZE_MAX)
+   {
+	if(++tries == len)
+		goto out;
+	i = (i + 1) % len;
+   }
+
+   pick->handle = set->handles[i];
+   pick->reactor = set->reactors[i];
+   pick->qos = set->qos[i];
+   rc = 0;
+
+out:
+   epoch_exit();
+   return rc;
+}
+
+/*
+ * Topics are stored under their name, which may be a wildcard filter. To
+ * be called with topics_lock held. Returns -1 when t could not be
+ * inserted, it is then left to the caller.
+ */
+int sol_topic_put(struct sol *sol, struct topic *t)
+{
+   const struct interned *in = topic_by_id(t->id);
+   void **slot = trie_insert(&sol->topics, in->name, in->len);
+   if(!slot)
+	   return -1;
+   __atomic_store_n(slot, t, __ATOMIC_RELEASE);
+   sol_topics_changed(sol);
+   return 0;
+}
+
+/* Reclaimed along with the last subscriber set, the name goes back too */
+static void topic_destroy(void *ptr)
+{
+   struct topic *t = ptr;
+   free(t->subscribers);
+   topic_free(t);
+}
+
+static void share_group_destroy(void *ptr)
+{
+   struct share_group *g = ptr;
+   free(g->members);
+   free(g);
+}
+
+/*
+ * Unlink the groups of t left without members. Cached matches may still
+ * point to them: the generation moves before they are retired, so a
+ * reader inside an epoch either sees them whole or rebuilds its entry.
+ */
+static void share_groups_prune(struct sol *sol, struct topic *t)
+{
+   struct share_group **gp = &t->groups;
+   while(*gp)
+   {
+	struct share_group *g = *gp;
+	if(g->members && g->members->len > 0)
+	{
+	   gp = &g->next;
+	   continue;
+	}
+	__atomic_store_n(gp, g->next, __ATOMIC_RELEASE);
+	sol_topics_changed(sol);
+	epoch_retire(g, share_group_destroy);
+   }
+}
+
+static int topic_unused(const struct topic *t)
+{
+   return (!t->subscribers || t->subscribers->len == 0) && !t->groups;
+}
+
+/*
+ * Drop the empty groups of t, then t itself from the trie once no
+ * subscriber and no group is left on it, retiring it along with the trie
+ * nodes it leaves empty; readers inside an epoch keep seeing it whole.
+ * Pruning a topic already gone is a no-op. To be called with
+ * topics_lock held.
+ */
+void sol_topic_prune(struct sol *sol, struct topic *t)
+{
+   share_groups_prune(sol, t);
+   if(!topic_unused(t))
+	   return;
+   size_t len = strlen(t->name);
+   if(trie_find(&sol->topics, t->name, len) != t ||
+		   trie_remove(&sol->topics, t->name, len) < 0)
+	   return;
+   epoch_retire(t, topic_destroy);
+}
+
+struct topic *sol_topic_get(struct sol *sol, const char *name, size_t len)
+{
+   return trie_find(&sol->topics, name, len);
+}
+
+struct topic_match
+{
+   void (*func)(struct topic *, void *);
+   void *arg;
+};
+
+static void topic_matched(void *data, void *arg)
+{
+   struct topic_match *m = arg;
+   m->func(data, m->arg);
+}
+
+/*
+ * Every topic whose filter matches the published name, wildcards included.
+ * Must be called inside an epoch.
+ */
+void sol_topic_match(struct sol *sol,
+		     const char *name,
+		     size_t len,
+		     void (*func)(struct topic *, void *),
+		     void *arg)
+{
+   struct topic_match m = { .func = func, .arg = arg };
+   trie_match(&sol->topics, name, len, topic_matched, &m);
+}
+
+/*
+ * To be called on every change to a subscriber set by SUBSCRIBE or
+ * UNSUBSCRIBE. Disconnections need not: a closed connection handle no
+ * longer resolves, cached matches simply skip it.
+ */
+void sol_topics_changed(struct sol *sol)
+{
+   __atomic_add_fetch(&sol->topics_gen, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Direct mapped, one cache per reactor thread so lookups take no lock;
+ * a stale or colliding entry is simply rebuilt in place.
+ */
+struct match_cache
+{
+   struct match_entry *entries;
+   size_t mask;
+};
+
+static __thread struct match_cache match_cache;
+
+struct match_collect
+{
+   int reactor;
+   uint64_t *handles;
+   unsigned char *qos;
+   size_t nsubs;
+   size_t capacity;
+   int ntopics;
+   uint64_t reactors;
+   struct share_group **groups;
+   size_t ngroups;
+   size_t groups_capacity;
+};
+
+static void collect_groups(struct topic *t, struct match_collect *c)
+{
+   for(struct share_group *g = __atomic_load_n(&t->groups, __ATOMIC_ACQUIRE);
+		   g; g = g->next)
+   {
+	if(c->ngroups == c->groups_capacity)
+	{
+	   size_t capacity = c->groups_capacity ? c->groups_capacity * 2 : 4;
+	   struct share_group **groups =
+		   realloc(c->groups, capacity * sizeof(*groups));
+	   if(!groups)
+		   return;
+	   c->groups = groups;
+	   c->groups_capacity = capacity;
+	}
+	c->groups[c->ngroups++] = g;
+   }
+}
+
+static void collect_subscribers(struct topic *t, void *arg)
+{
+   struct match_collect *c = arg;
+   const struct subscriber_set *set =
+	   __atomic_load_n(&t->subscribers, __ATOMIC_ACQUIRE);
+   c->ntopics++;
+   collect_groups(t, c);
+   if(!set)
+	   return;
+   size_t len = __atomic_load_n(&set->len, __ATOMIC_ACQUIRE);
+   for(size_t i = 0; i < len; i++)
+   {
+	c->reactors |= MATCH_REACTOR(set->reactors[i]);
+	if(set->reactors[i] != c->reactor)
+		continue;
+	if(c->nsubs == c->capacity)
+	{
+	   size_t capacity = c->capacity ? c->capacity * 2 : 8;
+	   uint64_t *handles =
+		   realloc(c->handles, capacity * sizeof(*handles));
+	   if(handles)
+		   c->handles = handles;
+	   unsigned char *qos = realloc(c->qos, capacity);
+	   if(qos)
+		   c->qos = qos;
+	   if(!handles || !qos)
+		   return;
+	   c->capacity = capacity;
+	}
+	c->handles[c->nsubs] = set->handles[i];
+	c->qos[c->nsubs] = set->qos[i];
+	c->nsubs++;
+   }
+}
+
+struct match_pair
+{
+   uint64_t handle;
+   unsigned char qos;
+};
+
+static int match_pair_cmp(const void *a, const void *b)
+{
+   const struct match_pair *pa = a, *pb = b;
+   if(pa->handle != pb->handle)
+	   return pa->handle < pb->handle ? -1 : 1;
+   return 0;
+}
+
+/*
+ * A client matched by several filters gets the message once, at max QoS.
+ * Duplicates only exist with overlapping filters, the common case of a
+ * single matching topic is returned as is.
+ */
+static size_t dedup_subscribers(uint64_t *handles,
+				unsigned char *qos,
+				size_t nsubs,
+				int ntopics)
+{
+   if(ntopics < 2 || nsubs < 2)
+	   return nsubs;
+
+   struct match_pair *pairs = malloc(nsubs * sizeof(*pairs));
+   if(!pairs)
+	   return nsubs;
+   for(size_t i = 0; i < nsubs; i++)
+   {
+	pairs[i].handle = handles[i];
+	pairs[i].qos = qos[i];
+   }
+   qsort(pairs, nsubs, sizeof(*pairs), match_pair_cmp);
+
+   size_t n = 0;
+   for(size_t i = 0; i < nsubs; i++)
+   {
+	if(n > 0 && pairs[i].handle == handles[n - 1])
+	{
+	   if(pairs[i].qos > qos[n - 1])
+		   qos[n - 1] = pairs[i].qos;
+	   continue;
+	}
+	handles[n] = pairs[i].handle;
+	qos[n] = pairs[i].qos;
+	n++;
+   }
+   free(pairs);
+   return n;
+}
+
+struct match_subs *match_subs_create(size_t nsubs)
+{
+   struct match_subs *subs =
+	   malloc(sizeof(*subs) + nsubs * (sizeof(uint64_t) + 1));
+   if(!subs)
+	   return NULL;
+   subs->refs = 1;
+   subs->nsubs = nsubs;
+   subs->qos = (unsigned char *) (subs->handles + nsubs);
+   return subs;
+}
+
+struct match_subs *match_subs_ref(struct match_subs *subs)
+{
+   __atomic_add_fetch(&subs->refs, 1, __ATOMIC_RELAXED);
+   return subs;
+}
+
+void match_subs_release(struct match_subs *subs)
+{
+   if(subs && __atomic_sub_fetch(&subs->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	   free(subs);
+}
+
+static int match_cache_init(struct match_cache *cache)
+{
+   size_t size = MATCH_CACHE_SIZE;
+   if(conf->match_cache_size > 0)
+	   for(size = 1; size < conf->match_cache_size; size *= 2)
+		   ;
+   cache->entries = calloc(size, sizeof(*cache->entries));
+   if(!cache->entries)
+	   return -1;
+   cache->mask = size - 1;
+   return 0;
+}
+
+/*
+ * Takes no lock, a miss walks the trie inside an epoch. *hit tells
+ * whether the entry came from the cache; NULL is returned if it could not
+ * be built.
+ */
+const struct match_entry *sol_topic_match_cached(struct sol *sol,
+						 const struct interned *topic,
+						 int reactor,
+						 int *hit)
+{
+   struct match_cache *cache = &match_cache;
+   if(!cache->entries && match_cache_init(cache) < 0)
+	   return NULL;
+
+   unsigned long long gen = __atomic_load_n(&sol->topics_gen, __ATOMIC_ACQUIRE);
+   unsigned long long reclaim_gen = topic_reclaim_gen();
+   struct match_entry *e = &cache->entries[topic->id & cache->mask];
+
+   *hit = e->id == topic->id && e->gen == gen && e->reclaim_gen == reclaim_gen;
+   if(*hit)
+	   return e;
+
+   struct match_collect c = { .reactor = reactor };
+   epoch_enter();
+   sol_topic_match(sol, topic->name, topic->len, collect_subscribers, &c);
+   epoch_exit();
+
+   size_t nsubs = dedup_subscribers(c.handles, c.qos, c.nsubs, c.ntopics);
+   struct match_subs *subs = NULL;
+   if(nsubs > 0 && (subs = match_subs_create(nsubs)) != NULL)
+   {
+	memcpy(subs->handles, c.handles, nsubs * sizeof(uint64_t));
+	memcpy(subs->qos, c.qos, nsubs);
+   }
+   free(c.handles);
+   free(c.qos);
+
+   match_subs_release(e->subs);
+   free(e->groups);
+   e->groups = c.groups;
+   e->ngroups = c.ngroups;
+   e->id = topic->id;
+   e->gen = gen;
+   e->reclaim_gen = reclaim_gen;
+   e->subs = subs;
+   e->reactors = c.reactors;
+   /* Not cached, the next lookup tries again */
+   if(nsubs > 0 && !subs)
+	   e->id = 0;
+   return e;
+}
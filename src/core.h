@@ -0,0 +1,206 @@
+#ifndef CORE_H
+#define CORE_H
+
+#include <pthread.h>
+#include "hashtable.h"
+#include "trie.h"
+#include "intern.h"
+
+struct closure;
+
+/*
+ * Subscribers of a topic as parallel arrays, so a fan-out walks them
+ * linearly. A subscriber is named by the (fd, gen) handle of its
+ * connection (see CONN_HANDLE in network.h), resolved through the
+ * connection table at delivery.
+ *
+ * Sets are read without lock: a new subscriber is appended in place when
+ * there is room, len being raised after the entry is written; any other
+ * change builds a new set, published on the topic, the old one retired
+ * through the epoch.
+ */
+struct subscriber_set
+{
+   size_t len;
+   size_t capacity;
+   uint64_t *handles;
+   unsigned short *reactors;
+   unsigned char *qos;
+   unsigned char *flags;
+};
+
+/*
+ * Shared subscriptions, "$share/<group>/<filter>": each message matching
+ * filter goes to a single member of the group, picked in O(1) by the
+ * group strategy. Least queue picks the less backlogged of two random
+ * members. Groups hang off the topic of their filter and are retired
+ * through the epoch once their last member leaves, members follow the
+ * subscriber set rules above. A subscription is in either the
+ * subscribers of its topic or the members of a group.
+ */
+#define SHARE_PREFIX "$share/"
+#define SHARE_PREFIX_LEN 7
+
+#define SHARE_ROUND_ROBIN 0
+#define SHARE_LEAST_QUEUE 1
+#define SHARE_STICKY 2
+
+struct share_group
+{
+   int strategy;
+   unsigned long cursor;
+   struct subscriber_set *members;
+   struct share_group *next;
+   size_t namelen;
+   char name[];
+};
+
+/* name is the interned copy, shared with every other user of the topic */
+struct topic
+{
+   unsigned id;
+   const char *name;
+   struct subscriber_set *subscribers;
+   struct share_group *groups;
+};
+
+/*
+ * A filter a client is subscribed to, kept to unsubscribe it on
+ * disconnect; group is set for a shared one.
+ */
+struct subscription
+{
+   struct topic *topic;
+   struct share_group *group;
+   struct subscription *next;
+};
+
+struct sol_client
+{
+   char *client_id;
+   int fd;
+   int reactor;	/* index of the reactor thread owning fd */
+   uint64_t handle;
+   struct closure *closure;
+   struct subscription *subscriptions;
+};
+
+struct subscriber
+{
+   unsigned qos;
+   unsigned flags;
+   struct sol_client *client;
+};
+
+/*
+ * clients is shared by every reactor thread and sharded, each shard with
+ * its own lock; topics is read on every PUBLISH without lock, inside an
+ * epoch, while writers (SUBSCRIBE, UNSUBSCRIBE) are serialized by
+ * topics_lock.
+ */
+struct sol
+{
+   ShardedHashTable *clients;
+   Trie topics;
+   pthread_mutex_t topics_lock;
+   unsigned long long topics_gen;
+};
+
+/*
+ * Subscribers resolved for a concrete topic name, cached per thread and
+ * valid as long as gen matches sol.topics_gen, which SUBSCRIBE and
+ * UNSUBSCRIBE bump; handles of connections closed meanwhile stay in until
+ * then and fail to resolve at delivery. Only the subscribers owned by the
+ * caller reactor are kept, one per client with the highest QoS of its
+ * matching filters.
+ * Entries are keyed by interned topic id, so a lookup is an integer compare;
+ * reclaim_gen tells whether the id may since have gone to another name.
+ * reactors has bit r % 64 set when reactor r owns a matching subscriber,
+ * so that a PUBLISH only wakes the reactors it has something for.
+ */
+#define MATCH_CACHE_SIZE 4096
+
+#define MATCH_REACTOR(r) (1ULL << ((r) % 64))
+
+/*
+ * Subscriber handles and their QoS, in a single allocation. Reference
+ * counted so that a fan-out sent a chunk at a time keeps reading them
+ * after the cache entry they came from has been rebuilt.
+ */
+struct match_subs
+{
+   int refs;
+   size_t nsubs;
+   unsigned char *qos;
+   uint64_t handles[];
+};
+
+struct match_entry
+{
+   unsigned id;
+   unsigned long long gen;
+   unsigned long long reclaim_gen;
+   struct match_subs *subs;	/* NULL when no subscriber matched */
+   uint64_t reactors;
+   struct share_group **groups;	/* whatever the reactor of their members */
+   size_t ngroups;
+};
+
+/* Queued bytes of a subscriber, SIZE_MAX when it is gone */
+typedef size_t share_backlog_fn(uint64_t);
+
+struct share_pick
+{
+   uint64_t handle;
+   unsigned short reactor;
+   unsigned char qos;
+};
+
+struct topic *topic_create(const char *, size_t);
+
+void topic_free(struct topic *);
+
+int subscriber_set_add(struct subscriber_set **, const struct subscriber *);
+
+int subscriber_set_del(struct subscriber_set **, uint64_t);
+
+int sol_client_subscribe(struct sol_client *, struct topic *,
+			 struct share_group *);
+
+void sol_client_unsubscribe(struct sol_client *, struct topic *,
+			    struct share_group *);
+
+void sol_client_unsubscribe_all(struct sol *, struct sol_client *);
+
+int share_filter_parse(const char *, size_t, const char **, size_t *, size_t *);
+
+struct share_group *topic_share_group_find(const struct topic *,
+					   const char *, size_t);
+
+struct share_group *topic_share_group(struct topic *, const char *, size_t, int);
+
+int share_group_pick(struct share_group *, const struct interned *,
+		     share_backlog_fn *, struct share_pick *);
+
+int sol_topic_put(struct sol *, struct topic *);
+
+struct topic *sol_topic_get(struct sol *, const char *, size_t);
+
+void sol_topic_prune(struct sol *, struct topic *);
+
+void sol_topic_match(struct sol *, const char *, size_t,
+		     void (*)(struct topic *, void *), void *);
+
+void sol_topics_changed(struct sol *);
+
+struct match_subs *match_subs_create(size_t);
+
+struct match_subs *match_subs_ref(struct match_subs *);
+
+void match_subs_release(struct match_subs *);
+
+const struct match_entry *sol_topic_match_cached(struct sol *,
+						 const struct interned *,
+						 int, int *);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "epoch.h"
+
+
+/*
+ * A thread announces the global epoch it entered with, shifted left with
+ * the low bit set, and 0 when outside of any critical section. Records
+ * are never unlinked, a thread going away simply leaves its own at 0.
+ */
+struct epoch_record
+{
+   unsigned long long epoch;
+   int nesting;
+   struct epoch_record *next;
+} __attribute__((aligned(64)));
+
+struct retired
+{
+   void *ptr;
+   void (*free)(void *);
+   struct retired *next;
+};
+
+static unsigned long long global_epoch;
+static struct epoch_record *records;
+
+/* Objects retired in epoch e wait on limbo[e % EPOCH_LISTS] */
+static struct retired *limbo[EPOCH_LISTS];
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct epoch_record *record;
+
+static struct epoch_record *epoch_register(void)
+{
+   /* calloc only guarantees max_align_t, records take a cache line each */
+   struct epoch_record *r = aligned_alloc(__alignof__(*r), sizeof(*r));
+   if(!r)
+	   return NULL;
+   memset(r, 0, sizeof(*r));
+   r->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+   while(!__atomic_compare_exchange_n(&records, &r->next, r, 0,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	   ;
+   return r;
+}
+
+/* Critical sections nest, only the outermost one is announced */
+void epoch_enter(void)
+{
+   if(!record)
+	   record = epoch_register();
+   if(!record)
+	   abort();
+   if(record->nesting++ > 0)
+	   return;
+   unsigned long long e = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+   __atomic_store_n(&record->epoch, e << 1 | 1, __ATOMIC_RELAXED);
+   /* The announcement must be visible before any shared read */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void)
+{
+   if(--record->nesting > 0)
+	   return;
+   __atomic_store_n(&record->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static void limbo_free(struct retired *r)
+{
+   struct retired *next;
+   for(; r; r = next)
+   {
+	next = r->next;
+	r->free(r->ptr);
+	free(r);
+   }
+}
+
+/*
+ * The global epoch moves forward only once every thread in a critical
+ * section announced the current one; objects retired two epochs before
+ * the new one can no longer be reached and are freed.
+ */
+static void epoch_try_advance(void)
+{
+   unsigned long long e = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   for(struct epoch_record *r = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+		   r; r = r->next)
+   {
+	unsigned long long local = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+	if((local & 1) && local >> 1 != e)
+		return;
+   }
+
+   __atomic_store_n(&global_epoch, e + 1, __ATOMIC_RELEASE);
+   struct retired *stale = limbo[(e + 1) % EPOCH_LISTS];
+   limbo[(e + 1) % EPOCH_LISTS] = NULL;
+   limbo_free(stale);
+}
+
+/*
+ * To be called once the object is unreachable from the shared structure;
+ * without memory to track it, it is leaked rather than freed too early.
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *))
+{
+   struct retired *r = malloc(sizeof(*r));
+   if(!r)
+	   return;
+   r->ptr = ptr;
+   r->free = free_fn;
+
+   pthread_mutex_lock(&limbo_lock);
+   unsigned long long e = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+   r->next = limbo[e % EPOCH_LISTS];
+   limbo[e % EPOCH_LISTS] = r;
+   epoch_try_advance();
+   pthread_mutex_unlock(&limbo_lock);
+}
+
+/* Free what can be freed, meant to be called periodically by writers */
+void epoch_reclaim(void)
+{
+   pthread_mutex_lock(&limbo_lock);
+   epoch_try_advance();
+   pthread_mutex_unlock(&limbo_lock);
+}
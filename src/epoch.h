@@ -0,0 +1,24 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdio.h>
+
+/*
+ * Epoch based reclamation for the read-mostly shared structures. Readers
+ * bracket their accesses with epoch_enter and epoch_exit, taking no lock;
+ * writers unlink an object, publish the new version with a release store
+ * and hand the old one to epoch_retire. It is freed once every thread
+ * inside a critical section has moved past the epoch it was retired in,
+ * that is two epochs later.
+ */
+#define EPOCH_LISTS 3
+
+void epoch_enter(void);
+
+void epoch_exit(void);
+
+void epoch_retire(void *, void (*)(void *));
+
+void epoch_reclaim(void);
+
+#endif
@@ -3,96 +3,329 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include <pthread.h>
 #include "util.h"
 #include "hashtable.h"
 
-struct hashtable 
+/*
+ * Control bytes: EMPTY and DELETED have the high bit set, a full slot
+ * stores the low 7 bits of its hash. The first HASHTABLE_GROUP control
+ * bytes are mirrored past the end so a group load never wraps.
+ */
+#define CTRL_EMPTY   ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+/*
+ * While growing, the table is made of two arrays: entries migrate from
+ * the old one (tabs[0]) to the new one (tabs[1]) a few slots at a time,
+ * on every operation, so no single put pays for the whole resize.
+ * Lookups and deletes check both, puts only go to the new one.
+ */
+struct htab
 {
    size_t table_size;
    size_t size;
-   int (*destructor)(struct hashtable_entry *);
+   size_t growth_left;
+   int8_t *ctrl;
    struct hashtable_entry *entries;
 };
 
-const int INITIAL_SIZE = 4;
-const int MAX_CHAIN_LENGTH = 8;
-const unsigned long KNUTH_PRIME = 2654435761;
-static unsigned long crc32(const uint8_t *, unsigned int);
+struct hashtable 
+{
+   struct htab tabs[2];
+   long long rehash_idx;
+   hashtable_hash_fn *hash;
+   int (*destructor)(struct hashtable_entry *);
+};
 
+const int INITIAL_SIZE = HASHTABLE_GROUP;
+/*
+ * Hash functions read keys a 64 bit word at a time, the tail is loaded
+ * into a zeroed word.
+ */
+static inline uint64_t load_word(const char *p)
+{
+   uint64_t w;
+   memcpy(&w, p, sizeof(w));
+   return w;
+}
 
-static uint64_t hashtable_hash_init(HashTable *m, const uint8_t *keystr)
+static inline uint64_t load_tail(const char *p, size_t len)
 {
-   assert(m && keystr);
-   uint64_t key = crc32(keystr, strlen((const char *)keystr));
+   uint64_t w = 0;
+   memcpy(&w, p, len);
+   return w;
+}
 
-   key += (key<<12);
-   key ^= (key >> 22);
-   key += (key << 4);
-   key ^= (key >> 9);
-   key += (key << 10);
-   key ^= (key >> 2);
-   key += (key << 7);
-   key ^= (key >> 12);
+static inline uint64_t mix64(uint64_t h)
+{
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return h;
+}
 
+/* Portable default: multiply-xor over words, murmur3 finalizer */
+uint64_t hashtable_hash_words(const char *key, size_t len)
+{
+   uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+   size_t i = 0;
+   for(; i + 8 <= len; i += 8)
+	   h = (h ^ load_word(key + i)) * 0x9fb21c651e98df25ULL;
+   if(i < len)
+	   h = (h ^ load_tail(key + i, len - i)) * 0x9fb21c651e98df25ULL;
+   return mix64(h);
+}
 
-   key = (key >> 3) * KNUTH_PRIME;
+#if defined(__x86_64__)
+/*
+ * CRC32C of the SSE4.2 crc32 instruction, one 8 byte word per cycle or
+ * so; the 32 bit CRC is spread over 64 bits by the finalizer, h1 and h2
+ * are both taken from it.
+ */
+__attribute__((target("sse4.2")))
+uint64_t hashtable_hash_crc32c(const char *key, size_t len)
+{
+   uint64_t crc = 0xffffffff;
+   size_t i = 0;
+   for(; i + 8 <= len; i += 8)
+	   crc = _mm_crc32_u64(crc, load_word(key + i));
+   if(i < len)
+	   crc = _mm_crc32_u64(crc, load_tail(key + i, len - i));
+   return mix64(crc ^ ((uint64_t) len << 32));
+}
+#endif
 
-   return key % m->table_size;
+/* Picked once from the CPU features, unless a table sets its own */
+static hashtable_hash_fn *default_hash(void)
+{
+#if defined(__x86_64__)
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("sse4.2"))
+	   return hashtable_hash_crc32c;
+#endif
+   return hashtable_hash_words;
 }
 
-static int hashtable_hash(HashTable *table, const uint8_t *key)
+static inline size_t h1(uint64_t hash)
 {
-   assert(table && key);
+   return hash >> 7;
+}
 
-   if(table->size >= (table->table_size/2))
-	   return -HASHTABLE_FULL;
+static inline int8_t h2(uint64_t hash)
+{
+   return hash & 0x7F;
+}
 
-   uint64_t curr = hashtable_hash_int(table, key);
-   char *k, *currk;
+/* Load factor of 7/8 */
+static size_t max_load(size_t table_size)
+{
+   return table_size - table_size / 8;
+}
+
+/* Bit i is set when control byte i of the group equals tag */
+static inline uint32_t group_match(const int8_t *group, int8_t tag)
+{
+#ifdef __SSE2__
+   __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+   return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag)));
+#else
+   uint32_t mask = 0;
+   for(int i = 0; i < HASHTABLE_GROUP; i++)
+	   if(group[i] == tag)
+		   mask |= 1U << i;
+   return mask;
+#endif
+}
+
+/* Bit i is set when control byte i of the group is EMPTY or DELETED */
+static inline uint32_t group_match_free(const int8_t *group)
+{
+#ifdef __SSE2__
+   __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+   return _mm_movemask_epi8(ctrl);
+#else
+   uint32_t mask = 0;
+   for(int i = 0; i < HASHTABLE_GROUP; i++)
+	   if(group[i] < 0)
+		   mask |= 1U << i;
+   return mask;
+#endif
+}
+
+static void set_ctrl(struct htab *t, size_t i, int8_t c)
+{
+   t->ctrl[i] = c;
+   if(i < HASHTABLE_GROUP)
+	   t->ctrl[t->table_size + i] = c;
+}
 
-   for(int i = 0; i < MAX_CHAIN_LENGTH; i++)
+static int htab_alloc(struct htab *t, size_t table_size)
+{
+   int8_t *ctrl = malloc(table_size + HASHTABLE_GROUP);
+   struct hashtable_entry *entries = malloc(table_size * sizeof(*entries));
+   if(!ctrl || !entries)
    {
-	if(table->entries[curr].taken == false)
-		return curr;
-	k = (char *)table->entries[curr].key;
-	currk = (char*)key;
-	if(table->entries[curr].taken == true &&
-			STREQ(k, currk, strlen(k)) == true)
-		return curr;
-	curr = (curr + 1) % table->table_size;
-   } 
-   return -HASHTABLE_FULL;
+	free(ctrl);
+	free(entries);
+	return -HASHTABLE_OOM;
+   }
+   memset(ctrl, CTRL_EMPTY, table_size + HASHTABLE_GROUP);
+   t->ctrl = ctrl;
+   t->entries = entries;
+   t->table_size = table_size;
+   t->size = 0;
+   t->growth_left = max_load(table_size);
+   return HASHTABLE_OK;
 }
 
-static int hashtable_rehash(HashTable *table)
+static void htab_free(struct htab *t)
 {
-  assert(table);
-  size_t old_size;
-  struct hashtable_entry *curr;
+   free(t->ctrl);
+   free(t->entries);
+   memset(t, 0, sizeof(*t));
+}
 
-  struct hashtable_entry *temp = calloc(2 * table->table_size, sizeof(*temp));
-  if(!temp)
-	  return -HASHTABLE_ERR;
+/*
+ * Probe sequence: groups at h1, then triangular steps of HASHTABLE_GROUP
+ * slots, which visits every group of a power of two table.
+ */
+static long long htab_find(const struct htab *t,
+			   const char *key,
+			   size_t keylen,
+			   uint64_t hash)
+{
+   size_t mask = t->table_size - 1;
+   size_t pos = h1(hash) & mask;
+   int8_t tag = h2(hash);
 
-  curr = table->entries;
-  table->entries = temp;
+   for(size_t step = HASHTABLE_GROUP; ; step += HASHTABLE_GROUP)
+   {
+	const int8_t *group = t->ctrl + pos;
+	uint32_t match = group_match(group, tag);
+	while(match)
+	{
+	   size_t i = (pos + __builtin_ctz(match)) & mask;
+	   const struct hashtable_entry *e = &t->entries[i];
+	   if(e->hash == hash && e->keylen == keylen &&
+			   memcmp(e->key, key, keylen) == 0)
+		   return i;
+	   match &= match - 1;
+	}
+	if(group_match(group, CTRL_EMPTY))
+		return -1;
+	pos = (pos + step) & mask;
+   }
+}
 
-  old_size = table->table_size;
-  table->table_size = 2 * table->table_size;
-  table->size = 0;
+/* First EMPTY or DELETED slot on the probe sequence of hash */
+static size_t htab_find_free(const struct htab *t, uint64_t hash)
+{
+   size_t mask = t->table_size - 1;
+   size_t pos = h1(hash) & mask;
 
-  int status;
+   for(size_t step = HASHTABLE_GROUP; ; step += HASHTABLE_GROUP)
+   {
+	uint32_t match = group_match_free(t->ctrl + pos);
+	if(match)
+		return (pos + __builtin_ctz(match)) & mask;
+	pos = (pos + step) & mask;
+   }
+}
 
-  for(size_t i = 0; i < old_size; i++)
-  {
-	if(curr[i].taken == false)
+/* Caller checks growth_left, a tombstone is reused for free */
+static void htab_insert(struct htab *t, const struct hashtable_entry *e)
+{
+   size_t i = htab_find_free(t, e->hash);
+   if(t->ctrl[i] == CTRL_EMPTY)
+	   t->growth_left--;
+   set_ctrl(t, i, h2(e->hash));
+   t->entries[i] = *e;
+   t->size++;
+}
+
+/*
+ * A slot can go back to EMPTY only if no probe sequence ever went through
+ * it, that is if the groups around it were never full; otherwise it
+ * becomes a tombstone so lookups keep probing past it.
+ */
+static void htab_erase(struct htab *t, size_t index)
+{
+   size_t mask = t->table_size - 1;
+   size_t before = (index - HASHTABLE_GROUP) & mask;
+   uint32_t empty_after = group_match(t->ctrl + index, CTRL_EMPTY);
+   uint32_t empty_before = group_match(t->ctrl + before, CTRL_EMPTY);
+   int never_full = empty_after && empty_before &&
+	   __builtin_ctz(empty_after) +
+	   __builtin_clz(empty_before << (32 - HASHTABLE_GROUP)) < HASHTABLE_GROUP;
+
+   set_ctrl(t, index, never_full ? CTRL_EMPTY : CTRL_DELETED);
+   if(never_full)
+	   t->growth_left++;
+   t->size--;
+}
+
+static int hashtable_rehashing(const HashTable *table)
+{
+   return table->rehash_idx >= 0;
+}
+
+/*
+ * Move the entries of up to steps slots of the old array, HASHTABLE_OK
+ * once it is empty and released. Stored hashes mean no key is hashed
+ * again.
+ */
+int hashtable_rehash_step(HashTable *table, size_t steps)
+{
+   if(!hashtable_rehashing(table))
+	   return HASHTABLE_OK;
+
+   struct htab *from = &table->tabs[0];
+   struct htab *to = &table->tabs[1];
+   while(steps-- > 0 && (size_t) table->rehash_idx < from->table_size)
+   {
+	size_t i = table->rehash_idx++;
+	if(from->ctrl[i] < 0)
 		continue;
-	if((status = hashtable_put(table, curr[i].key, 
-					curr[i].val)) != HASHTABLE_OK)
-		return status;
-  }
-  free(curr);
-  return HSAHTABLE_OK;
+	htab_insert(to, &from->entries[i]);
+	set_ctrl(from, i, CTRL_DELETED);
+	from->size--;
+   }
+
+   if((size_t) table->rehash_idx < from->table_size)
+	   return -HASHTABLE_FULL;
+
+   htab_free(from);
+   table->tabs[0] = *to;
+   memset(to, 0, sizeof(*to));
+   table->rehash_idx = -1;
+   return HASHTABLE_OK;
+}
+
+/*
+ * Start migrating to twice the size, or to a fresh array of the same size
+ * when most of the used slots are tombstones.
+ */
+static int hashtable_rehash(HashTable *table)
+{
+  assert(table);
+  struct htab *from = &table->tabs[0];
+  size_t new_size = from->table_size;
+  if(from->size > max_load(new_size) / 2)
+	  new_size *= 2;
+
+  if(htab_alloc(&table->tabs[1], new_size) != HASHTABLE_OK)
+	  return -HASHTABLE_OOM;
+  table->rehash_idx = 0;
+  return HASHTABLE_OK;
 }
 
 static int destroy_entry(struct hashtable_entry *entry)
@@ -108,115 +341,173 @@ static int destroy_entry(struct hashtable_entry *entry)
    return HASHTABLE_OK;
 }
 
-HashTable *hashtable_create(int (*destructor)(struct hashtable_entry *))
+/* Smallest power of two table holding capacity entries under max_load */
+static size_t table_size_for(size_t capacity)
+{
+   size_t size = INITIAL_SIZE;
+   while(max_load(size) < capacity)
+	   size *= 2;
+   return size;
+}
+
+HashTable *hashtable_create_sized(int (*destructor)(struct hashtable_entry *),
+				  size_t capacity)
 {
-   HashTable *table = malloc(sizeof(HashTable));
+   HashTable *table = calloc(1, sizeof(HashTable));
    if(!table)
 	   return NULL;
-   table->entries = calloc(INITIAL_SIZE, sizeof(struct hashtable_entry));
 
-   if(!table->entries)
+   if(htab_alloc(&table->tabs[0], table_size_for(capacity)) != HASHTABLE_OK)
    {
-      hashtable_release(table);
+      free(table);
       return NULL;
    }
 
+   table->rehash_idx = -1;
+   table->hash = default_hash();
    table->destructor = destructor ? destructor : destroy_entry;
-   table->table_size = INITIAL_SIZE;
-   table->size = 0;
    return table;
 }
 
-size_t hashtable_size(const HashTable *table)
+HashTable *hashtable_create(int (*destructor)(struct hashtable_entry *))
 {
-  return table->size;
+   return hashtable_create_sized(destructor, 0);
 }
 
-int hashtable_exits(HashTable *table, const char *key)
+/* Only valid on an empty table, stored hashes are not recomputed */
+int hashtable_set_hash(HashTable *table, hashtable_hash_fn *hash)
 {
-   void *ret = hashtable_get(table_key);
-   return !ret ? 0: 1;
+   if(hashtable_size(table) > 0)
+	   return -HASHTABLE_ERR;
+   table->hash = hash ? hash : default_hash();
+   return HASHTABLE_OK;
 }
 
+size_t hashtable_size(const HashTable *table)
+{
+  return table->tabs[0].size + table->tabs[1].size;
+}
 
-int hashtable_put(HashTable *table, const char *key, void val)
+/* Index of key in tabs[*which], -1 when missing */
+static long long hashtable_find(HashTable *table,
+				const char *key,
+				size_t keylen,
+				uint64_t hash,
+				int *which)
 {
-   assert(table && key);
+   hashtable_rehash_step(table, HASHTABLE_REHASH_STEP);
 
-   int index = hashtable_hash(table, (const uint8_t *) key);
-   while(index == _HASHTABLE_FULL)
+   for(*which = 0; *which < 2; (*which)++)
    {
-      if(hashtable_rehash(table) == -HASHTABLE_ERR)
-	      return -HASHTABLE_ERR;
-      index = hashtable_hash(table, (const uint8_t *) key);
+	struct htab *t = &table->tabs[*which];
+	if(t->size == 0)
+		continue;
+	long long index = htab_find(t, key, keylen, hash);
+	if(index >= 0)
+		return index;
    }
+   return -1;
+}
 
-   table->entries[index].val = val;
-   table->entries[index].key = key;
+static int hashtable_put_hashed(HashTable *table,
+				const char *key,
+				size_t keylen,
+				uint64_t hash,
+				void *val)
+{
+   int which;
+   long long index = hashtable_find(table, key, keylen, hash, &which);
+   if(index >= 0)
+   {
+	table->tabs[which].entries[index].key = key;
+	table->tabs[which].entries[index].val = val;
+	return HASHTABLE_OK;
+   }
 
-   if(table->entries[index].taken == false)
+   struct htab *t = &table->tabs[hashtable_rehashing(table)];
+   if(t->growth_left == 0)
    {
-	table->entries[index].taken = true;
-	table->size++;
+	/* Inserts outran the migration, finish it before growing again */
+	while(hashtable_rehash_step(table, SIZE_MAX) != HASHTABLE_OK)
+		;
+	if(hashtable_rehash(table) != HASHTABLE_OK)
+		return -HASHTABLE_OOM;
+	t = &table->tabs[1];
    }
 
-   return HSAHTABLE_OK;
+   struct hashtable_entry e = {
+	   .key = key, .val = val, .hash = hash, .keylen = keylen
+   };
+   htab_insert(t, &e);
+   return HASHTABLE_OK;
+}
+
+static void *hashtable_get_hashed(HashTable *table,
+				  const char *key,
+				  size_t keylen,
+				  uint64_t hash)
+{
+  int which;
+  long long index = hashtable_find(table, key, keylen, hash, &which);
+  return index < 0 ? NULL : table->tabs[which].entries[index].val;
+}
+
+static int hashtable_del_hashed(HashTable *table,
+				const char *key,
+				size_t keylen,
+				uint64_t hash)
+{
+   int which;
+   long long index = hashtable_find(table, key, keylen, hash, &which);
+   if(index < 0)
+	   return -HASHTABLE_ERR;
+
+   struct htab *t = &table->tabs[which];
+   htab_erase(t, index);
+   table->destructor(&t->entries[index]);
+   return HASHTABLE_OK;
+}
+
+int hashtable_put(HashTable *table, const char *key, void *val)
+{
+   assert(table && key);
+   size_t keylen = strlen(key);
+   return hashtable_put_hashed(table, key, keylen,
+			       table->hash(key, keylen), val);
 }
 
 void *hashtable_get(HashTable *table, const char *key)
 {
   assert(table && key);
-  uint64_t curr = hashtable_hash_int(table, (const uint8_t*)key);
-
-  for(int i = 0; i < MAX_CHAIN_LENGTH; i++)
-  {
-     if(table->entries[curr].taken = true)
-     {
-	if(STREQ(table->entries[curr].key, key, strlen(key)) == true)
-		return table->entries[curr].val;
-     }
-     curr = (curr + 1) % table->table_size;
-  }
-  return NULL;
+  size_t keylen = strlen(key);
+  return hashtable_get_hashed(table, key, keylen, table->hash(key, keylen));
 }
 
 int hashtable_del(HashTable *table, const char *key)
 {
    assert(table && key);
-   uint64_t curr = hashtable_hash_int(table, (const uint8_t*) table);
-
-   for(int i = 0; i < MAX_CHAIN_LENGTH; i++)
-   {
-	if(table->entries[curr].taken = true)
-	{
-	   if(STREQ(table->entries[curr].key, key, strlen(key)) == true)
-	   {
-		table->entries[curr].taken = false;
-		table->size--;
-		table->destructor(&table->entries[curr]);
-		return HASHTABLE_OK;
-	   }
-	}
-	curr = (curr + 1) % table->table_size;
-   }
-   return -HASHTABLE_ERR;
+   size_t keylen = strlen(key);
+   return hashtable_del_hashed(table, key, keylen, table->hash(key, keylen));
 }
 
 int hashtable_map(HashTable *table, int (*func)(struct hashtable_entry *))
 {
    assert(func);
 
-   if(!table || table->size <= 0)
+   if(!table || hashtable_size(table) <= 0)
 	   return -HASHTABLE_ERR;
 
-   for(size_t i = 0; i < table->table_size; i++)
+   for(int n = 0; n < 2; n++)
    {
-	if(table->entries[i].taken == true)
+	struct htab *t = &table->tabs[n];
+	for(size_t i = 0; i < t->table_size; i++)
 	{
-	   struct hashtable_entry data = table->entries[i];
-	   int status = func(&data);
-	   if(status != HASHTABLE_OK)
-		   return status;
+	   if(t->ctrl[i] >= 0)
+	   {
+		int status = func(&t->entries[i]);
+		if(status != HASHTABLE_OK)
+			return status;
+	   }
 	}
    }
    return HASHTABLE_OK;
@@ -227,17 +518,20 @@ int hashtable_map2(HashTable *table,
 		void *param)
 {
    assert(func);
-   if(!table || table_size <= 0)
+   if(!table || hashtable_size(table) <= 0)
 	   return -HASHTABLE_ERR;
 
-   for(size_t i = 0; i < table->table_size; i++)
+   for(int n = 0; n < 2; n++)
    {
-	if(table->entries[i].taken == true)
+	struct htab *t = &table->tabs[n];
+	for(size_t i = 0; i < t->table_size; i++)
 	{
-	   struct hashtable_entry data = table->entries[i];
-	   int status = func(&data, param);
-	   if(status != HASHTABLE_OK)
-		   return status;
+	   if(t->ctrl[i] >= 0)
+	   {
+		int status = func(&t->entries[i], param);
+		if(status != HASHTABLE_OK)
+			return status;
+	   }
 	}
    }
    return HASHTABLE_OK;
@@ -248,77 +542,194 @@ void hashtable_release(HashTable *table)
 	if(!table)
 		return;
 	hashtable_map(table, table->destructor);
-	if(!table || !table->entries)
-		return;
-	free(table->entries);
+	htab_free(&table->tabs[0]);
+	htab_free(&table->tabs[1]);
 	free(table);
 }
 
 
+/*
+ * Shared by every reactor thread: a key only ever takes the lock of its
+ * shard, picked by the top bits of its hash, while the low bits place it
+ * inside the shard table. The hash is computed once for both.
+ */
+struct shard
+{
+   pthread_mutex_t lock;
+   HashTable *table;
+} __attribute__((aligned(64)));
 
-static unsigned long crc32_tab[] = {
-	    0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-	        0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-		    0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-		        0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-			    0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-			        0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-				    0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-				        0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-					    0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-					        0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-						    0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-						        0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-							    0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-							        0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-								    0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-								        0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-									    0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-									        0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-										    0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-										        0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-											    0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-											        0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-												    0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-												        0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-													    0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-													        0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-														    0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-														        0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-															    0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-															        0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-																    0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-																        0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-																	    0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-																	        0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-																		    0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-																		        0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-																			    0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-																			        0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-																				    0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-																				        0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-																					    0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-																					        0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-																						    0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-																						        0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-																							    0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-																							        0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-																								    0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-																								        0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-																									    0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-																									        0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-																										    0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-																										        0x2d02ef8dL
+struct sharded_hashtable
+{
+   size_t nshards;
+   int shift;
+   hashtable_hash_fn *hash;
+   struct shard *shards;
 };
 
+ShardedHashTable *sharded_hashtable_create(
+		int (*destructor)(struct hashtable_entry *),
+		size_t nshards,
+		size_t capacity)
+{
+   ShardedHashTable *table = malloc(sizeof(*table));
+   if(!table)
+	   return NULL;
+
+   /* Power of two shards, at least 2 so the shift stays below 64 */
+   size_t n = 2;
+   while(n < nshards)
+	   n *= 2;
+   table->nshards = n;
+   table->shift = 64 - __builtin_ctzll(n);
+   table->hash = default_hash();
+   table->shards = aligned_alloc(64, n * sizeof(struct shard));
+   if(!table->shards)
+   {
+	free(table);
+	return NULL;
+   }
 
-static unsigned long crc32(const uint8_t *s, unsigned int len)
+   for(size_t i = 0; i < n; i++)
+   {
+	pthread_mutex_init(&table->shards[i].lock, NULL);
+	table->shards[i].table =
+		hashtable_create_sized(destructor, capacity / n);
+	if(!table->shards[i].table)
+	{
+	   table->nshards = i;
+	   sharded_hashtable_release(table);
+	   return NULL;
+	}
+	table->shards[i].table->hash = table->hash;
+   }
+   return table;
+}
+
+void sharded_hashtable_release(ShardedHashTable *table)
 {
-	unsigned int i;
-	uint64_t crc32val;
-	crc32val = 0LL;
-	for(i = 0; i < len; i++)
-		crc32val = crc32_tab[(crc32val ^ s[i]) & 0xff] ^(crc32val >> 8);
-	return crc32val;
+   if(!table)
+	   return;
+   for(size_t i = 0; i < table->nshards; i++)
+   {
+	hashtable_release(table->shards[i].table);
+	pthread_mutex_destroy(&table->shards[i].lock);
+   }
+   free(table->shards);
+   free(table);
+}
+
+static struct shard *shard_of(ShardedHashTable *table, uint64_t hash)
+{
+   return &table->shards[hash >> table->shift];
+}
+
+size_t sharded_hashtable_size(ShardedHashTable *table)
+{
+   size_t size = 0;
+   for(size_t i = 0; i < table->nshards; i++)
+   {
+	pthread_mutex_lock(&table->shards[i].lock);
+	size += hashtable_size(table->shards[i].table);
+	pthread_mutex_unlock(&table->shards[i].lock);
+   }
+   return size;
+}
+
+int sharded_hashtable_put(ShardedHashTable *table, const char *key, void *val)
+{
+   assert(table && key);
+   size_t keylen = strlen(key);
+   uint64_t hash = table->hash(key, keylen);
+   struct shard *shard = shard_of(table, hash);
+
+   pthread_mutex_lock(&shard->lock);
+   int rc = hashtable_put_hashed(shard->table, key, keylen, hash, val);
+   pthread_mutex_unlock(&shard->lock);
+   return rc;
 }
 
+/* Like put, but -HASHTABLE_ERR and nothing stored if key is already there */
+int sharded_hashtable_add(ShardedHashTable *table, const char *key, void *val)
+{
+   assert(table && key);
+   size_t keylen = strlen(key);
+   uint64_t hash = table->hash(key, keylen);
+   struct shard *shard = shard_of(table, hash);
+
+   pthread_mutex_lock(&shard->lock);
+   int rc = -HASHTABLE_ERR;
+   if(!hashtable_get_hashed(shard->table, key, keylen, hash))
+	   rc = hashtable_put_hashed(shard->table, key, keylen, hash, val);
+   pthread_mutex_unlock(&shard->lock);
+   return rc;
+}
+
+/*
+ * The value is returned after the shard lock is released: the caller has
+ * to make sure nobody deletes it meanwhile, or use
+ * sharded_hashtable_apply to work on it under the lock.
+ */
+void *sharded_hashtable_get(ShardedHashTable *table, const char *key)
+{
+   assert(table && key);
+   size_t keylen = strlen(key);
+   uint64_t hash = table->hash(key, keylen);
+   struct shard *shard = shard_of(table, hash);
+
+   pthread_mutex_lock(&shard->lock);
+   void *val = hashtable_get_hashed(shard->table, key, keylen, hash);
+   pthread_mutex_unlock(&shard->lock);
+   return val;
+}
+
+int sharded_hashtable_apply(ShardedHashTable *table,
+			    const char *key,
+			    int (*func)(void *, void *),
+			    void *param)
+{
+   assert(table && key && func);
+   size_t keylen = strlen(key);
+   uint64_t hash = table->hash(key, keylen);
+   struct shard *shard = shard_of(table, hash);
+
+   pthread_mutex_lock(&shard->lock);
+   void *val = hashtable_get_hashed(shard->table, key, keylen, hash);
+   int rc = func(val, param);
+   pthread_mutex_unlock(&shard->lock);
+   return rc;
+}
+
+int sharded_hashtable_del(ShardedHashTable *table, const char *key)
+{
+   assert(table && key);
+   size_t keylen = strlen(key);
+   uint64_t hash = table->hash(key, keylen);
+   struct shard *shard = shard_of(table, hash);
+
+   pthread_mutex_lock(&shard->lock);
+   int rc = hashtable_del_hashed(shard->table, key, keylen, hash);
+   pthread_mutex_unlock(&shard->lock);
+   return rc;
+}
+
+/*
+ * Walk one shard at a time under its own lock, writers to the other
+ * shards never wait for the whole iteration.
+ */
+int sharded_hashtable_map2(ShardedHashTable *table,
+			   int (*func)(struct hashtable_entry *, void *),
+			   void *param)
+{
+   assert(func);
+   int status = HASHTABLE_OK;
+   for(size_t i = 0; i < table->nshards && status == HASHTABLE_OK; i++)
+   {
+	struct shard *shard = &table->shards[i];
+	pthread_mutex_lock(&shard->lock);
+	if(hashtable_size(shard->table) > 0)
+		status = hashtable_map2(shard->table, func, param);
+	pthread_mutex_unlock(&shard->lock);
+   }
+   return status;
+}
@@ -10,30 +10,85 @@
 #define HASHTABLE_OOM  2
 #define HASHTABLE_FULL 3
 
+/*
+ * Open addressing table in the style of Swiss tables: a control byte per
+ * slot holds 7 bits of the key hash (or EMPTY/DELETED), and probing scans
+ * a group of HASHTABLE_GROUP control bytes at once, SSE2 where available.
+ * Full hashes and key lengths are kept in the entries so only tag hits
+ * compare keys, and resizing never hashes a key twice.
+ */
+#define HASHTABLE_GROUP 16
+
+/* Old slots migrated on every operation while the table grows */
+#define HASHTABLE_REHASH_STEP 64
+
 struct hashtable_entry
 {
   const char *key;
   void *val;
-  bool taken;
+  uint64_t hash;
+  size_t keylen;
 };
 
+typedef uint64_t hashtable_hash_fn(const char *, size_t);
+
+uint64_t hashtable_hash_words(const char *, size_t);
+#if defined(__x86_64__)
+uint64_t hashtable_hash_crc32c(const char *, size_t);
+#endif
+
+typedef struct hashtable HashTable;
 
-typedef struct hashtable_entry HashTable;
+HashTable *hashtable_create(int (*destructor)(struct hashtable_entry*));
 
-HashTable *hahstable_create(int (*destructor)(struct hashtable_entry*));
+HashTable *hashtable_create_sized(int (*destructor)(struct hashtable_entry*),
+				  size_t);
 
 void hashtable_release(HashTable *);
 
+int hashtable_set_hash(HashTable *, hashtable_hash_fn *);
+
 size_t hashtable_size(const HashTable *);
 
+int hashtable_put(HashTable *, const char *, void *);
+
 void *hashtable_get(HashTable *, const char *);
 
 int hashtable_del(HashTable *, const char *);
 
+int hashtable_rehash_step(HashTable *, size_t);
+
 int  hashtable_map(HashTable *, int (*func)(struct hashtable_entry *));
 
 int hashtable_map2(HashTable *, 
 		   int (*func)(struct hashtable_entry *, void *), void *);
-#endif
 
+/*
+ * Thread safe variant: N independent tables, each behind its own lock,
+ * a key goes to the shard picked by its hash.
+ */
+#define HASHTABLE_SHARDS 64
+
+typedef struct sharded_hashtable ShardedHashTable;
 
+ShardedHashTable *sharded_hashtable_create(
+		int (*destructor)(struct hashtable_entry *), size_t, size_t);
+
+void sharded_hashtable_release(ShardedHashTable *);
+
+size_t sharded_hashtable_size(ShardedHashTable *);
+
+int sharded_hashtable_put(ShardedHashTable *, const char *, void *);
+
+int sharded_hashtable_add(ShardedHashTable *, const char *, void *);
+
+void *sharded_hashtable_get(ShardedHashTable *, const char *);
+
+int sharded_hashtable_apply(ShardedHashTable *, const char *,
+			    int (*func)(void *, void *), void *);
+
+int sharded_hashtable_del(ShardedHashTable *, const char *);
+
+int sharded_hashtable_map2(ShardedHashTable *,
+			   int (*func)(struct hashtable_entry *, void *), void *);
+#endif
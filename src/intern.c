@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hashtable.h"
+#include "intern.h"
+#include "epoch.h"
+
+
+/*
+ * Names are found through a sharded open addressing set; ids resolve
+ * through pages of INTERN_PAGE_SIZE pointers, allocated on demand and
+ * published with release stores, so topic_by_id takes no lock. Freed
+ * ids wait on a stack for reuse, names are freed through the epoch.
+ */
+struct intern_shard
+{
+   pthread_mutex_t lock;
+   struct interned **slots;
+   size_t size;
+   size_t count;
+} __attribute__((aligned(64)));
+
+static struct intern_shard shards[INTERN_SHARDS] = {
+   [0 ... INTERN_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+static const struct interned **pages[INTERN_MAX_PAGES];
+static pthread_mutex_t pages_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned next_id = 1;
+static unsigned *free_ids;
+static size_t free_ids_len;
+static size_t free_ids_size;
+
+static pthread_mutex_t sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned live;
+static unsigned sweep_at = INTERN_SWEEP_MIN;
+static unsigned long long reclaim_gen;
+
+static struct intern_shard *shard_of(uint64_t hash)
+{
+   return &shards[hash >> 58 & (INTERN_SHARDS - 1)];
+}
+
+static struct interned *shard_find(const struct intern_shard *s,
+				   const char *name,
+				   size_t len,
+				   uint64_t hash)
+{
+   if(s->size == 0)
+	   return NULL;
+   size_t mask = s->size - 1;
+   for(size_t i = hash & mask; s->slots[i]; i = (i + 1) & mask)
+   {
+	struct interned *t = s->slots[i];
+	if(t->hash == hash && t->len == len && memcmp(t->name, name, len) == 0)
+		return t;
+   }
+   return NULL;
+}
+
+static void shard_put(struct intern_shard *s, struct interned *t)
+{
+   size_t mask = s->size - 1;
+   size_t i = t->hash & mask;
+   while(s->slots[i])
+	   i = (i + 1) & mask;
+   s->slots[i] = t;
+   s->count++;
+}
+
+/* Kept under half full, linear probing stays short */
+static int shard_grow(struct intern_shard *s)
+{
+   size_t old_size = s->size;
+   struct interned **old = s->slots;
+   size_t size = old_size ? old_size * 2 : 64;
+
+   s->slots = calloc(size, sizeof(*s->slots));
+   if(!s->slots)
+   {
+	s->slots = old;
+	return -1;
+   }
+   s->size = size;
+   s->count = 0;
+   for(size_t i = 0; i < old_size; i++)
+	   if(old[i])
+		   shard_put(s, old[i]);
+   free(old);
+   return 0;
+}
+
+/* 0 once every id is taken */
+static unsigned id_alloc(void)
+{
+   unsigned id = 0;
+   pthread_mutex_lock(&pages_lock);
+   if(free_ids_len > 0)
+	   id = free_ids[--free_ids_len];
+   else if(next_id < INTERN_MAX_PAGES * INTERN_PAGE_SIZE)
+	   id = next_id++;
+   pthread_mutex_unlock(&pages_lock);
+   return id;
+}
+
+/* The id slot is cleared first, a failure leaves the id unused for good */
+static int id_free(unsigned id)
+{
+   int rc = 0;
+   pthread_mutex_lock(&pages_lock);
+   const struct interned **page = pages[id >> INTERN_PAGE_BITS];
+   if(page)
+	   __atomic_store_n(&page[id & (INTERN_PAGE_SIZE - 1)], NULL,
+			    __ATOMIC_RELEASE);
+   if(free_ids_len == free_ids_size)
+   {
+	size_t size = free_ids_size ? free_ids_size * 2 : 1024;
+	unsigned *ids = realloc(free_ids, size * sizeof(*ids));
+	if(ids)
+	{
+	   free_ids = ids;
+	   free_ids_size = size;
+	}
+	else
+	   rc = -1;
+   }
+   if(rc == 0)
+	   free_ids[free_ids_len++] = id;
+   pthread_mutex_unlock(&pages_lock);
+   return rc;
+}
+
+static int publish_id(const struct interned *t)
+{
+   unsigned page = t->id >> INTERN_PAGE_BITS;
+   if(page >= INTERN_MAX_PAGES)
+	   return -1;
+   if(!__atomic_load_n(&pages[page], __ATOMIC_ACQUIRE))
+   {
+	pthread_mutex_lock(&pages_lock);
+	if(!pages[page])
+	{
+	   const struct interned **p = calloc(INTERN_PAGE_SIZE, sizeof(*p));
+	   __atomic_store_n(&pages[page], p, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pages_lock);
+	if(!pages[page])
+		return -1;
+   }
+   __atomic_store_n(&pages[page][t->id & (INTERN_PAGE_SIZE - 1)], t,
+		    __ATOMIC_RELEASE);
+   return 0;
+}
+
+/*
+ * Unreferenced names of s are freed, survivors moved to a fresh array so
+ * probe sequences stay unbroken; a shard the array cannot be allocated
+ * for is left as it is. Returns how many names were freed.
+ */
+static unsigned shard_sweep(struct intern_shard *s)
+{
+   unsigned freed = 0;
+   pthread_mutex_lock(&s->lock);
+   struct interned **old = s->slots;
+   size_t size = s->size;
+   struct interned **slots = size ? calloc(size, sizeof(*slots)) : NULL;
+   if(!slots)
+	   goto out;
+
+   s->slots = slots;
+   s->count = 0;
+   for(size_t i = 0; i < size; i++)
+   {
+	struct interned *t = old[i];
+	if(!t)
+		continue;
+	if(__atomic_load_n(&t->refs, __ATOMIC_ACQUIRE) == 0)
+	{
+	   /* Whatever is keyed by id moves on before the id is handed out again */
+	   if(freed == 0)
+		   __atomic_add_fetch(&reclaim_gen, 1, __ATOMIC_RELEASE);
+	   if(id_free(t->id) == 0)
+	   {
+		epoch_retire(t, free);
+		freed++;
+		continue;
+	   }
+	}
+	shard_put(s, t);
+   }
+   free(old);
+
+out:
+   pthread_mutex_unlock(&s->lock);
+   return freed;
+}
+
+/*
+ * One sweep at a time; a thread finding one just done has nothing left
+ * to do unless it ran out of ids.
+ */
+static void topic_sweep(int force)
+{
+   pthread_mutex_lock(&sweep_lock);
+   if(force || __atomic_load_n(&live, __ATOMIC_RELAXED) >= sweep_at)
+   {
+	unsigned freed = 0;
+	for(int i = 0; i < INTERN_SHARDS; i++)
+		freed += shard_sweep(&shards[i]);
+	unsigned n = __atomic_sub_fetch(&live, freed, __ATOMIC_RELAXED);
+	__atomic_store_n(&sweep_at, n * 2 > INTERN_SWEEP_MIN ?
+			 n * 2 : INTERN_SWEEP_MIN, __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&sweep_lock);
+}
+
+/* No reference is taken, the name may be swept as soon as it is returned */
+const struct interned *topic_lookup(const char *name, size_t len)
+{
+   uint64_t hash = hashtable_hash_words(name, len);
+   struct intern_shard *s = shard_of(hash);
+   pthread_mutex_lock(&s->lock);
+   const struct interned *t = shard_find(s, name, len, hash);
+   pthread_mutex_unlock(&s->lock);
+   return t;
+}
+
+static struct interned *intern_create(struct intern_shard *s,
+				      const char *name,
+				      size_t len,
+				      uint64_t hash)
+{
+   if(s->count * 2 >= s->size && shard_grow(s) < 0)
+	   return NULL;
+
+   struct interned *t = malloc(sizeof(*t) + len + 1);
+   if(!t)
+	   return NULL;
+   t->refs = 1;
+   t->len = len;
+   t->hash = hash;
+   memcpy(t->name, name, len);
+   t->name[len] = '\0';
+   t->id = id_alloc();
+   if(t->id == 0 || publish_id(t) < 0)
+   {
+	if(t->id)
+		id_free(t->id);
+	free(t);
+	return NULL;
+   }
+   shard_put(s, t);
+   __atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
+   return t;
+}
+
+/*
+ * Referenced id and shared copy of name, created on first use. NULL when
+ * out of memory or out of ids, even after sweeping the unreferenced names.
+ */
+const struct interned *topic_intern(const char *name, size_t len)
+{
+   uint64_t hash = hashtable_hash_words(name, len);
+   struct intern_shard *s = shard_of(hash);
+
+   if(__atomic_load_n(&live, __ATOMIC_RELAXED) >=
+		   __atomic_load_n(&sweep_at, __ATOMIC_RELAXED))
+	   topic_sweep(0);
+
+   for(int swept = 0; ; swept++)
+   {
+	pthread_mutex_lock(&s->lock);
+	struct interned *t = shard_find(s, name, len, hash);
+	if(t)
+		__atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+	else
+		t = intern_create(s, name, len, hash);
+	pthread_mutex_unlock(&s->lock);
+	if(t || swept)
+		return t;
+	topic_sweep(1);
+   }
+}
+
+/* Only for a caller already holding a reference */
+void topic_ref(const struct interned *t)
+{
+   __atomic_add_fetch(&((struct interned *) t)->refs, 1, __ATOMIC_RELAXED);
+}
+
+void topic_release(const struct interned *t)
+{
+   if(t)
+	   __atomic_sub_fetch(&((struct interned *) t)->refs, 1, __ATOMIC_RELEASE);
+}
+
+const struct interned *topic_by_id(unsigned id)
+{
+   unsigned page = id >> INTERN_PAGE_BITS;
+   if(page >= INTERN_MAX_PAGES)
+	   return NULL;
+   const struct interned **p = __atomic_load_n(&pages[page], __ATOMIC_ACQUIRE);
+   if(!p)
+	   return NULL;
+   return __atomic_load_n(&p[id & (INTERN_PAGE_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
+unsigned long long topic_reclaim_gen(void)
+{
+   return __atomic_load_n(&reclaim_gen, __ATOMIC_ACQUIRE);
+}
+
+unsigned topic_interned_count(void)
+{
+   return __atomic_load_n(&live, __ATOMIC_RELAXED);
+}
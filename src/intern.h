@@ -0,0 +1,46 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Global topic intern table: every distinct topic name gets an id and a
+ * single immutable, NUL terminated copy shared by every user. Users hold
+ * a reference, taken by topic_intern or topic_ref and dropped with
+ * topic_release; a name nobody references keeps its id until the table
+ * is swept, once it holds twice the names it kept at the last sweep.
+ * Swept names are freed and their ids reused, so anything keyed by id
+ * beyond the references it holds must also check topic_reclaim_gen.
+ * Id 0 is never assigned.
+ */
+#define INTERN_SHARDS 64
+#define INTERN_PAGE_BITS 12
+#define INTERN_PAGE_SIZE (1 << INTERN_PAGE_BITS)
+#define INTERN_MAX_PAGES 4096
+#define INTERN_SWEEP_MIN 65536
+
+struct interned
+{
+   unsigned id;
+   unsigned refs;
+   unsigned short len;
+   uint64_t hash;
+   char name[];
+};
+
+const struct interned *topic_intern(const char *, size_t);
+
+const struct interned *topic_lookup(const char *, size_t);
+
+const struct interned *topic_by_id(unsigned);
+
+void topic_ref(const struct interned *);
+
+void topic_release(const struct interned *);
+
+unsigned long long topic_reclaim_gen(void);
+
+unsigned topic_interned_count(void);
+
+#endif
@@ -1,26 +1,34 @@
 #include <stdlib.h>
+#include <limits.h>
 #include<string.h>
 #include "mqtt.h"
 #include "pack.h"
+#include "pool.h"
 
-static size_t unpack_mqtt_connect(const unsigned char *,
-				  union mqtt_header *,
-				  union mqtt_packet *);
+static int unpack_mqtt_connect(const unsigned char *,
+			       union mqtt_header *,
+			       union mqtt_packet *,
+			       int);
 
-static size_t unpack_mqtt_publish(const unsigned char *,
-				  union mqtt_header *,
-				  union mqtt_packet *);
+static int unpack_mqtt_publish(const unsigned char *,
+			       union mqtt_header *,
+			       union mqtt_packet *,
+			       int);
 
-static size_t unpack_mqtt_subscribe(const unsigned char *,
-				    union mqtt_header *,
-				    union mqtt_packet *);
+static int unpack_mqtt_subscribe(const unsigned char *,
+				 union mqtt_header *,
+				 union mqtt_packet *,
+				 int);
 
-static size_t unpack_mqtt_unsubscribe(const unsigned char *,
-				    union mqtt_header *,
-				    union mqtt_packet *);
-static size_t unpack_mqtt_ack(const unsigned char *,
-				    union mqtt_header *,
-				    union mqtt_packet *);
+static int unpack_mqtt_unsubscribe(const unsigned char *,
+				   union mqtt_header *,
+				   union mqtt_packet *,
+				   int);
+
+static int unpack_mqtt_ack(const unsigned char *,
+			   union mqtt_header *,
+			   union mqtt_packet *,
+			   int);
 
 static unsigned char* pack_mqtt_header(const union mqtt_header *);
 static unsigned char* pack_mqtt_ack(const union mqtt_packet *);		   
@@ -51,7 +59,24 @@ int mqtt_encode_length(unsigned char *buf, size_t len)
 }
 
 
-unsigned long long mqtt_decode_lenght(const unsigned char **buf)
+/*
+ * Pack the PUBLISH bytes preceding the topic name: header byte, remaining
+ * length and topic length. buf must hold MQTT_PUBLISH_HEADER_MAX bytes.
+ */
+size_t mqtt_pack_publish_header(unsigned char *buf,
+				unsigned char byte,
+				size_t remaining_len,
+				unsigned short topiclen)
+{
+   unsigned char *ptr = buf;
+   pack_u8(&ptr, byte);
+   ptr += mqtt_encode_length(ptr, remaining_len);
+   pack_u16(&ptr, topiclen);
+   return ptr - buf;
+}
+
+
+unsigned long long mqtt_decode_length(const unsigned char **buf)
 {
    char c;
    int miltiplier = 1;
@@ -66,152 +91,289 @@ unsigned long long mqtt_decode_lenght(const unsigned char **buf)
    return value;
 }
 
-static size_t unpack_mqtt_connect(const unsigned char *buf,
-				  union mqtt_header *hdr,
-				  union mqtt_packet *pkt)
+void mqtt_parser_init(struct mqtt_parser *parser)
 {
-   struct mqtt_connect connect = {.header = *hdr};
-   pkt->connect = connect;
-   const unsigned char *init = buf;
-
-   size_t len = mqtt_decode_length(&buf);
+   parser->state = MQTT_PARSE_TYPE;
+   parser->pos = 0;
+   parser->remaining_len = 0;
+   parser->multiplier = 1;
+}
 
-   buf = init+8;
-   pkt->connect.byte = unpack_u8((const uint8_t **) &buf);
-   pkt->connect.payload.keepalive = unpack_u16((const uint8_t**)&buf);
-   
-   uint16_t cid_len = unpack_u16((const uint8_t**)&buf);
+/* Packets a client may send; the server to client ones are refused */
+static const unsigned char client_packets[DISCONNECT + 1] = {
+   [CONNECT] = 1,
+   [PUBLISH] = 1,
+   [PUBACK] = 1,
+   [PUBREC] = 1,
+   [PUBREL] = 1,
+   [PUBCOMP] = 1,
+   [SUBSCRIBE] = 1,
+   [UNSUBSCRIBE] = 1,
+   [PINGREQ] = 1,
+   [DISCONNECT] = 1
+};
 
-   if(cid_len>0)
+/*
+ * Returns the length of the complete frame starting at buf, 0 if more
+ * bytes are needed, or a negative MQTT_PARSE_* error. The parser resets
+ * itself once a frame is returned. Frames of a type a client cannot send
+ * are an error as soon as their first byte is seen.
+ */
+long long mqtt_parse_frame(struct mqtt_parser *parser,
+			   const unsigned char *buf,
+			   size_t len,
+			   size_t max_len)
+{
+   while(parser->pos < len || parser->state == MQTT_PARSE_BODY)
    {
-	   pkt->connect.payload.client_id = malloc(cid_len+1);
-	   unpack_bytes((const uint8_t**)&buf,cid_len,
-			   pkt->connect.payload.client_id);
+	switch(parser->state)
+	{
+	   case MQTT_PARSE_TYPE:
+		{
+		   union mqtt_header hdr = {.byte = buf[parser->pos]};
+		   if(hdr.bits.type > DISCONNECT || !client_packets[hdr.bits.type])
+			   return -MQTT_PARSE_ERR;
+		   parser->pos++;
+		   parser->state = MQTT_PARSE_LENGTH;
+		}
+		break;
+	   case MQTT_PARSE_LENGTH:
+		{
+		   unsigned char c = buf[parser->pos++];
+		   parser->remaining_len += (c & 127) * parser->multiplier;
+		   parser->multiplier *= 128;
+		   if(parser->remaining_len > max_len)
+			   return -MQTT_PARSE_TOOBIG;
+		   if(c & 128)
+		   {
+			if(parser->pos > (size_t) MAX_LEN_BYTES)
+				return -MQTT_PARSE_ERR;
+		   }
+		   else
+			parser->state = MQTT_PARSE_BODY;
+		}
+		break;
+	   case MQTT_PARSE_BODY:
+		{
+		   size_t frame_len = parser->pos + parser->remaining_len;
+		   if(len < frame_len)
+			   return 0;
+		   mqtt_parser_init(parser);
+		   return frame_len;
+		}
+	}
    }
+   return 0;
+}
 
-   if(pkt->connect.bits.will == 1)
-   {
-	   unpack_string16(&buf,&pkt->connect.payload.will_topic);
-	   unpack_string16(&buf,&pkt->connect.payload.will_message);
-   }
+/*
+ * Length prefixed fields are either copied in their own allocation or, in
+ * view mode, pointed at where they sit in the frame. A field running past
+ * end, the end of the packet, fails the whole packet.
+ */
+static int unpack_field(const unsigned char **buf,
+			const unsigned char *end,
+			unsigned char **dest,
+			unsigned short *len,
+			int view)
+{
+   if(end - *buf < (long) sizeof(uint16_t))
+	   return -1;
+   const unsigned char *ptr = *buf;
+   if(end - *buf - (long) sizeof(uint16_t) < unpack_u16(&ptr))
+	   return -1;
+   if(view)
+	   *len = unpack_string16_view((uint8_t **) buf, dest);
+   else
+	   *len = unpack_string16((uint8_t **) buf, dest);
+   return 0;
+}
 
-   if(pkt->connect.bits.username == 1)
-	unpack_string16(&buf,&pkt->connect.payload.username);
+static int unpack_mqtt_connect(const unsigned char *buf,
+			       union mqtt_header *hdr,
+			       union mqtt_packet *pkt,
+			       int view)
+{
+   struct mqtt_connect connect = {.header = *hdr};
+   pkt->connect = connect;
+   struct mqtt_connect *c = &pkt->connect;
 
-   if(pkt->connect.bits.password == 1)
-	   unpack_string16(&buf,&pkt->connect.payload.password);
+   size_t len = mqtt_decode_length(&buf);
+   const unsigned char *end = buf + len;
+
+   /* Skip the protocol name and level */
+   if(len < sizeof(uint16_t))
+	   return -1;
+   uint16_t namelen = unpack_u16((const uint8_t **) &buf);
+   if((size_t) (end - buf) < namelen + 2 * sizeof(uint8_t) + sizeof(uint16_t))
+	   return -1;
+   buf += namelen + sizeof(uint8_t);
+   c->byte = unpack_u8((const uint8_t **) &buf);
+   c->payload.keepalive = unpack_u16((const uint8_t**)&buf);
+
+   if(unpack_field(&buf, end, &c->payload.client_id,
+			   &c->payload.client_id_len, view) < 0)
+	   return -1;
+
+   if(c->bits.will == 1 &&
+	(unpack_field(&buf, end, &c->payload.will_topic,
+		      &c->payload.will_topic_len, view) < 0 ||
+	 unpack_field(&buf, end, &c->payload.will_message,
+		      &c->payload.will_message_len, view) < 0))
+	   return -1;
+
+   if(c->bits.username == 1 &&
+	unpack_field(&buf, end, &c->payload.username,
+		     &c->payload.username_len, view) < 0)
+	   return -1;
+
+   if(c->bits.password == 1 &&
+	unpack_field(&buf, end, &c->payload.password,
+		     &c->payload.password_len, view) < 0)
+	   return -1;
 
    return len;
-
 }
 
 
-static size_t unpack_mqtt_publish(const unsigned char *buf,
-				  union mqtt_header *hdr,
-				  union mqtt_packet *pkt)
+static int unpack_mqtt_publish(const unsigned char *buf,
+			       union mqtt_header *hdr,
+			       union mqtt_packet *pkt,
+			       int view)
 {
    struct mqtt_publish publish = {.header = *hdr};
    pkt->publish = publish;
-   
 
    size_t len = mqtt_decode_length(&buf);
-   pkt->publish.topiclen = unpack_string16(&buf, &pkt->publish.topic);
-   uint16_t message_len = len;
+   const unsigned char *end = buf + len;
+   if(unpack_field(&buf, end, &pkt->publish.topic,
+			   &pkt->publish.topiclen, view) < 0)
+	   return -1;
 
-   if(publich.header.bits.qos > AT_MOST_ONCE)
+   if(publish.header.bits.qos > AT_MOST_ONCE)
    {
+      if(end - buf < (long) sizeof(uint16_t))
+	      return -1;
       pkt->publish.pkt_id = unpack_u16((const uint8_t**)&buf);
-      message_len -= sizeof(uint16_t);
    }
 
-   message_len -= (sizeof(utin16_t) + topic_len);
+   size_t message_len = end - buf;
    pkt->publish.payloadlen = message_len;
-   pkt->publish.payload = malloc(message_len + 1);
-
-   unpack_bytes((const uint8_t**)&buf, message_len, pkt->publish.payload);
+   if(view)
+   {
+      pkt->publish.payload = (unsigned char *) buf;
+   }
+   else
+   {
+      pkt->publish.payload = malloc(message_len + 1);
+      if(!pkt->publish.payload)
+	      return -1;
+      unpack_bytes((const uint8_t**)&buf, message_len, pkt->publish.payload);
+   }
 
    return len;
 }
 
 
-static size_t unpack_mqtt_subscribe(const unsigned char *buf,
-					union mqtt_header *hdr,
-					union mqtt_packet *pkt)
+/*
+ * Tuples are stored in pkt as they are decoded, so a packet failing
+ * halfway is released like a complete one.
+ */
+static int unpack_mqtt_subscribe(const unsigned char *buf,
+				 union mqtt_header *hdr,
+				 union mqtt_packet *pkt,
+				 int view)
 {
-   struct mqtt_subscribe subscribe = {.head = *hdr};
+   struct mqtt_subscribe subscribe = {.header = *hdr};
+   pkt->subscribe = subscribe;
+   struct mqtt_subscribe *sub = &pkt->subscribe;
 
    size_t len = mqtt_decode_length(&buf);
-   size_t remaining_bytes = len;
+   const unsigned char *end = buf + len;
+   if(len < sizeof(uint16_t))
+	   return -1;
+   sub->pkt_id = unpack_u16((const uint8_t**)&buf);
 
-   subscribe.pkt_id = unpack_u16((const uint8_t**)&buf);
-   remaining_bytes -= sizeof(uint16_t);
-
-   int i = 0;
-   while(remaining_bytes > 0)
+   while(buf < end)
    {
-      remaining_bytes -= sizeof(uint16_t);
-      subscribe.tuples = realloc(subscribe.tuples, (i+1) * sizeof(*subscribe.tuples));
-
-      subscribe.tuples[i].topic_len = 
-	      unpack_string16(&buf, &subscribe.tuples[i].topic);
-
-      remaining_bytes -= subscribe.tupels[i].topic_len;
-      subscribe.tuples[i].qos = unpack_u8((const uint8_t **)&buf);
-      len -= sizeof(uint8_t);
-      i++;
+      if(sub->tuples_len == USHRT_MAX)
+	      return -1;
+      void *tuples = realloc(sub->tuples,
+		      (sub->tuples_len + 1) * sizeof(*sub->tuples));
+      if(!tuples)
+	      return -1;
+      sub->tuples = tuples;
+
+      unsigned i = sub->tuples_len;
+      if(unpack_field(&buf, end, &sub->tuples[i].topic,
+			      &sub->tuples[i].topic_len, view) < 0)
+	      return -1;
+      sub->tuples_len++;
+      if(buf == end)
+	      return -1;
+      sub->tuples[i].qos = unpack_u8((const uint8_t **)&buf);
    }
 
-   subscribe.tuples_len = i;
-   pkt->subscribe = subscribe;
-   return len;
+   /* A SUBSCRIBE without any filter is a protocol violation */
+   return sub->tuples_len > 0 ? (int) len : -1;
 }
 
-static size_t unpack_mqtt_unsubscribe(const unsigned char *buf,
-					union mqtt_header *hdr,
-					union mqtt_packet *pkt)
+static int unpack_mqtt_unsubscribe(const unsigned char *buf,
+				   union mqtt_header *hdr,
+				   union mqtt_packet *pkt,
+				   int view)
 {
     struct mqtt_unsubscribe unsubscribe = { .header = *hdr};
+    pkt->unsubscribe = unsubscribe;
+    struct mqtt_unsubscribe *unsub = &pkt->unsubscribe;
 
     size_t len = mqtt_decode_length(&buf);
-    size_t remaining_bytes = len;
-
-    unsubscribe.pkt_id = unpack_u16((const uint8_t **)&buf);
-    remaining_bytes -= sizeof(uint16_t);
+    const unsigned char *end = buf + len;
+    if(len < sizeof(uint16_t))
+	    return -1;
+    unsub->pkt_id = unpack_u16((const uint8_t **)&buf);
 
-    int i = 0;
-    while(remaining_bytes > 0)
+    while(buf < end)
     {
-	remaining_bytes -= sizeof(uint16_t);
-	unsubscribe.tuples = realloc(unsubscribe.tuples,
-					(i+1)*sizeof(*unsubscribe.tuples));
-
-	unsubscribe.tuples[i].topic_len = 
-		unpack_string16(&buf, &unsubscribe.tuples[i].topic);
-	remaining_bytes -= unsubscribe.tuples[i].topic_len;
-	++i;
+	if(unsub->tuples_len == USHRT_MAX)
+		return -1;
+	void *tuples = realloc(unsub->tuples,
+			(unsub->tuples_len + 1) * sizeof(*unsub->tuples));
+	if(!tuples)
+		return -1;
+	unsub->tuples = tuples;
+
+	unsigned i = unsub->tuples_len;
+	if(unpack_field(&buf, end, &unsub->tuples[i].topic,
+				&unsub->tuples[i].topic_len, view) < 0)
+		return -1;
+	unsub->tuples_len++;
     }
 
-    unsubscribe.tuples_len = i;
-    pkt->unsubscribe = unsubscribe;
-    return len;
+    return unsub->tuples_len > 0 ? (int) len : -1;
 }
 
 
-static size_t unpack_mqtt_ack(const unsigned char *buf,
-				union mqtt_header *hdr,
-				union mqtt_packet *pkt)
+static int unpack_mqtt_ack(const unsigned char *buf,
+			   union mqtt_header *hdr,
+			   union mqtt_packet *pkt,
+			   int view)
 {
+   (void)view;
    struct mqtt_ack ack = {.header = *hdr};
 
    size_t len = mqtt_decode_length(&buf);
+   if(len < sizeof(uint16_t))
+	   return -1;
    ack.pkt_id = unpack_u16((const uint8_t**)&buf);
    pkt->ack = ack;
    return len;
 }
 
-typedef size_t mqtt_unpack_handler(const unsigned char *,
-					union mqtt_header *,
-					union mqtt_packet *);
+typedef int mqtt_unpack_handler(const unsigned char *,
+				union mqtt_header *,
+				union mqtt_packet *,
+				int);
 
 static mqtt_unpack_handler *unpack_handlers[11] = {
 	NULL,
@@ -227,7 +389,9 @@ static mqtt_unpack_handler *unpack_handlers[11] = {
 	unpack_mqtt_unsubscribe
 };
 
-int unpack_mqtt_packet(const unsigned char *bf, union mqtt_packet *pkt)
+static int unpack_packet(const unsigned char *buf,
+			 union mqtt_packet *pkt,
+			 int view)
 {
    int rc = 0;
    unsigned char type = *buf;
@@ -237,39 +401,103 @@ int unpack_mqtt_packet(const unsigned char *bf, union mqtt_packet *pkt)
 		   || header.bits.type == PINGREQ
     		   || header.bits.type == PINGRESP)
 	   pkt->header = header;
+   else if(header.bits.type < UNSUBACK && unpack_handlers[header.bits.type])
+   {
+	rc = unpack_handlers[header.bits.type](++buf, &header, pkt, view);
+	if(rc < 0)
+	{
+	   /* Drop whatever was decoded before the packet turned out short */
+	   if(view)
+		   mqtt_packet_release_view(pkt, header.bits.type);
+	   else
+		   mqtt_packet_release(pkt, header.bits.type);
+	}
+   }
    else
-	   rc = unpack_handlers[header.bits.type](++buf, &header, pkt);
+	   rc = -1;
    return rc;
 }
 
+int unpack_mqtt_packet(const unsigned char *buf, union mqtt_packet *pkt)
+{
+   return unpack_packet(buf, pkt, 0);
+}
+
+/*
+ * Topics, payloads, client id and credentials are left in buf: the packet
+ * is only valid as long as the frame is, and strings are not terminated.
+ * Release it with mqtt_packet_release_view.
+ */
+int unpack_mqtt_packet_view(const unsigned char *buf, union mqtt_packet *pkt)
+{
+   return unpack_packet(buf, pkt, 1);
+}
+
 
 
 
+/*
+ * Packets built for the wire come from a thread local pool instead of
+ * malloc or function statics, so builders are reentrant across reactor
+ * threads. A SUBACK return codes array up to MQTT_SUBACK_INLINE_RCS bytes
+ * is stored in the pooled object itself. Every built packet is handed
+ * back with mqtt_packet_free.
+ */
+struct mqtt_packet_obj
+{
+   union mqtt_packet pkt;
+   unsigned char rcs[MQTT_SUBACK_INLINE_RCS];
+};
+
+static __thread struct pool packet_pool =
+	POOL_INIT(sizeof(struct mqtt_packet_obj));
+
+static union mqtt_packet *mqtt_packet_alloc(void)
+{
+   return pool_alloc(&packet_pool);
+}
+
+void mqtt_packet_free(union mqtt_packet *pkt, unsigned type)
+{
+   if(!pkt)
+	   return;
+   struct mqtt_packet_obj *obj = (struct mqtt_packet_obj *) pkt;
+   if(type == SUBACK && pkt->suback.rcs != obj->rcs)
+	   free(pkt->suback.rcs);
+   pool_free(&packet_pool, obj);
+}
+
 union mqtt_header *mqtt_packet_header(unsigned char byte)
 {
-	static union mqtt_header header;
-	header.byte = byte;
-	return &header;
+	union mqtt_packet *pkt = mqtt_packet_alloc();
+	if(!pkt)
+		return NULL;
+	pkt->header.byte = byte;
+	return &pkt->header;
 }
 
 
 struct mqtt_ack *mqtt_packet_ack(unsigned char byte, unsigned short pkt_id)
 {
-	static struct mqtt_ack ack;
-	ack.header.byte = byte;
-	ack.pkt_id = pkt_id;
-	return &ack;
+	union mqtt_packet *pkt = mqtt_packet_alloc();
+	if(!pkt)
+		return NULL;
+	pkt->ack.header.byte = byte;
+	pkt->ack.pkt_id = pkt_id;
+	return &pkt->ack;
 }
 
 struct mqtt_connack *mqtt_packet_connack(unsigned char byte,
 					 unsigned char cflags,
 					 unsigned char rc)
 {
-   static struct mqtt_connack connack;
-   connack.header.byte = byte;
-   connack.byte = cflags;
-   connack.rc = rc;
-   return &connack;
+   union mqtt_packet *pkt = mqtt_packet_alloc();
+   if(!pkt)
+	   return NULL;
+   pkt->connack.header.byte = byte;
+   pkt->connack.byte = cflags;
+   pkt->connack.rc = rc;
+   return &pkt->connack;
 }
 
 struct mqtt_suback *mqtt_packet_suback(unsigned char byte,
@@ -277,11 +505,20 @@ struct mqtt_suback *mqtt_packet_suback(unsigned char byte,
 					unsigned char *rcs,
 					unsigned short rcslen)
 {
-   struct mqtt_suback *suback = malloc(sizeof(*suback));
+   struct mqtt_packet_obj *obj = (struct mqtt_packet_obj *) mqtt_packet_alloc();
+   if(!obj)
+	   return NULL;
+   struct mqtt_suback *suback = &obj->pkt.suback;
    suback->header.byte = byte;
    suback->pkt_id = pkt_id;
    suback->rcslen = rcslen;
-   suback->rcs = malloc(rcslen);
+   if(rcslen <= MQTT_SUBACK_INLINE_RCS)
+	   suback->rcs = obj->rcs;
+   else if(!(suback->rcs = malloc(rcslen)))
+   {
+	pool_free(&packet_pool, obj);
+	return NULL;
+   }
    memcpy(suback->rcs, rcs, rcslen);
    return suback;
 }
@@ -293,7 +530,10 @@ struct mqtt_publish *mqtt_packet_publish(unsigned char byte,
 					 size_t payloadlen,
 					 unsigned char *payload)
 {
-   struct mqtt_publish *publish = malloc(sizeof(*publish));
+   union mqtt_packet *pkt = mqtt_packet_alloc();
+   if(!pkt)
+	   return NULL;
+   struct mqtt_publish *publish = &pkt->publish;
    publish->header.byte = byte;
    publish->pkt_id = pkt_id;
    publish->topiclen = topiclen;
@@ -309,34 +549,45 @@ void mqtt_packet_release(union mqtt_packet *pkt, unsigned type)
    {
       case CONNECT:
 	      free(pkt->connect.payload.client_id);
-	      if(pkt->connect.bist.username == 1)
+	      if(pkt->connect.bits.username == 1)
 		      free(pkt->connect.payload.username);
 	      if(pkt->connect.bits.password == 1)
 		      free(pkt->connect.payload.password);
 	      if(pkt->connect.bits.will == 1)
 	      {
 		 free(pkt->connect.payload.will_message);
-		 free(pkt->connect.payloed.will_topic);
+		 free(pkt->connect.payload.will_topic);
 	      }
 	      break;
       case SUBSCRIBE:
-      case UNSUBSCRIBE:
-	      for(unsigned i = 0; i < pkt->subscribe.typles_len; ++i)
+	      for(unsigned i = 0; i < pkt->subscribe.tuples_len; ++i)
 	      		free(pkt->subscribe.tuples[i].topic);
 	      free(pkt->subscribe.tuples);
 	      break;
+      case UNSUBSCRIBE:
+	      for(unsigned i = 0; i < pkt->unsubscribe.tuples_len; ++i)
+	      		free(pkt->unsubscribe.tuples[i].topic);
+	      free(pkt->unsubscribe.tuples);
+	      break;
       case SUBACK:
 	      free(pkt->suback.rcs);
 	      break;
       case PUBLISH:
 	      free(pkt->publish.topic);
-	      freee(pkt->publish.payload);
+	      free(pkt->publish.payload);
 	      break;
       default:
 	      break;
    }
 }
 
+void mqtt_packet_release_view(union mqtt_packet *pkt, unsigned type)
+{
+   if(type == SUBSCRIBE)
+	   free(pkt->subscribe.tuples);
+   else if(type == UNSUBSCRIBE)
+	   free(pkt->unsubscribe.tuples);
+}
 
 typedef unsigned char *mqtt_pack_handler(const union mqtt_packet *);
 
@@ -363,7 +614,7 @@ static unsigned char *pack_mqtt_header(const union mqtt_header *hdr)
    unsigned char *packed = malloc(MQTT_HEADER_LEN);
    unsigned char *ptr = packed;
    pack_u8(&ptr, hdr->byte);
-   mqtt_encode_length(prt,0);
+   mqtt_encode_length(ptr, 0);
    return packed;
 }
 
@@ -393,12 +644,16 @@ static unsigned char *pack_mqtt_connack(const union mqtt_packet *pkt)
 
 static unsigned char *pack_mqtt_suback(const union mqtt_packet *pkt)
 {
-   size_t pktlen = MQTT_HEADER_LEN + sizeof(uint16_t) + pkt->suback.rcslen;
-   unsigned char *packed = malloc(pktlen + 0);
+   size_t len = sizeof(uint16_t) + pkt->suback.rcslen;
+   unsigned char lenbuf[4];
+   /* Past 127 return codes the remaining length takes more than a byte */
+   size_t pktlen = 1 + mqtt_encode_length(lenbuf, len) + len;
+   unsigned char *packed = malloc(pktlen);
+   if(!packed)
+	   return NULL;
    unsigned char *ptr = packed;
-   
+
    pack_u8(&ptr, pkt->suback.header.byte);
-   size_t len = sizeof(uint16_t) + pkt->suback.rcslen;
 
    int step = mqtt_encode_length(ptr,len);
    ptr+=step;
@@ -406,11 +661,11 @@ static unsigned char *pack_mqtt_suback(const union mqtt_packet *pkt)
    pack_u16(&ptr, pkt->suback.pkt_id);
    
    for(int i = 0; i < pkt->suback.rcslen; ++i)
-   	pack_u8(&ptr, pkt->suback.rcslen[i]);
+   	pack_u8(&ptr, pkt->suback.rcs[i]);
    return packed;
 }
 
-static unsigned char *pack_mqtt_publish(const union mqtt_paacket *pkt)
+static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt)
 {
    size_t pktlen = MQTT_HEADER_LEN + sizeof(uint16_t) +
 	   pkt->publish.topiclen + pkt->publish.payloadlen;
@@ -428,7 +683,7 @@ static unsigned char *pack_mqtt_publish(const union mqtt_paacket *pkt)
 	   remaininglen_offset = 1;
    pktlen += remaininglen_offset;
    unsigned char *packed = malloc(pktlen);
-   unsigned char *ptr = packet;
+   unsigned char *ptr = packed;
    pack_u8(&ptr, pkt->publish.header.byte);
    len += (pktlen - MQTT_HEADER_LEN - remaininglen_offset);
 
@@ -436,19 +691,19 @@ static unsigned char *pack_mqtt_publish(const union mqtt_paacket *pkt)
    ptr += step;
 
    pack_u16(&ptr, pkt->publish.topiclen);
-   pack_bytes(&ptr, pkt->publish.topic);
+   pack_bytes(&ptr, pkt->publish.topic, pkt->publish.topiclen);
 
    if(pkt->header.bits.qos > AT_MOST_ONCE)
 	   pack_u16(&ptr, pkt->publish.pkt_id);
 
-   pack_bytes(&ptr, pkt->publish.payload);
+   pack_bytes(&ptr, pkt->publish.payload, pkt->publish.payloadlen);
    return packed;
 }
 
 
 unsigned char *pack_mqtt_packet(const union mqtt_packet *pkt, unsigned type)
 {
-   if(type == PINGREQ || type == PINGERSP)
+   if(type == PINGREQ || type == PINGRESP)
 	   return pack_mqtt_header(&pkt->header);
    return pack_handlers[type](pkt);
 }
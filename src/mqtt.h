@@ -7,6 +7,8 @@
 
 #define MQTT_ACK_LEN 4
 
+#define MQTT_SUBACK_INLINE_RCS 32
+
 #define CONNACK_BYTE 0x20
 #define PUBLISH_BYTE 0x30
 #define PUBACK_BYTE 0x40
@@ -72,6 +74,11 @@ struct mqtt_connect
   struct
   {
     unsigned short keepalive;
+    unsigned short client_id_len;
+    unsigned short username_len;
+    unsigned short password_len;
+    unsigned short will_topic_len;
+    unsigned short will_message_len;
     unsigned char *client_id;
     unsigned char *username;
     unsigned char *password;
@@ -178,9 +185,41 @@ union mqtt_packet {
 
 
 
+/*
+ * Resumable frame parser: it is fed the unconsumed bytes of a connection
+ * read buffer and remembers how far into the fixed header it got, so a
+ * header or body split across reads is picked up where it stopped.
+ */
+enum mqtt_parser_state
+{
+   MQTT_PARSE_TYPE,
+   MQTT_PARSE_LENGTH,
+   MQTT_PARSE_BODY
+};
+
+#define MQTT_PARSE_ERR 1
+#define MQTT_PARSE_TOOBIG 2
+
+struct mqtt_parser
+{
+   int state;
+   size_t pos;
+   size_t remaining_len;
+   unsigned long multiplier;
+};
+
+void mqtt_parser_init(struct mqtt_parser *);
+long long mqtt_parse_frame(struct mqtt_parser *, const unsigned char *,
+			   size_t, size_t);
+
+#define MQTT_PUBLISH_HEADER_MAX 7
+
 int mqtt_encode_length(unsigned char *, size_t);
+size_t mqtt_pack_publish_header(unsigned char *, unsigned char,
+				size_t, unsigned short);
 unsigned long long mqtt_decode_length(const unsigned char **);
 int unpack_mqtt_packet(const unsigned char *, union mqtt_packet *);
+int unpack_mqtt_packet_view(const unsigned char *, union mqtt_packet *);
 unsigned char *pack_mqtt_packet(const union mqtt_packet *,unsigned);
 
 
@@ -192,7 +231,9 @@ struct mqtt_suback *mqtt_packet_suback(unsigned char ,unsigned short ,
 struct mqtt_publish *mqtt_packet_publish(unsigned char , unsigned short , 
 		 			 	size_t , unsigned char *,
 					 	size_t , unsigned char *);
+void mqtt_packet_free(union mqtt_packet *, unsigned);
 void mqtt_packet_release(union mqtt_packet *, unsigned );
+void mqtt_packet_release_view(union mqtt_packet *, unsigned);
 
 #endif
 
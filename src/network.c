@@ -1,21 +1,31 @@
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <errno.h>
+#include <assert.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
 #include <sys/epoll.h>
+#include <time.h>
+#include <string.h>
 #include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/eventfd.h>
+#include <sys/resource.h>
+#ifdef HAVE_IO_URING
+#include <poll.h>
+#include "uring.h"
+#endif
 #include "util.h"
 #include "config.h"
 #include "network.h"
+#include "pool.h"
 
 int set_nonblocking(int fd)
 {
@@ -35,7 +45,7 @@ err:
    return -1;
 }
 
-int set_tcp_nondelay(int fd)
+int set_tcp_nodelay(int fd)
 {
    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
 }
@@ -46,14 +56,14 @@ static int create_and_bind_unix(const char *sockpath)
    struct sockaddr_un addr;
    int fd;
 
-   if((fd == socket(AF_UNIX, SOCK_STREAM,0)) == -1)
+   if((fd = socket(AF_UNIX, SOCK_STREAM,0)) == -1)
    {
 	   perror("socket error");
 	   return -1;
    }
 
    memset(&addr, 0, sizeof(addr));
-   addr.sum_family = AF_UNIX;
+   addr.sun_family = AF_UNIX;
    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
    unlink(sockpath);
    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
@@ -69,8 +79,8 @@ static int create_and_bind_unix(const char *sockpath)
 
 static int create_and_bind_tcp(const char *host, const char *port)
 {
-   struct addr_info hints = {
-	   .ai_famili = AF_INSPEC,
+   struct addrinfo hints = {
+	   .ai_family = AF_UNSPEC,
 	   .ai_socktype = SOCK_STREAM,
 	   .ai_flags = AI_PASSIVE
    };
@@ -90,7 +100,9 @@ static int create_and_bind_tcp(const char *host, const char *port)
 		continue;
 	if(setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
 		perror("SO_REUSEADDR");
-	if((bind(sfd, rp->ai_addr, pr->ai_addrlen)) == 0)
+	if(setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+		perror("SO_REUSEPORT");
+	if((bind(sfd, rp->ai_addr, rp->ai_addrlen)) == 0)
 		break;
 
 	close(sfd);
@@ -136,25 +148,21 @@ int make_listen(const char *host, const char *port, int socket_family)
 }
 
 
-int accept_connection(int serversock)
+/*
+ * Accept a client already non-blocking and close-on-exec through
+ * accept4(2), the peer address is filled in addr as returned by the
+ * kernel so no getpeername(2) is needed afterwards.
+ */
+int accept_connection(int serversock, struct sockaddr_storage *addr)
 {
    int clientsock;
-   struct sockaddr_in addr;
-   socklen_t addrlen = sizeof(addr);
-   if((clientsock == accept(serversock,
-				   (struct sockaddr *)&addr, &addrlen)) < 0)
+   socklen_t addrlen = sizeof(*addr);
+   if((clientsock = accept4(serversock, (struct sockaddr *) addr,
+				   &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
 	   return -1;
-   set_nonblockong(clientsock);
 
    if(conf->socket_family == INET)
 	   set_tcp_nodelay(clientsock);
-   char ip_buff[INET_ADDRSTRLEN + 1];
-   if(inet_ntop(AF_INET, &addr.sin_addr,
-			   ip_buff, sizeof(ip_buff)) == NULL)
-   {
-	   close(clientsock);
-	   return -1;
-   }
    return clientsock;
 }
 
@@ -211,8 +219,554 @@ err:
 
 
 
+/* One outbuf per subscriber per PUBLISH, recycled through a per thread pool */
+static __thread struct pool outbuf_pool = POOL_INIT(sizeof(struct outbuf));
+
+struct outbuf *outbuf_create(struct bytestring *owner)
+{
+   struct outbuf *ob = pool_alloc(&outbuf_pool);
+   if(!ob)
+   {
+	bytestring_release(owner);
+	return NULL;
+   }
+   ob->next = NULL;
+   ob->owner = owner;
+   ob->nfrags = 0;
+   ob->cur = 0;
+   ob->off = 0;
+   ob->size = 0;
+   ob->inline_len = 0;
+   return ob;
+}
+
+/* Fails once the packet has OUTBUF_MAX_FRAGS fragments already */
+int outbuf_add(struct outbuf *ob, const unsigned char *data, size_t len)
+{
+   if(len == 0)
+	   return 0;
+   if(ob->nfrags == OUTBUF_MAX_FRAGS)
+	   return -1;
+   ob->frags[ob->nfrags].data = data;
+   ob->frags[ob->nfrags].len = len;
+   ob->nfrags++;
+   ob->size += len;
+   return 0;
+}
+
+/*
+ * Reserve len bytes of the inline area as the next fragment, the caller
+ * fills them in.
+ */
+unsigned char *outbuf_inline(struct outbuf *ob, size_t len)
+{
+   if(ob->inline_len + len > OUTBUF_INLINE_LEN)
+	   return NULL;
+   unsigned char *ptr = ob->inline_data + ob->inline_len;
+   if(outbuf_add(ob, ptr, len) < 0)
+	   return NULL;
+   ob->inline_len += len;
+   return ptr;
+}
+
+void outbuf_release(struct outbuf *ob)
+{
+   if(!ob)
+	   return;
+   bytestring_release(ob->owner);
+   pool_free(&outbuf_pool, ob);
+}
+
+void outqueue_init(struct outqueue *q)
+{
+   q->head = q->tail = NULL;
+   q->bytes = 0;
+   q->len = 0;
+}
+
+void outqueue_append(struct outqueue *q, struct outbuf *ob)
+{
+   if(!ob)
+	   return;
+   if(q->tail)
+	   q->tail->next = ob;
+   else
+	   q->head = ob;
+   q->tail = ob;
+   q->bytes += ob->size;
+   q->len++;
+}
+
+static void outqueue_pop(struct outqueue *q)
+{
+   struct outbuf *ob = q->head;
+   q->head = ob->next;
+   if(!q->head)
+	   q->tail = NULL;
+   q->len--;
+   outbuf_release(ob);
+}
+
+/*
+ * Mark n bytes as written, popping every packet that went out entirely.
+ */
+static void outqueue_consume(struct outqueue *q, size_t n)
+{
+   q->bytes -= n;
+   while(n > 0 && q->head)
+   {
+	struct outbuf *ob = q->head;
+	struct outfrag *frag = &ob->frags[ob->cur];
+	size_t left = frag->len - ob->off;
+	if(n < left)
+	{
+	   ob->off += n;
+	   return;
+	}
+	n -= left;
+	ob->off = 0;
+	if(++ob->cur == ob->nfrags)
+		outqueue_pop(q);
+   }
+   while(q->head && q->head->cur == q->head->nfrags)
+	   outqueue_pop(q);
+}
+
+/*
+ * Write as much of the queue as the socket accepts, gathering the pending
+ * fragments of consecutive packets into one sendmsg(2) per round; returns
+ * the number of bytes sent. A short write leaves the rest queued.
+ */
+ssize_t outqueue_flush(int fd, struct outqueue *q)
+{
+   struct iovec iov[OUTQUEUE_MAX_IOV];
+   struct msghdr msg;
+   ssize_t total = 0;
+   ssize_t n;
+
+   while(q->head)
+   {
+	int iovcnt = 0;
+	size_t len = 0;
+	for(struct outbuf *ob = q->head;
+			ob && iovcnt < OUTQUEUE_MAX_IOV; ob = ob->next)
+	{
+	   for(int i = ob->cur; i < ob->nfrags && iovcnt < OUTQUEUE_MAX_IOV; i++)
+	   {
+		size_t skip = (ob == q->head && i == ob->cur) ? ob->off : 0;
+		iov[iovcnt].iov_base = (void *) (ob->frags[i].data + skip);
+		iov[iovcnt].iov_len = ob->frags[i].len - skip;
+		len += iov[iovcnt].iov_len;
+		iovcnt++;
+	   }
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	if(n < 0)
+	{
+	   if(errno == EINTR)
+		   continue;
+	   if(errno == EAGAIN || errno == EWOULDBLOCK)
+		   break;
+	   return -1;
+	}
+	outqueue_consume(q, n);
+	total += n;
+	if((size_t) n < len)
+		break;
+   }
+   return total;
+}
+
+void outqueue_clear(struct outqueue *q)
+{
+   while(q->head)
+	   outqueue_pop(q);
+   q->bytes = 0;
+}
+
+
 #define EVLOOP_INITIAL_SIZE 4
 
+/* Sized after RLIMIT_NOFILE, no fd can fall outside of the table */
+int conntable_init(struct conntable *table)
+{
+   struct rlimit rl;
+   if(getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+	   rl.rlim_cur = CONNTABLE_DEFAULT_SIZE;
+   table->size = rl.rlim_cur;
+   table->slots = calloc(table->size, sizeof(*table->slots));
+   return table->slots ? 0 : -1;
+}
+
+int conntable_put(struct conntable *table, struct closure *cb)
+{
+   if(cb->fd < 0 || (size_t) cb->fd >= table->size)
+	   return -1;
+   struct connslot *slot = &table->slots[cb->fd];
+   /* Every connection leaves its slot through conntable_del */
+   assert(!slot->closure);
+   unsigned gen = slot->gen + 1;
+   __atomic_store_n(&slot->closure, cb, __ATOMIC_RELEASE);
+   __atomic_store_n(&slot->gen, gen, __ATOMIC_RELAXED);
+   cb->gen = gen;
+   __atomic_store_n(&slot->backlog, 0, __ATOMIC_RELAXED);
+   return 0;
+}
+
+struct closure *conntable_get(const struct conntable *table,
+			      int fd,
+			      unsigned gen)
+{
+   if(fd < 0 || (size_t) fd >= table->size)
+	   return NULL;
+   const struct connslot *slot = &table->slots[fd];
+   if(__atomic_load_n(&slot->gen, __ATOMIC_RELAXED) != gen)
+	   return NULL;
+   return __atomic_load_n(&slot->closure, __ATOMIC_ACQUIRE);
+}
+
+/* Must run before the fd is closed, another reactor may get it right away */
+void conntable_del(struct conntable *table, struct closure *cb)
+{
+   struct connslot *slot = &table->slots[cb->fd];
+   if(slot->closure != cb)
+	   return;
+   __atomic_store_n(&slot->closure, NULL, __ATOMIC_RELEASE);
+   __atomic_store_n(&slot->gen, slot->gen + 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->backlog, 0, __ATOMIC_RELAXED);
+}
+
+void conntable_set_backlog(struct conntable *table,
+			   const struct closure *cb,
+			   size_t bytes)
+{
+   __atomic_store_n(&table->slots[cb->fd].backlog, bytes, __ATOMIC_RELAXED);
+}
+
+/* Queued bytes of the connection named by handle, SIZE_MAX once gone */
+size_t conntable_backlog(const struct conntable *table, uint64_t handle)
+{
+   int fd = CONN_HANDLE_FD(handle);
+   if(fd < 0 || (size_t) fd >= table->size ||
+		   __atomic_load_n(&table->slots[fd].gen, __ATOMIC_RELAXED) !=
+		   CONN_HANDLE_GEN(handle))
+	   return SIZE_MAX;
+   return __atomic_load_n(&table->slots[fd].backlog, __ATOMIC_RELAXED);
+}
+
+void conntable_free(struct conntable *table, void (*release)(struct closure *))
+{
+   for(size_t i = 0; i < table->size; i++)
+	   if(table->slots[i].closure)
+		   release(table->slots[i].closure);
+   free(table->slots);
+   table->slots = NULL;
+   table->size = 0;
+}
+
+/* Slot 0 is left unused, a zero handle or watch index names no closure */
+static int evloop_watch(struct evloop *loop, struct closure *cb)
+{
+   unsigned idx = loop->watches_free;
+   if(idx)
+	   loop->watches_free = loop->watches[idx].next;
+   else
+   {
+	if(loop->watches_nr == loop->watches_size)
+	{
+	   unsigned size = loop->watches_size * 2;
+	   struct watch *w = realloc(loop->watches, size * sizeof(*w));
+	   if(!w)
+		   return -1;
+	   memset(w + loop->watches_size, 0x00,
+		  (size - loop->watches_size) * sizeof(*w));
+	   loop->watches = w;
+	   loop->watches_size = size;
+	}
+	idx = loop->watches_nr++;
+   }
+   loop->watches[idx].closure = cb;
+   cb->watch = idx;
+   cb->armed = 0;
+   return 0;
+}
+
+static void evloop_unwatch(struct evloop *loop, struct closure *cb)
+{
+   struct watch *w = &loop->watches[cb->watch];
+   w->closure = NULL;
+   w->gen++;
+   w->next = loop->watches_free;
+   loop->watches_free = cb->watch;
+   cb->watch = 0;
+}
+
+static uint64_t evloop_handle(const struct evloop *loop,
+			      const struct closure *cb)
+{
+   return WATCH_HANDLE(cb->watch, loop->watches[cb->watch].gen);
+}
+
+static struct closure *evloop_watched(const struct evloop *loop, uint64_t h)
+{
+   unsigned idx = WATCH_HANDLE_IDX(h);
+   if(idx == 0 || idx >= loop->watches_nr ||
+		   loop->watches[idx].gen != WATCH_HANDLE_GEN(h))
+	   return NULL;
+   return loop->watches[idx].closure;
+}
+
+/*
+ * Errors and hang-ups go to the owner close path; a closure without one
+ * is just no longer watched, its fd is not the loop's to close.
+ */
+static void evloop_on_error(struct evloop *loop, struct closure *cb)
+{
+   if(cb->on_error)
+   {
+	cb->on_error(loop, cb->args);
+	return;
+   }
+   fprintf(stderr, "Error on fd %d, no longer watched\n", cb->fd);
+   evloop_del_callback(loop, cb);
+}
+
+/*
+ * Deferred callbacks are closures that still have work to do but gave up
+ * their turn; they run once more after the events of the current
+ * iteration, and while any is pending the loop polls without blocking.
+ * The list holds watch handles, a closure deleted meanwhile is skipped.
+ */
+int evloop_defer_callback(struct evloop *loop, struct closure *cb)
+{
+   if(!cb->watch)
+	   return -1;
+   if(loop->deferred_nr + 1 > loop->deferred_maxsize)
+   {
+	int size = loop->deferred_maxsize * 2;
+	uint64_t *deferred = realloc(loop->deferred, size * sizeof(*deferred));
+	if(!deferred)
+		return -1;
+	loop->deferred = deferred;
+	loop->deferred_maxsize = size;
+   }
+   loop->deferred[loop->deferred_nr++] = evloop_handle(loop, cb);
+   return 0;
+}
+
+static void evloop_run_deferred(struct evloop *el)
+{
+   int n = el->deferred_nr;
+   for(int i = 0; i < n; i++)
+   {
+	struct closure *cb = evloop_watched(el, el->deferred[i]);
+	if(cb)
+		cb->call(el, cb->args);
+   }
+   el->deferred_nr -= n;
+   memmove(el->deferred, el->deferred + n,
+	   el->deferred_nr * sizeof(*el->deferred));
+}
+
+static void evloop_update_time(struct evloop *loop)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   loop->now = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+unsigned long long evloop_now(const struct evloop *loop)
+{
+   return loop->now;
+}
+
+/*
+ * Point the loop timerfd at the next tick the wheel has work on, or
+ * disarm it when no timer is pending.
+ */
+static void evloop_arm_timer(struct evloop *loop)
+{
+   struct itimerspec timervalue;
+   memset(&timervalue, 0x00, sizeof(timervalue));
+
+   long long next = timer_wheel_next(&loop->wheel);
+   if(next < 0)
+   {
+	loop->timer_deadline = -1;
+   }
+   else
+   {
+	loop->timer_deadline = loop->wheel.now + next;
+	unsigned long long at = loop->timer_deadline * TIMER_TICK_MS;
+	unsigned long long ms = at > loop->now ? at - loop->now : 1;
+	timervalue.it_value.tv_sec = ms / 1000;
+	timervalue.it_value.tv_nsec = (ms % 1000) * 1000000;
+   }
+
+   if(timerfd_settime(loop->timer_closure.fd, 0, &timervalue, NULL) < 0)
+	   perror("timerfd_settime");
+}
+
+/*
+ * Timers are O(1) to add and remove, the timerfd is only touched when the
+ * new timer expires before the tick it is currently armed for.
+ */
+void evloop_add_timer(struct evloop *loop,
+		      struct timer *t,
+		      unsigned long long ms)
+{
+   unsigned long long expires =
+	   (loop->now + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+   timer_wheel_add(&loop->wheel, t, expires);
+   if(loop->timer_deadline < 0 ||
+		   (long long) t->expires < loop->timer_deadline)
+	   evloop_arm_timer(loop);
+}
+
+void evloop_del_timer(struct evloop *loop, struct timer *t)
+{
+   timer_wheel_del(&loop->wheel, t);
+}
+
+static void evloop_on_timer(struct evloop *loop, void *arg)
+{
+   (void)arg;
+   uint64_t expirations;
+   (void)read(loop->timer_closure.fd, &expirations, sizeof(expirations));
+   timer_wheel_advance(&loop->wheel, loop->now / TIMER_TICK_MS);
+   evloop_arm_timer(loop);
+   evloop_rearm_callback_read(loop, &loop->timer_closure);
+}
+
+static void evloop_on_periodic_task(struct timer *t)
+{
+   struct periodic_task *task = t->args;
+   task->closure->call(task->loop, task->closure->args);
+   evloop_add_timer(task->loop, &task->timer, task->interval);
+}
+
+#ifdef HAVE_IO_URING
+
+/*
+ * The io_uring backend only replaces the readiness notification: polls
+ * are requested through one-shot IORING_OP_POLL_ADD entries and the
+ * callbacks still do their own non-blocking reads and writes. Every add
+ * and rearm only queues an SQE, and all of them are flushed together
+ * with the wait in a single io_uring_enter(2), instead of one
+ * epoll_ctl(2) per event. A closure has at most one poll in flight, armed
+ * holds its mask: rearming with another mask updates that poll in place,
+ * deleting the closure cancels it.
+ */
+static int uring_init(struct evloop *loop)
+{
+   loop->ring = malloc(sizeof(*loop->ring));
+   if(!loop->ring)
+	   return -1;
+   int rc = ring_init(loop->ring, loop->max_events);
+   if(rc < 0)
+   {
+	fprintf(stderr, "io_uring_setup: %s, falling back to epoll\n",
+			strerror(-rc));
+	free(loop->ring);
+	loop->ring = NULL;
+	return -1;
+   }
+   loop->backend = EVLOOP_URING;
+   return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct evloop *loop)
+{
+   struct io_uring_sqe *sqe = ring_get_sqe(loop->ring);
+   if(!sqe)
+   {
+	ring_submit(loop->ring, 0);
+	sqe = ring_get_sqe(loop->ring);
+   }
+   return sqe;
+}
+
+static int uring_poll_arm(struct evloop *loop, struct closure *cb,
+			  unsigned mask)
+{
+   if(cb->armed == mask)
+	   return 0;
+   struct io_uring_sqe *sqe = uring_get_sqe(loop);
+   if(!sqe)
+	   return -1;
+   uint64_t h = evloop_handle(loop, cb);
+   if(cb->armed)
+	   ring_prep_poll_update(sqe, h, mask);
+   else
+	   ring_prep_poll_add(sqe, cb->fd, mask, h);
+   cb->armed = mask;
+   return 0;
+}
+
+static int uring_poll_cancel(struct evloop *loop, struct closure *cb)
+{
+   if(!cb->armed)
+	   return 0;
+   struct io_uring_sqe *sqe = uring_get_sqe(loop);
+   if(!sqe)
+	   return -1;
+   ring_prep_cancel(sqe, evloop_handle(loop, cb));
+   cb->armed = 0;
+   return 0;
+}
+
+/*
+ * Submit what was queued, wait for completions unless callbacks are
+ * deferred and run one batch of them. Completions are resolved through
+ * the watch table: the loop own requests and the polls of closures
+ * deleted meanwhile, even earlier in the same batch, resolve to no
+ * closure and are skipped.
+ */
+static int uring_run_once(struct evloop *el)
+{
+   int rc = ring_submit(el->ring, el->deferred_nr > 0 ? 0 : 1);
+   if(rc < 0 && rc != -EINTR)
+   {
+	el->status = -rc;
+	return -1;
+   }
+
+   evloop_update_time(el);
+   unsigned count = ring_cq_ready(el->ring);
+   for(unsigned i = 0; i < count; i++)
+   {
+	struct io_uring_cqe *cqe = ring_cqe_at(el->ring, i);
+	struct closure *closure = evloop_watched(el, cqe->user_data);
+	if(!closure)
+		continue;
+
+	closure->armed = 0;
+	if(cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP)))
+	{
+	    evloop_on_error(el, closure);
+	    continue;
+	}
+
+	closure->call(el, closure->args);
+   }
+   ring_cq_advance(el->ring, count);
+   evloop_run_deferred(el);
+   return 0;
+}
+
+static int uring_wait(struct evloop *el)
+{
+   while(uring_run_once(el) == 0)
+	   ;
+   return -1;
+}
+
+#endif
+
 struct evloop *evloop_create(int max_events, int timeout)
 {
    struct evloop *loop = malloc(sizeof(*loop));
@@ -222,47 +776,75 @@ struct evloop *evloop_create(int max_events, int timeout)
 
 void evloop_init(struct evloop *loop, int max_events, int timeout)
 {
+   loop->backend = EVLOOP_EPOLL;
+   loop->ring = NULL;
    loop->max_events = max_events;
-   loop->events = malloc(sizeof(struct epoll_event*) * max_events);
+   loop->events = malloc(sizeof(struct epoll_event) * max_events);
    loop->epollfd = epoll_create1(0);
    loop->timeout = timeout;
    loop->periodic_maxsize = EVLOOP_INITIAL_SIZE;
    loop->periodic_nr = 0;
    loop->periodic_tasks = 
 	   malloc(EVLOOP_INITIAL_SIZE * sizeof(*loop->periodic_tasks));
+   loop->deferred_maxsize = EVLOOP_INITIAL_SIZE;
+   loop->deferred_nr = 0;
+   loop->deferred = malloc(EVLOOP_INITIAL_SIZE * sizeof(*loop->deferred));
+   loop->watches_size = EVLOOP_INITIAL_SIZE;
+   loop->watches_nr = 1;
+   loop->watches_free = 0;
+   loop->watches = calloc(EVLOOP_INITIAL_SIZE, sizeof(*loop->watches));
    loop->status = 0;
+#ifdef HAVE_IO_URING
+   if(conf->io_backend == EVLOOP_URING)
+	   uring_init(loop);
+#endif
+   evloop_update_time(loop);
+   timer_wheel_init(&loop->wheel, loop->now / TIMER_TICK_MS);
+   loop->timer_deadline = -1;
+   memset(&loop->timer_closure, 0x00, sizeof(loop->timer_closure));
+   loop->timer_closure.fd = timerfd_create(CLOCK_MONOTONIC,
+		   			   TFD_NONBLOCK | TFD_CLOEXEC);
+   loop->timer_closure.args = loop;
+   loop->timer_closure.call = evloop_on_timer;
+   evloop_add_callback(loop, &loop->timer_closure);
 }
 
 
 void evloop_free(struct evloop *loop)
 {
+#ifdef HAVE_IO_URING
+   if(loop->ring)
+   {
+	ring_exit(loop->ring);
+	free(loop->ring);
+   }
+#endif
+   close(loop->timer_closure.fd);
    free(loop->events);
    for(int i = 0; i < loop->periodic_nr; ++i)
 	   free(loop->periodic_tasks[i]);
    free(loop->periodic_tasks);
+   free(loop->deferred);
+   free(loop->watches);
    free(loop);
 }
 
 
-int epoll_add(int efd, int fd, int evs, void *data)
+int epoll_add(int efd, int fd, int evs, uint64_t data)
 {
    struct epoll_event ev;
-   ev.data.fd = fd;
-   if(data)
-	   ev.data.ptr = data;
-   rv.events = evs | EPOLLET | EPOLLONESHORT;
+   ev.data.u64 = data;
+   ev.events = evs | EPOLLET | EPOLLONESHOT;
    return epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
 }
 
 
-int epoll_mod(int efd, itn fd, int evs, void *data)
+int epoll_mod(int efd, int fd, int evs, uint64_t data)
 {
    struct epoll_event ev;
-   ev.data.fd = fd;
-   if(data)
-	   ev.data.ptr = data;
+   ev.data.u64 = data;
    ev.events = evs | EPOLLET | EPOLLONESHOT;
-   return epoll_ctl(efd, EPOLL_ECT_MOD, fd, &ev);  
+   return epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);  
 }
 
 int epoll_del(int efd, int fd)
@@ -272,7 +854,20 @@ int epoll_del(int efd, int fd)
 
 void evloop_add_callback(struct evloop *loop, struct closure *cb)
 {
-   if(epoll_add(loop->epollfd, cb->fd, EPOLLIN, cb) < 0)
+   if(evloop_watch(loop, cb) < 0)
+   {
+	perror("register callback: ");
+	return;
+   }
+#ifdef HAVE_IO_URING
+   if(loop->backend == EVLOOP_URING)
+   {
+	if(uring_poll_arm(loop, cb, POLLIN) < 0)
+		perror("io_uring register callback: ");
+	return;
+   }
+#endif
+   if(epoll_add(loop->epollfd, cb->fd, EPOLLIN, evloop_handle(loop, cb)) < 0)
 	   perror("EPOLL register callback: ");
 }
 
@@ -281,29 +876,6 @@ void evloop_add_periodic_task(struct evloop *loop,
 				unsigned long long ns,
 				struct closure *cb)
 {
-   struct itimerspec timervalue;
-   int timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
-   memset(&timervalue, 0x00, sizeof(timeervalue));
-
-   timervalue.it_value.tv_sec = seconds;
-   timervalue.it_value.tv_nsec = ns;
-   timervalue.it_interval.tv_sec = seconds;
-   timervalue.it_interval.tv_nsec = ns;
-   if(timerfd_settime(timerfd, 0, &timervalue, NULL) < 0)
-   {
-	   perror("timerfd_settime");
-	   return;
-   }
-
-   struct epoll_event ev;
-   ev.data.fd = timerfd;
-   ev.events = EPOLLIN;
-   if(epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, timerfd, &ev) < 0)
-   {
-	   perror("epoll_ctl(2): EPOLLIN");
-	   return;
-   }
-
    if(loop->periodic_nr + 1 > loop->periodic_maxsize)
    {
 	loop->periodic_maxsize *= 2;
@@ -312,21 +884,29 @@ void evloop_add_periodic_task(struct evloop *loop,
 			loop->periodic_maxsize * sizeof(*loop->periodic_tasks));
    }
    
-   loop->periodic_tasks[loop->periodic_nr] = 
-	   malloc(sizeof(*loop->periodic_tasks[loop->periodic_nr]);
-   loop->periodic_tasks[loop->periodic_nr]->closure = cb;
+   struct periodic_task *task = malloc(sizeof(*task));
+   task->interval = seconds * 1000ULL + ns / 1000000;
+   task->loop = loop;
+   task->closure = cb;
+   timer_init(&task->timer, evloop_on_periodic_task, task);
+   loop->periodic_tasks[loop->periodic_nr] = task;
    loop->periodic_nr++;
+
+   evloop_add_timer(loop, &task->timer, task->interval);
 }
 
 int evloop_wait(struct evloop *el)
 {
    int rc;
    int events;
-   long int timer = 0L;
-   int periodic_done = 0;
+#ifdef HAVE_IO_URING
+   if(el->backend == EVLOOP_URING)
+	   return uring_wait(el);
+#endif
    while(1)
    {
-	events = epoll_wait(el->epollfd, el->events, el->max_events, el->timeout);
+	events = epoll_wait(el->epollfd, el->events, el->max_events,
+			    el->deferred_nr > 0 ? 0 : el->timeout);
 	if(events < 0)
 	{
 	   if(errno == EINTR)
@@ -336,56 +916,78 @@ int evloop_wait(struct evloop *el)
 	   break;
 	}
 
+	evloop_update_time(el);
+
+	/* Closures deleted earlier in the batch resolve to nothing */
 	for(int i = 0; i < events; i++)
 	{
+	    struct closure *closure = evloop_watched(el, el->events[i].data.u64);
+	    if(!closure)
+		    continue;
+
 	    if((el->events[i].events & EPOLLERR) ||
-		(el->events[i].events & EPOLLHUP) ||
-		(el->events[i].events & EPOLLIN) &&
-		(el->events[i].events & EPOLLOUT))
+		(el->events[i].events & EPOLLHUP))
 	    {
-		perror("epoll_wait(2)");
-		shutdown(el->events[i].data.fd, 0);
-		close(el->events[i].data.fd);
-		el->status = errno;
+		evloop_on_error(el, closure);
 		continue;
 	    }
 
-	    struct closure *closure = el->events[i].data.prt;
-	    periodic_done = 0;
-	    for(int j = 0; j < el->periodic_nr && periodic_done == 0; ++j)
-	    {
-		if(el->events[j].data.fd == el->periodic_tasks[j]->timerfd)
-		{
-		   struct closure *c = el->periodic_tasks[j]->closure;
-		   (void)read(el->events.data.fd, &timer, 8);
-		   c->call(el, c->args);
-		   periodic_done = 1;
-		}
-	    }
-
-	    if(periodic_done == 1)
-		    continue;
-
 	    closure->call(el, closure->args);
 	}
+
+	evloop_run_deferred(el);
    }
 
    return rc;
 }
 
 
-int evloop_rearm_callback_read(struct evloop el, struct closure *cb)
+int evloop_rearm_callback_read(struct evloop *el, struct closure *cb)
 {
-   return epoll_mod(el->epollfd, cb->fd, EPOLLIN, cb);
+#ifdef HAVE_IO_URING
+   if(el->backend == EVLOOP_URING)
+	   return uring_poll_arm(el, cb, POLLIN);
+#endif
+   return epoll_mod(el->epollfd, cb->fd, EPOLLIN,
+		    evloop_handle(el, cb));
 }
 
 
-int evloop_rearm_callback_write(struct evloop el, struct closure *cb)
+int evloop_rearm_callback_write(struct evloop *el, struct closure *cb)
+{
+#ifdef HAVE_IO_URING
+   if(el->backend == EVLOOP_URING)
+	   return uring_poll_arm(el, cb, POLLOUT);
+#endif
+   return epoll_mod(el->epollfd, cb->fd, EPOLLOUT,
+		    evloop_handle(el, cb));
+}
+
+int evloop_rearm_callback_rw(struct evloop *el, struct closure *cb)
 {
-   return epoll_mod(el->epollfd, cb->fd, EPOLLOUT, cb);
+#ifdef HAVE_IO_URING
+   if(el->backend == EVLOOP_URING)
+	   return uring_poll_arm(el, cb, POLLIN | POLLOUT);
+#endif
+   return epoll_mod(el->epollfd, cb->fd, EPOLLIN | EPOLLOUT,
+		    evloop_handle(el, cb));
 }
 
+/*
+ * Must run before the owner closes the fd or frees the closure; nothing
+ * queued for it on the loop reaches it afterwards.
+ */
 int evloop_del_callback(struct evloop *el, struct closure *cb)
 {
-   return epoll_del(el->epollfd, cb->fd);
+   int rc;
+   if(!cb->watch)
+	   return 0;
+#ifdef HAVE_IO_URING
+   if(el->backend == EVLOOP_URING)
+	   rc = uring_poll_cancel(el, cb);
+   else
+#endif
+	   rc = epoll_del(el->epollfd, cb->fd);
+   evloop_unwatch(el, cb);
+   return rc;
 }
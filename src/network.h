@@ -5,6 +5,9 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include "util.h"
+#include "mqtt.h"
+#include "pack.h"
+#include "timer.h"
 
 
 #define UNIX 0
@@ -18,62 +21,230 @@ int create_and_bind(const char *, const char *, int);
 
 int make_listen(const char *, const char *, int);
 
-int accept_connection(int);
+struct sockaddr_storage;
+
+int accept_connection(int, struct sockaddr_storage *);
 
 ssize_t send_bytes(int, const unsigned char *, size_t);
 
 ssize_t recv_bytes(int, unsigned char *, size_t);
 
 
-struct evloop
+struct evloop;
+
+typedef void callback(struct evloop *, void *);
+
+#define OUTBUF_MAX_FRAGS 4
+#define OUTBUF_INLINE_LEN 16
+#define OUTQUEUE_MAX_IOV 64
+
+/*
+ * Outbound queue of a connection. Each queued packet is a list of
+ * fragments written with a single sendmsg(2) together with the packets
+ * behind it; fragments either point into the shared owner buffer or into
+ * the few inline bytes carried by the packet itself (fixed header, packet
+ * id). cur and off mark how much of the packet already went out, bytes
+ * counts what is still unsent in the whole queue.
+ */
+struct outfrag
 {
-   int epollfd;
-   int max_events;
-   int timeout;
-   int status;
-   struct epoll_event *events;
+	const unsigned char *data;
+	size_t len;
+};
 
-   int periodic_maxsize;
-   int periodic_nr;
-   struct 
-   {
-      int timerfd;
-      struct closure *closure;
-   } **periodic_tasks; 
-}evloop;
+struct outbuf
+{
+	struct outbuf *next;
+	struct bytestring *owner;
+	int nfrags;
+	int cur;
+	size_t off;
+	size_t size;
+	size_t inline_len;
+	struct outfrag frags[OUTBUF_MAX_FRAGS];
+	unsigned char inline_data[OUTBUF_INLINE_LEN];
+};
 
+struct outqueue
+{
+	struct outbuf *head;
+	struct outbuf *tail;
+	size_t bytes;
+	size_t len;
+};
 
-typedef void callback(struct evloop *, void *);
+struct outbuf *outbuf_create(struct bytestring *);
+int outbuf_add(struct outbuf *, const unsigned char *, size_t);
+unsigned char *outbuf_inline(struct outbuf *, size_t);
+void outbuf_release(struct outbuf *);
+
+void outqueue_init(struct outqueue *);
+void outqueue_append(struct outqueue *, struct outbuf *);
+ssize_t outqueue_flush(int, struct outqueue *);
+void outqueue_clear(struct outqueue *);
 
 struct closure
 {
 	int fd;
 	void *obj;
 	void *args;
-	char closure_id[UUIN_LEN];
+	unsigned gen;
 	struct bytestring *payload;
+	struct bytestring *rbuf;
+	size_t rpos;
+	struct mqtt_parser parser;
+	struct outqueue outq;
+	int paused;
+	struct timer timer;
+	unsigned long long last_seen;
+	unsigned short keepalive;
+	int connected;
+	unsigned watch;
+	unsigned armed;
 	callback *call;
+	callback *on_error;
+};
+
+/*
+ * Connections indexed by fd. Descriptors are unique in the process and a
+ * slot is only written by the reactor owning its fd, so lookups take no
+ * lock and no hashing. The slot generation is bumped every time a
+ * connection takes or leaves it; (fd, gen) keeps naming the same
+ * connection after the fd number has been reused. backlog mirrors the
+ * bytes waiting on the connection outbound queue, for other reactors to
+ * read.
+ */
+struct connslot
+{
+	struct closure *closure;
+	unsigned gen;
+	size_t backlog;
 };
 
+#define CONNTABLE_DEFAULT_SIZE (1024 * 1024)
+
+struct conntable
+{
+	struct connslot *slots;
+	size_t size;
+};
+
+#define CONN_HANDLE(fd, gen) (((uint64_t)(gen) << 32) | (uint32_t)(fd))
+#define CONN_HANDLE_FD(h) ((int)((h) & 0xFFFFFFFF))
+#define CONN_HANDLE_GEN(h) ((unsigned)((h) >> 32))
+
+int conntable_init(struct conntable *);
+int conntable_put(struct conntable *, struct closure *);
+struct closure *conntable_get(const struct conntable *, int, unsigned);
+void conntable_del(struct conntable *, struct closure *);
+void conntable_set_backlog(struct conntable *, const struct closure *, size_t);
+size_t conntable_backlog(const struct conntable *, uint64_t);
+void conntable_free(struct conntable *, void (*)(struct closure *));
+
+#define EVLOOP_EPOLL 0
+#define EVLOOP_URING 1
+
+struct ring;
+
+/*
+ * Closures registered on a loop are named by a watch handle, their slot in
+ * the loop watch table and the generation of the slot, which is what goes
+ * in epoll event data and io_uring user_data. Deleting a closure moves the
+ * slot generation on, so events and completions still pending for it
+ * resolve to nothing instead of reaching freed memory. Handle 0 is never
+ * given out and tags the loop own requests (cancels, poll updates).
+ */
+struct watch
+{
+   struct closure *closure;
+   unsigned gen;
+   unsigned next;
+};
+
+#define WATCH_HANDLE(idx, gen) (((uint64_t)(gen) << 32) | (uint32_t)(idx))
+#define WATCH_HANDLE_IDX(h) ((unsigned)((h) & 0xFFFFFFFF))
+#define WATCH_HANDLE_GEN(h) ((unsigned)((h) >> 32))
+
+struct periodic_task
+{
+   struct timer timer;
+   unsigned long long interval;
+   struct evloop *loop;
+   struct closure *closure;
+};
+
+/*
+ * Every timer of the loop lives in its timing wheel, a single timerfd is
+ * armed for the next tick the wheel has work on; now is the monotonic
+ * time in milliseconds, refreshed at each wakeup.
+ */
+struct evloop
+{
+   int backend;
+   int epollfd;
+   int max_events;
+   int timeout;
+   int status;
+   struct epoll_event *events;
+   struct ring *ring;
+
+   unsigned watches_size;
+   unsigned watches_nr;
+   unsigned watches_free;
+   struct watch *watches;
+
+   unsigned long long now;
+   long long timer_deadline;
+   struct timer_wheel wheel;
+   struct closure timer_closure;
+
+   int periodic_maxsize;
+   int periodic_nr;
+   struct periodic_task **periodic_tasks; 
+
+   int deferred_maxsize;
+   int deferred_nr;
+   uint64_t *deferred;
+};
+
+
 struct evloop *evloop_create(int, int);
 void evloop_init(struct evloop *, int, int);
 void evloop_free(struct evloop *);
 
 int evloop_wait(struct evloop *);
-void evloop_add_callback(struct evloop *, struct clousure *);
+void evloop_add_callback(struct evloop *, struct closure *);
 
 
 void evloop_add_periodic_task(struct evloop *,
 			       int,
 			       unsigned long long,
-			       struct clousure *);
+			       struct closure *);
+
+int evloop_del_callback(struct evloop *, struct closure *);
+
+int evloop_defer_callback(struct evloop *, struct closure *);
+
+unsigned long long evloop_now(const struct evloop *);
+
+/*
+ * Fire the timer on the loop thread, the given milliseconds from now. Used
+ * for connect and keepalive deadlines; QoS retransmit deadlines would
+ * go through here too, but inflight messages are not tracked yet, so
+ * none are armed.
+ */
+void evloop_add_timer(struct evloop *, struct timer *, unsigned long long);
+
+void evloop_del_timer(struct evloop *, struct timer *);
+
+int evloop_rearm_callback_read(struct evloop *, struct closure *);
 
-int evloop_del_callback(struct evloop *, struct clousure *);
+int evloop_rearm_callback_write(struct evloop *, struct closure *);
 
-int evloop_rearm_callback_read(struct evloop *, struct clousure *);
+int evloop_rearm_callback_rw(struct evloop *, struct closure *);
 
-int epoll_add(int, int, int, void *);
-int epoll_mod(int, int, int, void *);
+int epoll_add(int, int, int, uint64_t);
+int epoll_mod(int, int, int, uint64_t);
 int epoll_del(int, int);
 
 #endif
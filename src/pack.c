@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include "pack.h"
+#include "pool.h"
 
 uint8_t unpack_u8(const uint8_t **buf)
 {
@@ -37,9 +38,18 @@ uint8_t *unpack_bytes(const uint8_t **buf, size_t len, uint8_t *str)
 
 uint16_t unpack_string16(uint8_t **buf, uint8_t **dest)
 {
-  uint16_t len = unpack_u16(buf);
+  uint16_t len = unpack_u16((const uint8_t **) buf);
   *dest = malloc(len+1);
-  *dest = unpack_bytes(buf,len,*dest);
+  *dest = unpack_bytes((const uint8_t **) buf,len,*dest);
+  return len;
+}
+
+/* Point dest at the string inside buf instead of copying it */
+uint16_t unpack_string16_view(uint8_t **buf, uint8_t **dest)
+{
+  uint16_t len = unpack_u16((const uint8_t **) buf);
+  *dest = *buf;
+  (*buf) += len;
   return len;
 }
 
@@ -64,17 +74,73 @@ void pack_u32(uint8_t **buf, uint32_t val)
   (*buf) += sizeof(uint32_t);
 }
 
-void pack_bytes(uint8_t **buf, uint8_t *str)
+/* Length is always known by the caller, payloads may well hold NULs */
+void pack_bytes(uint8_t **buf, const uint8_t *str, size_t len)
 {
-  size_t len = strlen((char*)str);
   memcpy(*buf, str, len);
   (*buf)+=len;
 }
 
-struct bytestring *bytstring_create(size_t len)
+/*
+ * Small bytestrings come from thread local pools, one per size class, with
+ * the data laid right after the struct so create is one allocation (none
+ * once the pool is warm).
+ */
+static const size_t bytestring_classes[BYTESTRING_POOL_CLASSES] = {
+   64, 256, 1024, 4096
+};
+
+static __thread struct pool bytestring_pools[BYTESTRING_POOL_CLASSES] = {
+   POOL_INIT(sizeof(struct bytestring) + 64),
+   POOL_INIT(sizeof(struct bytestring) + 256),
+   POOL_INIT(sizeof(struct bytestring) + 1024),
+   POOL_INIT(sizeof(struct bytestring) + 4096)
+};
+
+static int bytestring_class(size_t len)
+{
+  for(int i = 0; i < BYTESTRING_POOL_CLASSES; i++)
+	  if(len <= bytestring_classes[i])
+		  return i;
+  return -1;
+}
+
+static int bytestring_inline(const struct bytestring *bstring)
+{
+  return bstring->data == (unsigned char *)(bstring + 1);
+}
+
+struct bytestring *bytestring_create(size_t len)
+{
+  int class = bytestring_class(len);
+  struct bytestring *bstring;
+  if(class < 0)
+	  bstring = malloc(sizeof(*bstring) + len);
+  else
+	  bstring = pool_alloc(&bytestring_pools[class]);
+  if(!bstring)
+	  return NULL;
+  bstring->size = len;
+  bstring->last = 0;
+  bstring->refs = 1;
+  bstring->pool = class;
+  bstring->data = (unsigned char *)(bstring + 1);
+  return bstring;
+}
+
+struct bytestring *bytestring_wrap(unsigned char *data, size_t size)
 {
   struct bytestring *bstring = malloc(sizeof(*bstring));
-  bytestring_init(bstring, len);
+  if(!bstring)
+  {
+	  free(data);
+	  return NULL;
+  }
+  bstring->size = size;
+  bstring->last = size;
+  bstring->refs = 1;
+  bstring->pool = -1;
+  bstring->data = data;
   return bstring;
 }
 
@@ -83,16 +149,31 @@ void bytestring_init(struct bytestring *bstring, size_t size)
   if(!bstring)
 	  return;
   bstring->size = size;
+  bstring->refs = 1;
+  bstring->pool = -1;
   bstring->data = malloc(sizeof(unsigned char) * size);
   bytestring_reset(bstring);
 }
 
+struct bytestring *bytestring_ref(struct bytestring *bstring)
+{
+   if(bstring)
+	   __atomic_add_fetch(&bstring->refs, 1, __ATOMIC_RELAXED);
+   return bstring;
+}
+
 void bytestring_release(struct bytestring *bstring)
 {
    if(!bstring)
 	   return;
-   free(bstring->data);
-   free(bstring);
+   if(__atomic_sub_fetch(&bstring->refs, 1, __ATOMIC_ACQ_REL) > 0)
+	   return;
+   if(!bytestring_inline(bstring))
+	   free(bstring->data);
+   if(bstring->pool >= 0)
+	   pool_free(&bytestring_pools[bstring->pool], bstring);
+   else
+	   free(bstring);
 }
 
 void bytestring_reset(struct bytestring *bstring)
@@ -102,3 +183,31 @@ void bytestring_reset(struct bytestring *bstring)
 	bstring->last = 0;
 	memset(bstring->data, 0, bstring->size);
 }
+
+int bytestring_grow(struct bytestring *bstring, size_t size)
+{
+	if(!bstring)
+		return -1;
+	if(size <= bstring->size)
+		return 0;
+	unsigned char *data;
+	if(bytestring_inline(bstring))
+	{
+		if(bstring->pool >= 0 && size <= bytestring_classes[bstring->pool])
+		{
+			bstring->size = size;
+			return 0;
+		}
+		/* Inline data can't be reallocated, move it out of the struct */
+		data = malloc(size);
+		if(data)
+			memcpy(data, bstring->data, bstring->last);
+	}
+	else
+		data = realloc(bstring->data, size);
+	if(!data)
+		return -1;
+	bstring->data = data;
+	bstring->size = size;
+	return 0;
+}
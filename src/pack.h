@@ -14,25 +14,39 @@ uint8_t* unpack_bytes(const uint8_t **, size_t ,uint8_t *);
 
 uint16_t unpack_string16(uint8_t **buf, uint8_t **dest);
 
+uint16_t unpack_string16_view(uint8_t **buf, uint8_t **dest);
+
 void pack_u8(uint8_t **, uint8_t );
 
 void pack_u16(uint8_t **, uint16_t );
 
 void pack_u32(uint8_t **, uint32_t );
 
-void pack_bytes(uint8_t **, uint8_t *);
+void pack_bytes(uint8_t **, const uint8_t *, size_t);
+
+#define BYTESTRING_POOL_CLASSES 4
 
+/*
+ * Reference counted, a buffer shared by several outbound queues is freed
+ * by the last bytestring_release. pool is the size class the bytestring
+ * was taken from, -1 if it was malloc'ed.
+ */
 struct bytestring 
 {
   size_t size;
   size_t last;
+  int refs;
+  int pool;
   unsigned char *data;
 };
 
 struct bytestring *bytestring_create(size_t);
+struct bytestring *bytestring_wrap(unsigned char *, size_t);
 void bytestring_init(struct bytestring *, size_t);
+struct bytestring *bytestring_ref(struct bytestring *);
 void bytestring_release(struct bytestring *);
-void bytestring_reset(string bytestring *);
+void bytestring_reset(struct bytestring *);
+int bytestring_grow(struct bytestring *, size_t);
 
 #endif
 
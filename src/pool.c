@@ -0,0 +1,42 @@
+#include <stdlib.h>
+#include "pool.h"
+
+
+struct pool_obj
+{
+   struct pool_obj *next;
+};
+
+void pool_init(struct pool *p, size_t objsize, size_t max_free)
+{
+   p->objsize = objsize < sizeof(struct pool_obj) ?
+	   sizeof(struct pool_obj) : objsize;
+   p->nfree = 0;
+   p->max_free = max_free;
+   p->free = NULL;
+}
+
+void *pool_alloc(struct pool *p)
+{
+   struct pool_obj *obj = p->free;
+   if(!obj)
+	   return malloc(p->objsize);
+   p->free = obj->next;
+   p->nfree--;
+   return obj;
+}
+
+void pool_free(struct pool *p, void *ptr)
+{
+   if(!ptr)
+	   return;
+   if(p->nfree >= p->max_free)
+   {
+	free(ptr);
+	return;
+   }
+   struct pool_obj *obj = ptr;
+   obj->next = p->free;
+   p->free = obj;
+   p->nfree++;
+}
@@ -0,0 +1,31 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+
+/*
+ * Free list of fixed size objects. Pools are meant to be thread local, one
+ * per reactor thread, so alloc and free take no lock; an object released
+ * by another thread simply lands on that thread's list. Up to max_free
+ * objects are kept, the rest go back to malloc.
+ */
+#define POOL_MAX_FREE 1024
+
+struct pool
+{
+   size_t objsize;
+   size_t nfree;
+   size_t max_free;
+   void *free;
+};
+
+#define POOL_INIT(size) \
+   { .objsize = (size), .nfree = 0, .max_free = POOL_MAX_FREE, .free = NULL }
+
+void pool_init(struct pool *, size_t, size_t);
+
+void *pool_alloc(struct pool *);
+
+void pool_free(struct pool *, void *);
+
+#endif
@@ -1,27 +1,82 @@
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "mqtt.h"
 #include "network.h"
-#include "pack.c"
+#include "pack.h"
 #include "util.h"
 #include "server.h"
 #include "core.h"
 #include "config.h"
 #include "hashtable.h"
+#include "slab.h"
+#include "epoch.h"
 
 
 static const double SOL_SECONDS = 88775.24;
 
-static struct sol_info info;
 static struct sol sol;
 
+/* Fixed size objects living as long as a connection */
+static struct slab closure_slab;
+static struct slab client_slab;
+
+static struct conntable connections;
+
+/*
+ * A PUBLISH received on one reactor is handed to every other reactor
+ * owning a matching subscriber, as told by the match cache entry of the
+ * origin, as its interned topic and a reference to the body (topic then
+ * payload) shared by all of them; each reactor then delivers it only to
+ * the subscribers whose connection it owns. A reactor also hands itself the
+ * rest of a fan-out too large to run at once, as a reference to the
+ * subscribers of the match cache entry and the offset still to reach
+ * them from.
+ */
+struct handoff
+{
+   struct handoff *next;
+   unsigned short pkt_id;
+   const struct interned *topic;
+   unsigned short payloadlen;
+   struct bytestring *body;
+   struct match_subs *subs;
+   size_t sent;
+};
+
+struct reactor
+{
+   int id;
+   pthread_t thread;
+   struct evloop *loop;
+   struct closure server;
+   struct closure inbox;
+   pthread_mutex_t inbox_lock;
+   struct handoff *inbox_head;
+   struct handoff *inbox_tail;
+   struct sol_info info;
+};
+
+static int nreactors;
+static struct reactor *reactors;
+static __thread struct reactor *reactor;
+
+/* Counters are written by their own reactor only and summed by the stats task */
+#define stat_add(field, n) \
+   __atomic_fetch_add(&reactor->info.field, (n), __ATOMIC_RELAXED)
+#define stat_get(r, field) __atomic_load_n(&(r)->info.field, __ATOMIC_RELAXED)
+
 typedef int handler(struct closure *, union mqtt_packet *);
 
+static void on_client_timer(struct timer *);
+
 static int connect_handler(struct closure *, union mqtt_packet *);
 static int disconnect_handler(struct closure *, union mqtt_packet *);
 static int subscribe_handler(struct closure *, union mqtt_packet *);
@@ -34,7 +89,7 @@ static int pubcomp_handler(struct closure *, union mqtt_packet *);
 static int pingreq_handler(struct closure *, union mqtt_packet *);
 
 
-static handler *handler[15] =
+static handler *handlers[15] =
 {
   NULL,
   connect_handler,
@@ -55,182 +110,763 @@ static handler *handler[15] =
 
 struct connection 
 {
-   char ip[INET_ADDRSTRLEN + 1];
+   char ip[INET6_ADDRSTRLEN + 1];
    int fd;
 };
 
 static void on_read(struct evloop *, void *);
 static void on_write(struct evloop *, void *);
-static void on_accep(struct evloop *, void *);
+static void on_accept(struct evloop *, void *);
+static void on_handoff(struct evloop *, void *);
+static void on_client_error(struct evloop *, void *);
 
 
 static void publish_stats(struct evloop *, void *);
 
-static int accept_new_client(int fd, struct connection *conn)
-{
-   if(!conn)
-	   return -1;
-
-   int clientsock = accept_connection(fd);
-   if(clientsock == -1)
-	   return -1;
+static void publish_memory_stats(void);
 
-   struct sockaddr_in addr;
-   socklen_t addrlen = sizeof(addr);
+static void closure_free(struct closure *);
 
-   if(getpeername(clientsock, (struct sockaddr *) &addr, &addrlen) < 0)
-	   return -1;
+static void publish_message(unsigned short, const struct interned *,
+			    unsigned short, unsigned char *);
 
-   char ip_buff[INET_ADDRSTRLEN + 1];
-   if(inet_ntop(AF_INET, &addr.sin_addr, ip_buf, sizeof(ip_buf)) == NULL)
-	   return -1;
+/*
+ * Returns 1 when a client was accepted, 0 when the backlog is empty and -1
+ * on error.
+ */
+static int accept_new_client(int fd, struct connection *conn)
+{
+   struct sockaddr_storage addr;
 
-   struct sockaddr_in sin;
-   socket_len sinlen = sizeof(sin);
-   if(getsockname(fd, (struct sockaddr*)&sin, &sinlen) < 0)
-	   return -1;
+   int clientsock = accept_connection(fd, &addr);
+   if(clientsock == -1)
+	   return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
 
    conn->fd = clientsock;
-   strcpy(conn->ip, ip_buf);
-   return 0;
+   conn->ip[0] = '\0';
+   if(addr.ss_family == AF_INET)
+	   inet_ntop(AF_INET, &((struct sockaddr_in *) &addr)->sin_addr,
+			   conn->ip, sizeof(conn->ip));
+   else if(addr.ss_family == AF_INET6)
+	   inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &addr)->sin6_addr,
+			   conn->ip, sizeof(conn->ip));
+   else
+	   strcpy(conn->ip, "unix");
+   return 1;
 }
 
-static void on_accept(struct evloop *loop, void *arg)
+static int connect_timeout(void)
 {
-   struct closure *server = arg;
-   struct connection conn;
-   accept_new_client(server->fd, &conn);
+   return conf->connect_timeout > 0 ? conf->connect_timeout : CONNECT_TIMEOUT;
+}
 
-   struct closure *client_closure = malloc(sizeof(*client_closure));
+static void add_client(struct evloop *loop, struct connection *conn)
+{
+   struct closure *client_closure = slab_alloc(&closure_slab);
    if(!client_closure)
+   {
+	   close(conn->fd);
 	   return;
+   }
 
-   client_closure->fd = conn.fd;
+   client_closure->fd = conn->fd;
    client_closure->obj = NULL;
    client_closure->payload = NULL;
+   client_closure->rbuf = bytestring_create(READ_BUFSIZE);
+   if(!client_closure->rbuf)
+   {
+	   sol_error("No read buffer for fd %d", conn->fd);
+	   slab_free(&closure_slab, client_closure);
+	   close(conn->fd);
+	   return;
+   }
+   client_closure->rpos = 0;
+   mqtt_parser_init(&client_closure->parser);
+   outqueue_init(&client_closure->outq);
+   client_closure->paused = 0;
+   client_closure->connected = 0;
+   client_closure->keepalive = 0;
+   client_closure->last_seen = evloop_now(loop);
    client_closure->args = client_closure;
    client_closure->call = on_read;
-   generate_uuid(client_closure->closure_id);
-   hashtable_put(sol.closures, client_closure->closure_id, client_closure);
-   
+   client_closure->on_error = on_client_error;
+   if(conntable_put(&connections, client_closure) < 0)
+   {
+	   sol_error("No connection slot for fd %d", conn->fd);
+	   close(conn->fd);
+	   closure_free(client_closure);
+	   return;
+   }
+
    evloop_add_callback(loop, client_closure);
-   evloop_rearm_callback_read(loop, server);
 
-   info.nclients++;
-   info.nconnections++;
-   sol_info("New connection from %s on port %s", conn.ip, conf->port);
-}
+   /* A client has connect_timeout seconds to send its CONNECT */
+   timer_init(&client_closure->timer, on_client_timer, client_closure);
+   evloop_add_timer(loop, &client_closure->timer, connect_timeout() * 1000ULL);
 
+   stat_add(nclients, 1);
+   stat_add(nconnections, 1);
+   sol_debug("New connection from %s on port %s", conn->ip, conf->port);
+}
 
-static ssize_t recv_packet(int clientfd, unsigned char *buf, char *command)
+/*
+ * Drain the listen backlog, up to conf->accept_batch clients per wakeup;
+ * past the cap the listener yields to the other connections on the loop
+ * and picks up the rest right after them.
+ */
+static void on_accept(struct evloop *loop, void *arg)
 {
-   ssize_t nbytes = 0;
-   if((nbytes = recv_bytes(clientfd, buf, 1)) <= 0)
-	   return -ERRCLIENTDC;
-   unsigned char byte = *buf;
-   buf++;
-   if(DISCONNECT < byte || CONNECT > byte)
-   	return -ERRPACKETERR;
-   
-   unsigned char buff[4];
-   int count = 0;
-   int n = 0;
-   do
+   struct closure *server = arg;
+   struct connection conn;
+   int batch = conf->accept_batch > 0 ? conf->accept_batch : ACCEPT_BATCH;
+   int rc = 0;
+   int accepted = 0;
+
+   while(accepted < batch && (rc = accept_new_client(server->fd, &conn)) > 0)
    {
- 	if((n = recv_bytes(clientfd, buf+count, 1)) <= 0)
-		return -ERRCLIENTDC;
-	buff[count] = buf[count];
-	nbytes += n;
-   }while(buff[count++] & (1 << 7));
+	add_client(loop, &conn);
+	accepted++;
+   }
 
+   if(rc < 0)
+	   sol_error("Error accepting connections: %s", strerror(errno));
+
+   if(accepted < batch || evloop_defer_callback(loop, server) < 0)
+	   evloop_rearm_callback_read(loop, server);
+}
 
-   const unsigned char *pbuf = &buff[0];
-   unsigned long long tlen = mqtt_decode_length(&pbuf);
 
-   if(tlen > conf->max_request_size)
+/*
+ * Fill the connection read buffer with one large non-blocking read,
+ * compacting already consumed frames away first and growing the buffer
+ * when a single frame does not fit.
+ */
+static ssize_t fill_read_buffer(struct closure *cb)
+{
+   struct bytestring *rbuf = cb->rbuf;
+
+   if(cb->rpos > 0)
    {
-	   nbytes = -ERRMAXREQSIZE;
-	   goto exit;
+	memmove(rbuf->data, rbuf->data + cb->rpos, rbuf->last - cb->rpos);
+	rbuf->last -= cb->rpos;
+	cb->rpos = 0;
    }
 
-   if((n = recv_bytes(clientfd, buf + 1, tlen)) < 0)
-	   goto err;
-   nbytes += n;
-   *command = byte;
-exit:
-   return nbytes;
-err:
-   shutdown(clienfd, 0);
-   close(clientfd);
-   return nbytes;
+   if(rbuf->last == rbuf->size)
+   {
+	size_t size = rbuf->size * 2;
+	if(size > conf->max_request_size + MQTT_HEADER_LEN + 3)
+		size = conf->max_request_size + MQTT_HEADER_LEN + 3;
+	if(size <= rbuf->size || bytestring_grow(rbuf, size) < 0)
+		return -ERRMAXREQSIZE;
+   }
+
+   ssize_t n = recv(cb->fd, rbuf->data + rbuf->last,
+		    rbuf->size - rbuf->last, 0);
+   if(n < 0)
+   {
+	if(errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+	return -ERRCLIENTDC;
+   }
+   if(n == 0)
+	   return -ERRCLIENTDC;
+
+   rbuf->last += n;
+   cb->last_seen = evloop_now(reactor->loop);
+   stat_add(bytes_recv, n);
+   return n;
+}
+
+static void close_connection(struct closure *cb)
+{
+  evloop_del_timer(reactor->loop, &cb->timer);
+  evloop_del_callback(reactor->loop, cb);
+  conntable_del(&connections, cb);
+  shutdown(cb->fd, 0);
+  close(cb->fd);
+
+  if(cb->obj)
+  {
+     struct sol_client *client = cb->obj;
+     pthread_mutex_lock(&sol.topics_lock);
+     sol_client_unsubscribe_all(&sol, client);
+     pthread_mutex_unlock(&sol.topics_lock);
+     sharded_hashtable_del(sol.clients, client->client_id);
+  }
+  closure_free(cb);
+  stat_add(nclients, -1);
+  stat_add(nconnections, -1);
 }
 
+/* Error or hang-up reported by the loop on the client socket */
+static void on_client_error(struct evloop *loop, void *arg)
+{
+  (void)loop;
+  close_connection(arg);
+}
 
-static void on_read(struct evloop *loop, void *arg)
+/*
+ * Keepalive grace is one and a half times the interval the client asked
+ * for (MQTT 3.1.1 3.1.2.10); every byte received pushes the deadline
+ * forward, so the timer is only rescheduled when it fires early.
+ */
+static void on_client_timer(struct timer *t)
 {
-  struct closure *cb = arg;
+  struct closure *cb = t->args;
 
-  unsigned char *buffer = malloc(conf->max_request_size);
-  ssize_t bytes = 0;
-  char command = 0;
+  if(!cb->connected)
+  {
+     sol_debug("Closing half-open connection");
+     close_connection(cb);
+     return;
+  }
 
-  bytes = recv_packet(cb->fd, buffer, &command);
-  if(bytes == -ERRCLIENTDC || bytes == -ERRMAXREQSIZE)
-	  goto exit;
+  unsigned long long now = evloop_now(reactor->loop);
+  unsigned long long grace = cb->keepalive * 1500ULL;
+  if(now - cb->last_seen >= grace)
+  {
+     sol_debug("Keepalive expired, closing connection");
+     close_connection(cb);
+     return;
+  }
 
-  if(bytes == -ERRPACKETERR)
-	  goto errdc;
-  info.bytes_recv++;
+  evloop_add_timer(reactor->loop, t, grace - (now - cb->last_seen));
+}
+
+static size_t high_watermark(void)
+{
+  return conf->outq_hwm > 0 ? conf->outq_hwm : OUTQ_HWM;
+}
 
-  union mqtt_packet packet;
-  unpack_mqtt_packet(buffer, &packet);
-  union mqtt_header header hdr = {.byte = command};
-  int rc = handlers[hdr.bits.type](cb, &packet);
-  if(rc == REARM_W)
+static size_t low_watermark(void)
+{
+  return conf->outq_lwm > 0 ? conf->outq_lwm : OUTQ_LWM;
+}
+
+/* Hard limit of the outbound queue, a multiple of the high watermark */
+static size_t outq_limit(void)
+{
+  int factor = conf->outq_max_factor > 0 ?
+	  conf->outq_max_factor : OUTQ_MAX_FACTOR;
+  return high_watermark() * factor;
+}
+
+/*
+ * Queue a packet on the client outbound queue. Past the high watermark
+ * reads from the client are paused until the queue drains below the low
+ * watermark, and droppable (QoS0) packets are discarded if so configured.
+ * Past the hard limit droppable packets are always discarded, anything
+ * else gets the client disconnected: the socket is shut down and the
+ * loop reports the hang-up to the owner close path.
+ */
+static int enqueue_outbuf(struct closure *cb,
+			  struct outbuf *ob,
+			  int droppable)
+{
+  if(!ob)
+	  return -1;
+
+  if(droppable && conf->outq_drop_qos0 && cb->outq.bytes >= high_watermark())
+  {
+     outbuf_release(ob);
+     stat_add(messages_dropped, 1);
+     return -1;
+  }
+
+  if(cb->outq.bytes >= outq_limit())
+  {
+     outbuf_release(ob);
+     stat_add(messages_dropped, 1);
+     if(!droppable)
+     {
+	sol_debug("Outbound queue of fd %d full, disconnecting", cb->fd);
+	shutdown(cb->fd, SHUT_RDWR);
+     }
+     return -1;
+  }
+
+  outqueue_append(&cb->outq, ob);
+  conntable_set_backlog(&connections, cb, cb->outq.bytes);
+  if(cb->outq.bytes >= high_watermark())
+	  cb->paused = 1;
+  return 0;
+}
+
+static int flush_outbound(struct closure *cb)
+{
+  ssize_t sent = outqueue_flush(cb->fd, &cb->outq);
+  if(sent < 0)
+  {
+     sol_error("Error writing on socket %d: %s", cb->fd, strerror(errno));
+     return -1;
+  }
+
+  stat_add(bytes_sent, sent);
+  conntable_set_backlog(&connections, cb, cb->outq.bytes);
+  if(cb->paused && cb->outq.bytes <= low_watermark())
+	  cb->paused = 0;
+  return 0;
+}
+
+/*
+ * Handle the complete frames already sitting in the read buffer, at most
+ * budget of them, queueing any reply a handler leaves in cb->payload.
+ * Stops early once the client is paused by its outbound queue.
+ */
+static int process_frames(struct evloop *loop, struct closure *cb, int *budget)
+{
+  struct bytestring *rbuf = cb->rbuf;
+  long long frame_len = 0;
+
+  while(*budget > 0 && !cb->paused)
+  {
+     frame_len = mqtt_parse_frame(&cb->parser,
+				  rbuf->data + cb->rpos,
+				  rbuf->last - cb->rpos,
+				  conf->max_request_size);
+     if(frame_len <= 0)
+	     break;
+
+     const unsigned char *frame = rbuf->data + cb->rpos;
+     cb->rpos += frame_len;
+     (*budget)--;
+     stat_add(messages_recv, 1);
+
+     union mqtt_packet packet;
+     union mqtt_header hdr = {.byte = *frame};
+     /* CONNECT comes first and only once */
+     if(!handlers[hdr.bits.type] ||
+		     (hdr.bits.type == CONNECT) != (cb->obj == NULL) ||
+		     unpack_mqtt_packet_view(frame, &packet) < 0)
+     {
+	frame_len = -1;
+	break;
+     }
+     if(hdr.bits.type == CONNECT && !cb->connected)
+     {
+	cb->connected = 1;
+	cb->keepalive = packet.connect.payload.keepalive;
+	if(cb->keepalive > 0)
+		evloop_add_timer(loop, &cb->timer, cb->keepalive * 1500ULL);
+	else
+		evloop_del_timer(loop, &cb->timer);
+     }
+     int rc = handlers[hdr.bits.type](cb, &packet);
+     mqtt_packet_release_view(&packet, hdr.bits.type);
+     if(rc < 0)
+     {
+	close_connection(cb);
+	return -1;
+     }
+     if(rc == REARM_W && cb->payload)
+     {
+	struct outbuf *ob = outbuf_create(cb->payload);
+	if(ob && outbuf_add(ob, cb->payload->data, cb->payload->size) < 0)
+	{
+		outbuf_release(ob);
+		ob = NULL;
+	}
+	enqueue_outbuf(cb, ob, 0);
+	cb->payload = NULL;
+     }
+  }
+
+  if(frame_len < 0)
+  {
+     sol_error("Dropping client");
+     close_connection(cb);
+     return -1;
+  }
+
+  if(cb->rpos == rbuf->last)
+	  cb->rpos = rbuf->last = 0;
+
+  return REARM_R;
+}
+
+static int read_budget(void)
+{
+  return conf->read_budget > 0 ? conf->read_budget : READ_BUDGET;
+}
+
+/*
+ * Pick what to wait for next: a paused client only waits for its queue to
+ * drain, a client with pending output waits for either direction, and a
+ * connection that used up its budget yields to the others on the loop and
+ * is called again right after them.
+ */
+static void rearm_client(struct evloop *loop, struct closure *cb, int budget)
+{
+  if(cb->paused)
   {
      cb->call = on_write;
-     evloop_rearm_callbazck_write(loop, cb);
-  } else if(rc == REARM_R)
+     evloop_rearm_callback_write(loop, cb);
+     return;
+  }
+
+  cb->call = on_read;
+  if(budget == 0 && evloop_defer_callback(loop, cb) == 0)
+	  return;
+  if(cb->outq.len > 0)
+	  evloop_rearm_callback_rw(loop, cb);
+  else
+	  evloop_rearm_callback_read(loop, cb);
+}
+
+/*
+ * Sockets are edge-triggered, so keep reading and handling frames until
+ * the socket is drained, the budget is spent or the client gets paused;
+ * a read that does not fill the buffer means there is nothing left to
+ * drain. Replies queued meanwhile go out with a single flush at the end.
+ */
+static void on_read(struct evloop *loop, void *arg)
+{
+  struct closure *cb = arg;
+  int budget = read_budget();
+  ssize_t n;
+  int full;
+
+  if(cb->outq.len > 0 && flush_outbound(cb) < 0)
   {
-     cb->call = on_read;
-     evloop_rearm_callback_read(loop, cb);
+     close_connection(cb);
+     return;
   }
 
-exit:
-  free(buffer);
-  return;
-errdc:
-  free(buffer);
-  sol_error("Dropping client");
-  shutdown(cb->fd, 0);
-  close(cb->fd);
+  do
+  {
+     if((n = fill_read_buffer(cb)) < 0)
+     {
+	close_connection(cb);
+	return;
+     }
+     full = cb->rbuf->last == cb->rbuf->size;
+     if(process_frames(loop, cb, &budget) != REARM_R)
+	     return;
+  } while(n > 0 && full && budget > 0 && !cb->paused);
+
+  if(cb->outq.len > 0 && flush_outbound(cb) < 0)
+  {
+     close_connection(cb);
+     return;
+  }
 
-  hashtable_del(sol.clients, ((struct sol_client*) cb->obj)->client_id);
-  hashtable_del(sol.closures, cb->closure_id);
-  info.nclients--;
-  info.nconnections--;
-  return;
+  rearm_client(loop, cb, budget);
 }
 
 static void on_write(struct evloop *loop, void *arg)
 {
   struct closure *cb = arg;
-  ssize_t sent;
-  if((sent = send_bytes(cb->fd, cb->payload->data, cb->payload->size)) < 0)
-	  sol_error("Error writing on socket to client %s: %s",
-			  ((struct sol_client*)cb->obj)->client_id, strerror(errno));
+  int budget = read_budget();
 
-  info.bytes_sent += sent;
-  bytestring_release(cb->payload);
-  cb->payload = NULL;
+  if(flush_outbound(cb) < 0)
+  {
+     close_connection(cb);
+     return;
+  }
 
-  cb->call = on_read;
-  evloop_rearm_callback_read(loop, cb);
+  if(!cb->paused)
+  {
+     if(process_frames(loop, cb, &budget) != REARM_R)
+	     return;
+     if(cb->outq.len > 0 && flush_outbound(cb) < 0)
+     {
+	close_connection(cb);
+	return;
+     }
+  }
+
+  rearm_client(loop, cb, budget);
+}
+
+/*
+ * Queue data for a client owned by this reactor, writing it out right away
+ * when nothing else is pending; whatever does not fit is left to EPOLLOUT.
+ */
+static void send_to_client(struct closure *cb,
+			   struct outbuf *ob,
+			   int droppable)
+{
+  int idle = cb->outq.len == 0;
+  if(enqueue_outbuf(cb, ob, droppable) < 0 || !idle)
+	  return;
+
+  if(flush_outbound(cb) < 0)
+	  return;
+
+  if(cb->outq.len > 0)
+	  rearm_client(reactor->loop, cb, read_budget());
+}
+
+
+
+/*
+ * Packet handlers. A handler returns REARM_W with the reply packed in
+ * cb->payload, REARM_R when there is nothing to answer, or a negative
+ * error for the connection to be closed once the packet is released.
+ * Packets are views into the read buffer, strings are not NUL terminated.
+ */
+
+/* Pack pkt as the reply of cb, pkt is handed back to the packet pool */
+static int reply(struct closure *cb, union mqtt_packet *pkt,
+		 unsigned type, size_t len)
+{
+   if(!pkt)
+	   return REARM_R;
+   unsigned char *packed = pack_mqtt_packet(pkt, type);
+   mqtt_packet_free(pkt, type);
+   if(!packed)
+	   return REARM_R;
+   cb->payload = bytestring_wrap(packed, len);
+   return cb->payload ? REARM_W : REARM_R;
+}
+
+static int reply_ack(struct closure *cb, unsigned char byte,
+		     unsigned type, unsigned short pkt_id)
+{
+   return reply(cb, (union mqtt_packet *) mqtt_packet_ack(byte, pkt_id),
+		type, MQTT_ACK_LEN);
+}
+
+/* '+' and '#' take a whole level, '#' only the last one */
+static int filter_valid(const char *filter, size_t len)
+{
+   if(len == 0)
+	   return 0;
+   for(size_t i = 0; i < len; i++)
+   {
+	if(filter[i] != '+' && filter[i] != '#')
+		continue;
+	if(i > 0 && filter[i - 1] != '/')
+		return 0;
+	if(i + 1 < len && (filter[i] == '#' || filter[i + 1] != '/'))
+		return 0;
+   }
+   return 1;
 }
 
+static int connect_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   struct mqtt_connect *c = &pkt->connect;
+   struct sol_client *client = slab_alloc(&client_slab);
+   if(!client)
+	   return -ERRCLIENTDC;
+
+   if(c->payload.client_id_len > 0)
+	   client->client_id = strndup((const char *) c->payload.client_id,
+				       c->payload.client_id_len);
+   else if((client->client_id = malloc(UUIN_LEN)))
+	   generate_uuid(client->client_id);
+   if(!client->client_id)
+   {
+	slab_free(&client_slab, client);
+	return -ERRCLIENTDC;
+   }
+   client->fd = cb->fd;
+   client->reactor = reactor->id;
+   client->handle = CONN_HANDLE(cb->fd, cb->gen);
+   client->closure = cb;
+   client->subscriptions = NULL;
+
+   /* A client id already connected is refused, not taken over */
+   if(sharded_hashtable_add(sol.clients, client->client_id, client) < 0)
+   {
+	sol_info("Client %s already connected, disconnecting", client->client_id);
+	free(client->client_id);
+	slab_free(&client_slab, client);
+	return -ERRCLIENTDC;
+   }
+   cb->obj = client;
+   sol_debug("New client connected as %s (k%u)",
+	     client->client_id, c->payload.keepalive);
+
+   return reply(cb, (union mqtt_packet *) mqtt_packet_connack(CONNACK_BYTE, 0, 0),
+		CONNACK, MQTT_ACK_LEN);
+}
+
+static int disconnect_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   (void)pkt;
+   sol_debug("Received DISCONNECT from %s",
+	     ((struct sol_client *) cb->obj)->client_id);
+   return -ERRCLIENTDC;
+}
 
+/*
+ * Filters are added to the trie on first use; the reply carries the
+ * granted QoS of every filter in order, 0x80 for the ones refused.
+ */
+static int subscribe_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   struct sol_client *client = cb->obj;
+   struct mqtt_subscribe *s = &pkt->subscribe;
+   unsigned char rcs[s->tuples_len];
+   int changed = 0;
+
+   pthread_mutex_lock(&sol.topics_lock);
+   for(unsigned i = 0; i < s->tuples_len; i++)
+   {
+	const char *filter = (const char *) s->tuples[i].topic;
+	size_t len = s->tuples[i].topic_len;
+	const char *group;
+	size_t grouplen, offset;
+	rcs[i] = 0x80;
+	int shared = share_filter_parse(filter, len, &group, &grouplen, &offset);
+	if(shared < 0 || s->tuples[i].qos > EXACTLY_ONCE)
+		continue;
+	if(shared)
+	{
+	   filter += offset;
+	   len -= offset;
+	}
+	if(!filter_valid(filter, len))
+		continue;
+
+	struct topic *t = sol_topic_get(&sol, filter, len);
+	if(!t)
+	{
+	   if(!(t = topic_create(filter, len)))
+		   continue;
+	   if(sol_topic_put(&sol, t) < 0)
+	   {
+		topic_free(t);
+		continue;
+	   }
+	}
+	/* A topic just created for a failed subscription goes away again */
+	struct share_group *g = NULL;
+	if(shared && !(g = topic_share_group(t, group, grouplen, -1)))
+	{
+	   sol_topic_prune(&sol, t);
+	   continue;
+	}
+	struct subscriber_set **set = g ? &g->members : &t->subscribers;
+	struct subscriber sub = {
+		.qos = s->tuples[i].qos, .flags = 0, .client = client
+	};
+	int rc = subscriber_set_add(set, &sub);
+	if(rc < 0)
+	{
+	   sol_topic_prune(&sol, t);
+	   continue;
+	}
+	if(sol_client_subscribe(client, t, g) < 0)
+	{
+	   subscriber_set_del(set, client->handle);
+	   sol_topic_prune(&sol, t);
+	   changed |= rc == 0;
+	   continue;
+	}
+	rcs[i] = s->tuples[i].qos;
+	changed |= rc == 0;
+   }
+   if(changed)
+	   sol_topics_changed(&sol);
+   pthread_mutex_unlock(&sol.topics_lock);
+
+   unsigned char lenbuf[4];
+   size_t len = sizeof(uint16_t) + s->tuples_len;
+   len += 1 + mqtt_encode_length(lenbuf, len);
+   return reply(cb, (union mqtt_packet *) mqtt_packet_suback(SUBACK_BYTE,
+				   s->pkt_id, rcs, s->tuples_len),
+		SUBACK, len);
+}
 
-#define SYS_TOPICS 14
+static int unsubscribe_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   struct sol_client *client = cb->obj;
+   struct mqtt_unsubscribe *u = &pkt->unsubscribe;
+   int changed = 0;
+
+   pthread_mutex_lock(&sol.topics_lock);
+   for(unsigned i = 0; i < u->tuples_len; i++)
+   {
+	const char *filter = (const char *) u->tuples[i].topic;
+	size_t len = u->tuples[i].topic_len;
+	const char *group;
+	size_t grouplen, offset;
+	int shared = share_filter_parse(filter, len, &group, &grouplen, &offset);
+	if(shared < 0)
+		continue;
+	struct topic *t = sol_topic_get(&sol, filter + (shared ? offset : 0),
+					len - (shared ? offset : 0));
+	if(!t)
+		continue;
+	struct share_group *g = NULL;
+	if(shared && !(g = topic_share_group_find(t, group, grouplen)))
+		continue;
+	changed |= subscriber_set_del(g ? &g->members : &t->subscribers,
+				      client->handle) == 0;
+	sol_client_unsubscribe(client, t, g);
+	sol_topic_prune(&sol, t);
+   }
+   if(changed)
+	   sol_topics_changed(&sol);
+   pthread_mutex_unlock(&sol.topics_lock);
+
+   return reply_ack(cb, UNSUBACK_BYTE, UNSUBACK, u->pkt_id);
+}
+
+static int publish_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   struct mqtt_publish *p = &pkt->publish;
+   unsigned qos = p->header.bits.qos;
+   if(qos > EXACTLY_ONCE || p->topiclen == 0 ||
+		   memchr(p->topic, '+', p->topiclen) ||
+		   memchr(p->topic, '#', p->topiclen))
+	   return -ERRPACKETERR;
+
+   const struct interned *topic =
+	   topic_intern((const char *) p->topic, p->topiclen);
+   if(topic)
+   {
+	publish_message(p->pkt_id, topic, p->payloadlen, p->payload);
+	topic_release(topic);
+   }
+   else
+	   sol_error("Unable to intern topic, dropping PUBLISH from %s",
+		     ((struct sol_client *) cb->obj)->client_id);
+
+   if(qos == AT_LEAST_ONCE)
+	   return reply_ack(cb, PUBACK_BYTE, PUBACK, p->pkt_id);
+   if(qos == EXACTLY_ONCE)
+	   return reply_ack(cb, PUBREC_BYTE, PUBREC, p->pkt_id);
+   return REARM_R;
+}
+
+static int puback_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   (void)cb;
+   (void)pkt;
+   return REARM_R;
+}
+
+static int pubrec_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   /* PUBREL has the reserved bits of its fixed header set to 0010 */
+   return reply_ack(cb, PUBREL_BYTE | 0x02, PUBREL, pkt->ack.pkt_id);
+}
+
+static int pubrel_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   return reply_ack(cb, PUBCOMP_BYTE, PUBCOMP, pkt->ack.pkt_id);
+}
+
+static int pubcomp_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   (void)cb;
+   (void)pkt;
+   return REARM_R;
+}
+
+static int pingreq_handler(struct closure *cb, union mqtt_packet *pkt)
+{
+   (void)pkt;
+   return reply(cb, (union mqtt_packet *) mqtt_packet_header(PINGRESP_BYTE),
+		PINGRESP, MQTT_HEADER_LEN);
+}
+
+#define SYS_TOPICS 22
 
 static const char *sys_topics[SYS_TOPICS] = 
 {
@@ -247,9 +883,20 @@ static const char *sys_topics[SYS_TOPICS] =
    "$SOL/broker/bytes/received/",
    "$SOL/broker/messages/sent/",
    "$SOL/broker/messages/received/",
-   "$SOL/broker/memory/used/"
+   "$SOL/broker/memory/used/",
+   "$SOL/broker/memory/closures/",
+   "$SOL/broker/memory/clients/",
+   "$SOL/broker/cache/",
+   "$SOL/broker/cache/hits/",
+   "$SOL/broker/cache/misses/",
+   "$SOL/broker/topics/interned/",
+   "$SOL/broker/memory/topics/nodes/",
+   "$SOL/broker/memory/topics/bytes/"
 };
 
+/* Interned at startup, the stats are published by id */
+static const struct interned *sys_interned[SYS_TOPICS];
+
 static void run(struct evloop *loop)
 {
   if(evloop_wait(loop) < 0)
@@ -268,142 +915,464 @@ static int client_destructor(struct hashtable_entry *entry)
    struct sol_client *client = entry->val;
    if(client->client_id)
 	   free(client->client_id);
-   free(client);
+   slab_free(&client_slab, client);
    return 0;
 }
 
-static int closure_destructor(struct hashtable_entry *entry)
+static void closure_free(struct closure *closure)
 {
-   if(!entry)
-	   return -1;
-
-   struct closure *closure = entry->val;
    if(closure->payload)
 	   bytestring_release(closure->payload);
-   free(closure);
-   return 0;
+   if(closure->rbuf)
+	   bytestring_release(closure->rbuf);
+   outqueue_clear(&closure->outq);
+   slab_free(&closure_slab, closure);
+}
+
+
+static uint64_t deliver_message(unsigned short, const struct interned *,
+				struct bytestring *, unsigned short, int);
+
+static size_t deliver_chunk(struct handoff *);
+
+
+static struct handoff *handoff_create(unsigned short pkt_id,
+				      const struct interned *topic,
+				      struct bytestring *body,
+				      unsigned short payloadlen)
+{
+   struct handoff *h = calloc(1, sizeof(*h));
+   if(!h)
+	   return NULL;
+   h->pkt_id = pkt_id;
+   topic_ref(topic);
+   h->topic = topic;
+   h->payloadlen = payloadlen;
+   h->body = bytestring_ref(body);
+   return h;
+}
+
+static void handoff_free(struct handoff *h)
+{
+   topic_release(h->topic);
+   bytestring_release(h->body);
+   match_subs_release(h->subs);
+   free(h);
+}
+
+static void reactor_handoff(struct reactor *r, struct handoff *h)
+{
+   if(!h)
+	   return;
+
+   h->next = NULL;
+   pthread_mutex_lock(&r->inbox_lock);
+   if(r->inbox_tail)
+	   r->inbox_tail->next = h;
+   else
+	   r->inbox_head = h;
+   r->inbox_tail = h;
+   pthread_mutex_unlock(&r->inbox_lock);
+
+   if(eventfd_write(r->inbox.fd, 1) < 0)
+	   sol_error("Error waking reactor %d: %s", r->id, strerror(errno));
 }
 
-int start_server(const char *addr, const char port)
+/*
+ * Fan-out remainders go back at the tail of the inbox, so the loop polls
+ * its connections between two chunks.
+ */
+static void on_handoff(struct evloop *loop, void *arg)
 {
-   trie_init(&sol.topics);
-   sol.clients = hashtable_create(client_destructor);
-   sol.closure = hashtable_create(closure_destructor);
+   struct closure *cb = arg;
+   eventfd_t val;
+   (void)eventfd_read(cb->fd, &val);
 
-   struct closure server_closure;
+   pthread_mutex_lock(&reactor->inbox_lock);
+   struct handoff *h = reactor->inbox_head;
+   reactor->inbox_head = reactor->inbox_tail = NULL;
+   pthread_mutex_unlock(&reactor->inbox_lock);
 
-   server_closure.fd = make_listen(addr, port, conf->socket_famili);
-   server_closure.payload = NULL;
-   server_closure.args = &server_closure;
-   server_closure.call = on_accept;
-   generate_uuid(server_closure.closure_id);
+   struct handoff *next;
+   for(; h; h = next)
+   {
+	next = h->next;
+	if(!h->subs)
+		deliver_message(h->pkt_id, h->topic, h->body, h->payloadlen, 0);
+	else if(deliver_chunk(h) < h->subs->nsubs)
+	{
+		reactor_handoff(reactor, h);
+		continue;
+	}
+	handoff_free(h);
+   }
+
+   evloop_rearm_callback_read(loop, cb);
+}
+
+static void reactor_init(struct reactor *r, int id,
+			 const char *addr, const char *port)
+{
+   r->id = id;
+   r->loop = evloop_create(EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
+   r->inbox_head = r->inbox_tail = NULL;
+   pthread_mutex_init(&r->inbox_lock, NULL);
+   memset(&r->info, 0, sizeof(r->info));
+
+   /*
+    * INET listeners are bound with SO_REUSEPORT so the kernel spreads
+    * incoming connections across reactors; a UNIX socket path can only be
+    * bound once, so it stays on the first reactor.
+    */
+   if(id == 0 || conf->socket_family == INET)
+   {
+	r->server.fd = make_listen(addr, port, conf->socket_family);
+	r->server.obj = NULL;
+	r->server.payload = NULL;
+	r->server.rbuf = NULL;
+	outqueue_init(&r->server.outq);
+	r->server.args = &r->server;
+	r->server.call = on_accept;
+	evloop_add_callback(r->loop, &r->server);
+   }
+
+   r->inbox.fd = eventfd(0, EFD_NONBLOCK);
+   r->inbox.obj = NULL;
+   r->inbox.payload = NULL;
+   r->inbox.rbuf = NULL;
+   outqueue_init(&r->inbox.outq);
+   r->inbox.args = &r->inbox;
+   r->inbox.call = on_handoff;
+   evloop_add_callback(r->loop, &r->inbox);
+}
+
+static void *reactor_thread(void *arg)
+{
+   reactor = arg;
+   run(reactor->loop);
+   return NULL;
+}
+
+int start_server(const char *addr, const char *port)
+{
+   if(trie_init(&sol.topics) < 0)
+	   return -1;
+   pthread_mutex_init(&sol.topics_lock, NULL);
+   if(slab_init(&closure_slab, "closures", sizeof(struct closure),
+		conf->slab_hugepages) < 0 ||
+		   slab_init(&client_slab, "clients", sizeof(struct sol_client),
+			     conf->slab_hugepages) < 0)
+   {
+	sol_error("Unable to set up the object slabs");
+	return -1;
+   }
+
+   if(conntable_init(&connections) < 0)
+	   return -1;
+
+   sol.clients = sharded_hashtable_create(client_destructor,
+		   conf->clients_shards > 0 ? conf->clients_shards : HASHTABLE_SHARDS,
+		   conf->clients_hint > 0 ? conf->clients_hint : CLIENTS_HINT);
+   if(!sol.clients)
+	   return -1;
 
    for(int i = 0; i < SYS_TOPICS; i++)
-	   sol_topic_put(&sol, topic_create(strdup(sys_topics[i])));
+   {
+	sys_interned[i] = topic_intern(sys_topics[i], strlen(sys_topics[i]));
+	if(!sys_interned[i])
+		return -1;
+	struct topic *t = topic_create(sys_topics[i], strlen(sys_topics[i]));
+	if(!t)
+		return -1;
+	if(sol_topic_put(&sol, t) < 0)
+	{
+	   topic_free(t);
+	   return -1;
+	}
+   }
 
-   struct evloop *event_loop = evloop_create(EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
+   nreactors = conf->nreactors;
+   if(nreactors <= 0)
+	   nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+   if(nreactors <= 0)
+	   nreactors = 1;
 
-   evloop_add_callback(event_loop, &server_closure);
+   reactors = calloc(nreactors, sizeof(*reactors));
+   if(!reactors)
+	   return -1;
 
+   for(int i = 0; i < nreactors; i++)
+	   reactor_init(&reactors[i], i, addr, port);
 
    struct closure sys_closure = 
    {
 	.fd = 0,
+	.obj = NULL,
 	.payload = NULL,
+	.rbuf = NULL,
 	.args = &sys_closure,
-	.call = publish_stats;
+	.call = publish_stats
    };
 
-   generaet_uuid(sys_closure.closure_id);
-   
-   evloop_add_periodic_task(event_loop, conf->stats_pub_interval,
+   evloop_add_periodic_task(reactors[0].loop, conf->stats_pub_interval,
 		   0, &sys_closure);
 
-   sol_info("Server start");
-   info.start_time = time(NULL);
-   run(event_loop);
-   hashtable_release(sol.clients);
-   hashtable_release(sol.closures);
+   sol_info("Server start with %d reactors", nreactors);
+   reactors[0].info.start_time = time(NULL);
+
+   for(int i = 1; i < nreactors; i++)
+	   if(pthread_create(&reactors[i].thread, NULL,
+				   reactor_thread, &reactors[i]) != 0)
+		   sol_error("Unable to start reactor %d: %s", i, strerror(errno));
+
+   reactor_thread(&reactors[0]);
+
+   for(int i = 1; i < nreactors; i++)
+	   pthread_join(reactors[i].thread, NULL);
+
+   conntable_free(&connections, closure_free);
+   free(reactors);
+   sharded_hashtable_release(sol.clients);
    sol_info("Sol v%s exiting", VERSION);
    return 0;
 }
 
 static void publish_message(unsigned short pkt_id,
-			    unsigned short topiclen,
-			    const char *topic,
+			    const struct interned *topic,
 			    unsigned short payloadlen,
 			    unsigned char *payload)
 {
-   struct topic *t = sol_topic_get(&sol, topic);
-   if(!t)
+   struct bytestring *body = bytestring_create(topic->len + payloadlen);
+   if(!body)
+	   return;
+   memcpy(body->data, topic->name, topic->len);
+   memcpy(body->data + topic->len, payload, payloadlen);
+
+   /* Reactors without a matching subscriber are left asleep */
+   uint64_t owners = deliver_message(pkt_id, topic, body, payloadlen, 1);
+   for(int i = 0; i < nreactors; i++)
+	if(&reactors[i] != reactor && (owners & MATCH_REACTOR(i)))
+		reactor_handoff(&reactors[i],
+				handoff_create(pkt_id, topic, body, payloadlen));
+
+   bytestring_release(body);
+}
+
+/*
+ * Build the outbound packet of a PUBLISH for one subscriber. Topic and
+ * payload are fragments of the shared body, only the fixed header and the
+ * packet id are written per subscriber, in the packet inline bytes.
+ */
+static struct outbuf *publish_outbuf(struct bytestring *body,
+				     unsigned qos,
+				     unsigned short pkt_id,
+				     unsigned short topiclen,
+				     unsigned short payloadlen)
+{
+   struct outbuf *ob = outbuf_create(bytestring_ref(body));
+   if(!ob)
+	   return NULL;
+
+   union mqtt_header hdr = {.byte = PUBLISH_BYTE};
+   hdr.bits.qos = qos;
+
+   size_t remaining_len = sizeof(uint16_t) + topiclen + payloadlen;
+   if(qos > AT_MOST_ONCE)
+	   remaining_len += sizeof(uint16_t);
+
+   unsigned char fixed[MQTT_PUBLISH_HEADER_MAX];
+   size_t fixedlen = mqtt_pack_publish_header(fixed, hdr.byte,
+		   				remaining_len, topiclen);
+   unsigned char *ptr = outbuf_inline(ob, fixedlen);
+   if(!ptr || outbuf_add(ob, body->data, topiclen) < 0)
+	   goto err;
+   memcpy(ptr, fixed, fixedlen);
+
+   if(qos > AT_MOST_ONCE)
+   {
+	ptr = outbuf_inline(ob, sizeof(uint16_t));
+	if(!ptr)
+		goto err;
+	pack_u16(&ptr, pkt_id);
+   }
+
+   if(outbuf_add(ob, body->data + topiclen, payloadlen) < 0)
+	   goto err;
+   return ob;
+
+err:
+   outbuf_release(ob);
+   return NULL;
+}
+
+static size_t fanout_chunk(void)
+{
+   return conf->fanout_chunk > 0 ? conf->fanout_chunk : FANOUT_CHUNK;
+}
+
+/* A handle whose connection went away no longer resolves */
+static void deliver_to(const struct handoff *h, uint64_t handle, unsigned qos)
+{
+   struct closure *cb = conntable_get(&connections,
+				      CONN_HANDLE_FD(handle),
+				      CONN_HANDLE_GEN(handle));
+   if(!cb)
 	   return;
+   send_to_client(cb,
+		   publish_outbuf(h->body, qos, h->pkt_id,
+			   h->topic->len, h->payloadlen),
+		   qos == AT_MOST_ONCE);
+   stat_add(messages_sent, 1);
+}
 
-   union mqtt_packet pkt;
-   struct mqtt_publish *p = mqtt_packet_publish(PUBLISH_BYTE,
-		   				pkt_id,
-						topiclen,
-						(unsigned char *)topic,
-						payloadlen,
-						payload);
-
-   pkt.publish = *p;
-   size_t len;
-   unsigned char *packed;
-
-   struct list_node *cur = t->subscribees->head;
-   size_t sent = 0L;
-   for(; curr; curr = curr->next)
+/*
+ * Send to the next fanout_chunk subscribers of h, returning how many of
+ * them are done so far.
+ */
+static size_t deliver_chunk(struct handoff *h)
+{
+   const struct match_subs *subs = h->subs;
+   size_t end = h->sent + fanout_chunk();
+   if(end > subs->nsubs)
+	   end = subs->nsubs;
+
+   for(; h->sent < end; h->sent++)
+	   deliver_to(h, subs->handles[h->sent], subs->qos[h->sent]);
+   return h->sent;
+}
+
+/* Hand the subscribers of a fan-out from sent on to reactor r */
+static void deliver_later(struct reactor *r,
+			  const struct handoff *h,
+			  struct match_subs *subs,
+			  size_t sent)
+{
+   struct handoff *more = handoff_create(h->pkt_id, h->topic,
+					 h->body, h->payloadlen);
+   if(!more)
    {
-       sol_debug("Send PUBLISH (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
-		       pkt.publish.header.bits.dup,
-		       pkt.publish.header.bits.qos,
-		       pkt.publish.header.bits.retain,
-		       pkt.publish.pkt_id,
-		       pkt.publish.topic,
-		       pkt.publish.payloadlen);
-
-       len = MQTT_HEADER_LEN + sizeof(uint16_t) + 
-	       pkt.publish.topiclen + pkt.publish.payloadlen;
-
-       struct subscriber *sub = cur->data;
-       struct sol_client *sc = sub->client;
-
-       pkt.publish.header.bits.qos = sub->qos;
-       if(pkt.publish.header.bits.qos > AT_MOST_ONCE)
-	       len += sizeof(uint16_t);
-       int remaininglen_offset = 0;
-       if((len - 1) > 0x200000)
-	       remaininglen_offset = 3;
-       else if((len - 1) > 0x4000)
-	       remaininglen_offset = 2;
-       else if((len - 1) > 0x80) 
-	       remaininglen_offset = 1;
-       len += remaininglen_offset;
-       packed = pack_mqtt_packet(&pkt, PUBLISH);
-
-       if((send = send_bytes(sc->fd, packed, len)) < 0)
-	       sol_error("Error publish to %s: %s",
-			       sc->client_id, strerror(errno));
-
-       info.bytes_sent += sent;
-       info.messages_sent++;
-       free(packed);
+	sol_error("Dropping PUBLISH to %zu subscribers: out of memory",
+			subs->nsubs - sent);
+	return;
    }
-   free(p);
+   more->subs = match_subs_ref(subs);
+   more->sent = sent;
+   reactor_handoff(r, more);
+}
+
+static size_t share_backlog(uint64_t handle)
+{
+   return conntable_backlog(&connections, handle);
+}
+
+/*
+ * One member per matching group gets the message, picked here on the
+ * reactor the PUBLISH came from and sent by the reactor owning it.
+ */
+static void deliver_shared(const struct match_entry *e, const struct handoff *h)
+{
+   for(size_t i = 0; i < e->ngroups; i++)
+   {
+	struct share_pick pick;
+	if(share_group_pick(e->groups[i], h->topic, share_backlog, &pick) < 0)
+		continue;
+	if(pick.reactor == reactor->id)
+	{
+	   deliver_to(h, pick.handle, pick.qos);
+	   continue;
+	}
+	if(pick.reactor >= nreactors)
+		continue;
+	struct match_subs *one = match_subs_create(1);
+	if(!one)
+		continue;
+	one->handles[0] = pick.handle;
+	one->qos[0] = pick.qos;
+	deliver_later(&reactors[pick.reactor], h, one, 0);
+	match_subs_release(one);
+   }
+}
+
+/*
+ * Subscribers come from the match cache of this reactor, already limited
+ * to the clients it owns; the trie is only walked on a miss. Past
+ * fanout_chunk subscribers, the rest is handed back to this reactor to go
+ * out a chunk at a time, holding a reference to the subscribers of the
+ * cache entry so that a later PUBLISH may rebuild it meanwhile. Shared
+ * subscriptions are only routed by the origin reactor, inside the epoch
+ * the entry was checked in, keeping its groups alive. Returns the
+ * reactors owning a matching subscriber, all of them when unknown.
+ */
+static uint64_t deliver_message(unsigned short pkt_id,
+				const struct interned *topic,
+				struct bytestring *body,
+				unsigned short payloadlen,
+				int origin)
+{
+   int hit;
+
+   epoch_enter();
+   const struct match_entry *e =
+	   sol_topic_match_cached(&sol, topic, reactor->id, &hit);
+   if(hit)
+	   stat_add(cache_hits, 1);
+   else
+	   stat_add(cache_misses, 1);
+   if(!e)
+   {
+	epoch_exit();
+	return ~0ULL;
+   }
+
+   sol_debug("Send PUBLISH (m%u, %.*s, ... (%i bytes))",
+		   pkt_id, topic->len, topic->name, payloadlen);
+
+   struct handoff h = {
+	.pkt_id = pkt_id,
+	.topic = topic,
+	.payloadlen = payloadlen,
+	.body = body,
+	.subs = e->subs
+   };
+   uint64_t owners = e->reactors;
+   if(origin)
+	   deliver_shared(e, &h);
+   epoch_exit();
+   if(h.subs && deliver_chunk(&h) < h.subs->nsubs)
+	   deliver_later(reactor, &h, h.subs, h.sent);
+   return owners;
 }
 
 
 static void publish_stats(struct evloop *loop, void *args)
 {
+  (void)loop;
+  (void)args;
+  /* Topic tree versions left over by the last writers */
+  epoch_reclaim();
+
+  struct sol_info info = { .start_time = reactors[0].info.start_time };
+  for(int i = 0; i < nreactors; i++)
+  {
+     info.nclients += stat_get(&reactors[i], nclients);
+     info.bytes_sent += stat_get(&reactors[i], bytes_sent);
+     info.messages_sent += stat_get(&reactors[i], messages_sent);
+     info.messages_recv += stat_get(&reactors[i], messages_recv);
+     info.cache_hits += stat_get(&reactors[i], cache_hits);
+     info.cache_misses += stat_get(&reactors[i], cache_misses);
+  }
+
   char cclients[number_len(info.nclients) + 1];
   sprintf(cclients, "%d", info.nclients);
 
   char bsent[number_len(info.bytes_sent) + 1];
   sprintf(bsent, "%lld", info.bytes_sent);
 
-  char msent[number_len(info.messages_sent) + 1];                                                      mprintf(bsent, "%lld", info.messages_sent); 
+  char msent[number_len(info.messages_sent) + 1];
+  sprintf(msent, "%lld", info.messages_sent); 
 
-  char mrevc[number_len(info.messages_recv) + 1];                                                      sprintf(mrecv, "%lld", info.bytes_recv); 
+  char mrecv[number_len(info.messages_recv) + 1];
+  sprintf(mrecv, "%lld", info.messages_recv); 
   
   long long uptime = time(NULL) - info.start_time;
   char utime[number_len(uptime) + 1];
@@ -412,19 +1381,77 @@ static void publish_stats(struct evloop *loop, void *args)
   double sol_uptime = (double)(time(NULL) - info.start_time) / SOL_SECONDS;
   char sutime[16];
   sprintf(sutime, "%.4f", sol_uptime);
-  publish_message(0, strlen(sys_topics[5]), sys_topics[5],
+  publish_message(0, sys_interned[5],
 		  strlen(utime), (unsigned char*)&utime);
 
-  publish_message(0, strlen(sys_topics[6]), sys_topics[6],                                                             strlen(sutime), (unsigned char*)&sutime);
+  publish_message(0, sys_interned[6],
+		  strlen(sutime), (unsigned char*)&sutime);
+
+  publish_message(0, sys_interned[7],
+		  strlen(cclients), (unsigned char*)&cclients);
+
+  publish_message(0, sys_interned[9],
+		  strlen(bsent), (unsigned char*)&bsent);
+
+  publish_message(0, sys_interned[11],
+		  strlen(msent), (unsigned char*)&msent);
+
+  publish_message(0, sys_interned[12],
+		  strlen(mrecv), (unsigned char*)&mrecv);
+
+  char chits[number_len(info.cache_hits) + 1];
+  sprintf(chits, "%lld", info.cache_hits);
 
-  publish_message(0, strlen(sys_topics[7]), sys_topics[7],                                                             strlen(cclients), (unsigned char*)&cclients);
+  char cmisses[number_len(info.cache_misses) + 1];
+  sprintf(cmisses, "%lld", info.cache_misses);
 
-  publish_message(0, strlen(sys_topics[9]), sys_topics[9],                                                             strlen(bsent), (unsigned char*)&bsent);
+  publish_message(0, sys_interned[17],
+		  strlen(chits), (unsigned char*)&chits);
 
-  publish_message(0, strlen(sys_topics[11]), sys_topics[11],                                                             strlen(msent), (unsigned char*)&msent);
+  publish_message(0, sys_interned[18],
+		  strlen(cmisses), (unsigned char*)&cmisses);
 
-  publish_message(0, strlen(sys_topics[12]), sys_topics[12],                                                              strlen(mrecv), (unsigned char*)&mrecv);
+  char cinterned[number_len(topic_interned_count()) + 1];
+  sprintf(cinterned, "%u", topic_interned_count());
+
+  publish_message(0, sys_interned[19],
+		  strlen(cinterned), (unsigned char*)&cinterned);
+
+  publish_memory_stats();
 }
 
+/*
+ * Slab occupancy, published as "inuse/total objects" on a topic per slab,
+ * nodes and bytes of the topic trie, plus the bytes used by both on
+ * memory/used.
+ */
+static void publish_memory_stats(void)
+{
+  struct slab *slabs[] = { &closure_slab, &client_slab };
+  size_t used = 0;
+  char buf[64];
 
+  for(int i = 0; i < 2; i++)
+  {
+     struct slab_stats stats;
+     slab_stats(slabs[i], &stats);
+     used += stats.bytes;
+     snprintf(buf, sizeof(buf), "%zu/%zu", stats.inuse, stats.total);
+     publish_message(0, sys_interned[14 + i],
+		     strlen(buf), (unsigned char *) buf);
+  }
 
+  struct trie_stats topics;
+  trie_stats(&sol.topics, &topics);
+  used += topics.bytes;
+
+  snprintf(buf, sizeof(buf), "%zu", topics.nodes);
+  publish_message(0, sys_interned[20], strlen(buf), (unsigned char *) buf);
+
+  snprintf(buf, sizeof(buf), "%zu", topics.bytes);
+  publish_message(0, sys_interned[21], strlen(buf), (unsigned char *) buf);
+
+  snprintf(buf, sizeof(buf), "%zu", used);
+  publish_message(0, sys_interned[13],
+		  strlen(buf), (unsigned char *) buf);
+}
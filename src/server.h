@@ -4,6 +4,21 @@
 #define EPOLL_MAX_EVENTS 256
 #define EPOLL_TIMEOUT -1
 
+#define READ_BUFSIZE 4096
+#define READ_BUDGET 64
+
+#define ACCEPT_BATCH 256
+
+#define CONNECT_TIMEOUT 10
+
+#define CLIENTS_HINT 1024
+
+#define FANOUT_CHUNK 1024
+
+#define OUTQ_HWM (1024 * 1024)
+#define OUTQ_LWM (256 * 1024)
+#define OUTQ_MAX_FACTOR 8
+
 #define ERRCLIENTDC 1
 #define ERRPACKETERR 2
 #define ERRMAXREQSIZE 3
@@ -20,9 +35,12 @@ struct sol_info
   int nconnections;
   long long start_time;
   long long bytes_recv;
-  long long bytes_send;
+  long long bytes_sent;
   long long messages_sent;
   long long messages_recv;
+  long long messages_dropped;
+  long long cache_hits;
+  long long cache_misses;
 };
 
 #endif
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+
+struct slab_obj
+{
+   struct slab_obj *next;
+};
+
+struct magazine
+{
+   int n;
+   void *objs[SLAB_MAGAZINE];
+};
+
+static int nslabs;
+static __thread struct magazine magazines[SLAB_MAX_CACHES];
+
+int slab_init(struct slab *s, const char *name, size_t objsize, int hugepages)
+{
+   int id = __atomic_fetch_add(&nslabs, 1, __ATOMIC_RELAXED);
+   if(id >= SLAB_MAX_CACHES)
+	   return -1;
+
+   /* Keep objects pointer aligned */
+   objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+   s->name = name;
+   s->id = id;
+   s->objsize = objsize < sizeof(struct slab_obj) ?
+	   sizeof(struct slab_obj) : objsize;
+   s->hugepages = hugepages;
+   s->slab_size = hugepages ? SLAB_HUGE_SIZE : SLAB_SIZE;
+   s->free = NULL;
+   s->nslabs = 0;
+   s->total = 0;
+   s->inuse = 0;
+   pthread_mutex_init(&s->lock, NULL);
+   return 0;
+}
+
+/*
+ * Map a new slab and thread its objects on the free list, must be called
+ * with the lock held. Huge pages are only a hint, when none are reserved
+ * the slab falls back to regular pages.
+ */
+static int slab_grow(struct slab *s)
+{
+   void *mem = MAP_FAILED;
+   if(s->hugepages)
+	   mem = mmap(NULL, s->slab_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   if(mem == MAP_FAILED)
+	   mem = mmap(NULL, s->slab_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(mem == MAP_FAILED)
+	   return -1;
+
+   size_t count = s->slab_size / s->objsize;
+   unsigned char *ptr = mem;
+   for(size_t i = 0; i < count; i++)
+   {
+	struct slab_obj *obj = (struct slab_obj *)(ptr + i * s->objsize);
+	obj->next = s->free;
+	s->free = obj;
+   }
+   s->nslabs++;
+   s->total += count;
+   return 0;
+}
+
+static int magazine_refill(struct slab *s, struct magazine *m)
+{
+   pthread_mutex_lock(&s->lock);
+   while(m->n < SLAB_MAGAZINE / 2)
+   {
+	if(!s->free && slab_grow(s) < 0)
+		break;
+	struct slab_obj *obj = s->free;
+	s->free = obj->next;
+	m->objs[m->n++] = obj;
+   }
+   pthread_mutex_unlock(&s->lock);
+   return m->n;
+}
+
+static void magazine_spill(struct slab *s, struct magazine *m)
+{
+   pthread_mutex_lock(&s->lock);
+   while(m->n > SLAB_MAGAZINE / 2)
+   {
+	struct slab_obj *obj = m->objs[--m->n];
+	obj->next = s->free;
+	s->free = obj;
+   }
+   pthread_mutex_unlock(&s->lock);
+}
+
+void *slab_alloc(struct slab *s)
+{
+   struct magazine *m = &magazines[s->id];
+   if(m->n == 0 && magazine_refill(s, m) == 0)
+	   return NULL;
+   __atomic_add_fetch(&s->inuse, 1, __ATOMIC_RELAXED);
+   return m->objs[--m->n];
+}
+
+void slab_free(struct slab *s, void *ptr)
+{
+   if(!ptr)
+	   return;
+   struct magazine *m = &magazines[s->id];
+   if(m->n == SLAB_MAGAZINE)
+	   magazine_spill(s, m);
+   m->objs[m->n++] = ptr;
+   __atomic_sub_fetch(&s->inuse, 1, __ATOMIC_RELAXED);
+}
+
+void slab_stats(struct slab *s, struct slab_stats *stats)
+{
+   pthread_mutex_lock(&s->lock);
+   stats->objsize = s->objsize;
+   stats->nslabs = s->nslabs;
+   stats->bytes = s->nslabs * s->slab_size;
+   stats->total = s->total;
+   pthread_mutex_unlock(&s->lock);
+   stats->inuse = __atomic_load_n(&s->inuse, __ATOMIC_RELAXED);
+}
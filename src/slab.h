@@ -0,0 +1,52 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * Typed slab allocator for the long lived, fixed size objects of the
+ * broker (closures, clients, subscribers). Objects are carved out of
+ * SLAB_SIZE chunks mmap'ed in one go, optionally on huge pages, and never
+ * handed back to malloc, so connection churn does not fragment the heap.
+ *
+ * Every thread keeps a small magazine of free objects per slab, alloc and
+ * free only take the slab lock to refill or spill half a magazine.
+ */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_HUGE_SIZE (2 * 1024 * 1024)
+#define SLAB_MAGAZINE 32
+#define SLAB_MAX_CACHES 16
+
+struct slab
+{
+   const char *name;
+   int id;
+   size_t objsize;
+   size_t slab_size;
+   int hugepages;
+   pthread_mutex_t lock;
+   void *free;
+   size_t nslabs;
+   size_t total;
+   size_t inuse;
+};
+
+struct slab_stats
+{
+   size_t objsize;
+   size_t nslabs;
+   size_t bytes;
+   size_t total;
+   size_t inuse;
+};
+
+int slab_init(struct slab *, const char *, size_t, int);
+
+void *slab_alloc(struct slab *);
+
+void slab_free(struct slab *, void *);
+
+void slab_stats(struct slab *, struct slab_stats *);
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include "timer.h"
+
+
+static void timer_list_init(struct timer *head)
+{
+   head->prev = head;
+   head->next = head;
+}
+
+static int timer_list_empty(const struct timer *head)
+{
+   return head->next == head;
+}
+
+static void timer_list_append(struct timer *head, struct timer *t)
+{
+   t->prev = head->prev;
+   t->next = head;
+   head->prev->next = t;
+   head->prev = t;
+}
+
+static void timer_list_unlink(struct timer *t)
+{
+   t->prev->next = t->next;
+   t->next->prev = t->prev;
+   t->prev = NULL;
+   t->next = NULL;
+}
+
+/*
+ * Move every timer of a slot on a local list, so the slot can be refilled
+ * while the detached timers are walked.
+ */
+static void timer_list_splice(struct timer *slot, struct timer *head)
+{
+   timer_list_init(head);
+   if(timer_list_empty(slot))
+	   return;
+   head->next = slot->next;
+   head->prev = slot->prev;
+   head->next->prev = head;
+   head->prev->next = head;
+   timer_list_init(slot);
+}
+
+void timer_wheel_init(struct timer_wheel *w, unsigned long long now)
+{
+   w->now = now;
+   w->count = 0;
+   for(int i = 0; i < TIMER_WHEEL_LEVELS; i++)
+	   for(int j = 0; j < TIMER_WHEEL_SLOTS; j++)
+		   timer_list_init(&w->slots[i][j]);
+}
+
+void timer_init(struct timer *t, void (*call)(struct timer *), void *args)
+{
+   t->prev = NULL;
+   t->next = NULL;
+   t->expires = 0;
+   t->call = call;
+   t->args = args;
+}
+
+int timer_pending(const struct timer *t)
+{
+   return t->next != NULL;
+}
+
+/*
+ * The level is picked by the distance to the expiration, the slot by the
+ * bits of the expiration tick belonging to that level; expirations before
+ * first are moved to it and the ones past the last wheel are clamped to
+ * its end.
+ */
+static void timer_wheel_insert(struct timer_wheel *w,
+			       struct timer *t,
+			       unsigned long long first)
+{
+   unsigned long long expires = t->expires;
+   if(expires < first)
+	   expires = first;
+
+   unsigned long long delta = expires - w->now;
+   unsigned long long max = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+   if(delta >= max)
+   {
+	delta = max - 1;
+	expires = w->now + delta;
+   }
+
+   int level = 0;
+   while(level < TIMER_WHEEL_LEVELS - 1 &&
+		   delta >= 1ULL << (TIMER_WHEEL_BITS * (level + 1)))
+	   level++;
+
+   int slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+   timer_list_append(&w->slots[level][slot], t);
+}
+
+void timer_wheel_add(struct timer_wheel *w,
+		     struct timer *t,
+		     unsigned long long expires)
+{
+   timer_wheel_del(w, t);
+   t->expires = expires;
+   timer_wheel_insert(w, t, w->now + 1);
+   w->count++;
+}
+
+void timer_wheel_del(struct timer_wheel *w, struct timer *t)
+{
+   if(!timer_pending(t))
+	   return;
+   timer_list_unlink(t);
+   w->count--;
+}
+
+static void timer_wheel_cascade(struct timer_wheel *w, int level, int slot)
+{
+   struct timer head;
+   timer_list_splice(&w->slots[level][slot], &head);
+   while(!timer_list_empty(&head))
+   {
+	struct timer *t = head.next;
+	timer_list_unlink(t);
+	timer_wheel_insert(w, t, w->now);
+   }
+}
+
+/*
+ * Move the wheel forward to now, one tick at a time, running the timers
+ * of every slot it goes through. Callbacks are free to add timers again.
+ */
+void timer_wheel_advance(struct timer_wheel *w, unsigned long long now)
+{
+   struct timer head;
+
+   while(w->now < now)
+   {
+	if(w->count == 0)
+	{
+	   w->now = now;
+	   break;
+	}
+
+	w->now++;
+	for(int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+	{
+	   int shift = TIMER_WHEEL_BITS * (level - 1);
+	   if(((w->now >> shift) & TIMER_WHEEL_MASK) != 0)
+		   break;
+	   timer_wheel_cascade(w, level,
+			   (w->now >> (shift + TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+	}
+
+	timer_list_splice(&w->slots[0][w->now & TIMER_WHEEL_MASK], &head);
+	while(!timer_list_empty(&head))
+	{
+	   struct timer *t = head.next;
+	   timer_list_unlink(t);
+	   w->count--;
+	   t->call(t);
+	}
+   }
+}
+
+/*
+ * Ticks until the wheel has something to do: the next non empty slot of
+ * the first wheel, or its next wrap when upper levels have to cascade.
+ * Returns -1 when no timer is pending.
+ */
+long long timer_wheel_next(const struct timer_wheel *w)
+{
+   if(w->count == 0)
+	   return -1;
+
+   for(long long i = 1; i <= TIMER_WHEEL_SLOTS; i++)
+   {
+	unsigned long long tick = w->now + i;
+	if((tick & TIMER_WHEEL_MASK) == 0 ||
+			!timer_list_empty(&w->slots[0][tick & TIMER_WHEEL_MASK]))
+		return i;
+   }
+   return TIMER_WHEEL_SLOTS;
+}
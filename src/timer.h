@@ -0,0 +1,49 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdio.h>
+
+/*
+ * Hierarchical timing wheel: TIMER_WHEEL_LEVELS wheels of
+ * TIMER_WHEEL_SLOTS slots each, the first one ticking every
+ * TIMER_TICK_MS and every following one covering a full turn of the
+ * previous. Add and delete are O(1), timers of the upper levels are
+ * cascaded down as the lower wheel wraps.
+ */
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer
+{
+   struct timer *prev;
+   struct timer *next;
+   unsigned long long expires;
+   void (*call)(struct timer *);
+   void *args;
+};
+
+struct timer_wheel
+{
+   unsigned long long now;
+   size_t count;
+   struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *, unsigned long long);
+
+void timer_init(struct timer *, void (*)(struct timer *), void *);
+
+int timer_pending(const struct timer *);
+
+void timer_wheel_add(struct timer_wheel *, struct timer *, unsigned long long);
+
+void timer_wheel_del(struct timer_wheel *, struct timer *);
+
+void timer_wheel_advance(struct timer_wheel *, unsigned long long);
+
+long long timer_wheel_next(const struct timer_wheel *);
+
+#endif
@@ -0,0 +1,621 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+#include "epoch.h"
+#include "trie.h"
+
+
+/* Length of the level of topic starting at pos */
+static size_t level_len(const char *topic, size_t len, size_t pos)
+{
+   const char *end = memchr(topic + pos, '/', len - pos);
+   return end ? (size_t)(end - topic) - pos : len - pos;
+}
+
+static int is_wildcard(const char *level, size_t len)
+{
+   return len == 1 && (level[0] == '+' || level[0] == '#');
+}
+
+static void stats_add(Trie *trie, long long nodes, long long bytes)
+{
+   __atomic_add_fetch(&trie->nodes, nodes, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&trie->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* A NULL label is left for the caller to fill in */
+static struct trie_node *trie_node_create(Trie *trie,
+					  const char *label,
+					  size_t len,
+					  size_t first)
+{
+   size_t size = sizeof(struct trie_node) + len + 1;
+   struct trie_node *node = calloc(1, size);
+   if(!node)
+	   return NULL;
+   if(label)
+	   memcpy(node->label, label, len);
+   node->label[len] = '\0';
+   node->len = len;
+   node->first = first;
+   stats_add(trie, 1, size);
+   return node;
+}
+
+/* Only for nodes never published */
+static void trie_node_destroy(Trie *trie, struct trie_node *node)
+{
+   stats_add(trie, -1, -(long long)(sizeof(*node) + node->len + 1));
+   free(node->children);
+   free(node);
+}
+
+static struct trie_index *trie_index_create(Trie *trie,
+					    size_t capacity,
+					    int hashed)
+{
+   size_t size = sizeof(struct trie_index) + capacity * sizeof(struct trie_node *);
+   struct trie_index *idx = calloc(1, size);
+   if(!idx)
+	   return NULL;
+   idx->capacity = capacity;
+   idx->hashed = hashed;
+   stats_add(trie, 0, size);
+   return idx;
+}
+
+static void trie_index_retire(Trie *trie, struct trie_index *idx)
+{
+   if(!idx)
+	   return;
+   stats_add(trie, 0, -(long long)(sizeof(*idx) +
+				   idx->capacity * sizeof(struct trie_node *)));
+   epoch_retire(idx, free);
+}
+
+int trie_init(Trie *trie)
+{
+   trie->nodes = 0;
+   trie->bytes = 0;
+   trie->root = trie_node_create(trie, "", 0, 0);
+   return trie->root ? 0 : -1;
+}
+
+static int first_level_eq(const struct trie_node *node,
+			  const char *level,
+			  size_t len)
+{
+   return node->first == len && memcmp(node->label, level, len) == 0;
+}
+
+/*
+ * Slot of the child whose first level is level. Once hashed, the empty
+ * slot where it would go is returned when missing; NULL otherwise.
+ * Array slots are filled before nchildren is raised and table slots are
+ * set at once, so both are safe to walk while the writer adds children.
+ */
+static struct trie_node **child_slot(const struct trie_node *node,
+				     const char *level,
+				     size_t len)
+{
+   struct trie_index *idx = __atomic_load_n(&node->children, __ATOMIC_ACQUIRE);
+   if(!idx)
+	   return NULL;
+
+   if(!idx->hashed)
+   {
+	unsigned n = __atomic_load_n(&idx->nchildren, __ATOMIC_ACQUIRE);
+	for(unsigned i = 0; i < n; i++)
+	{
+	   struct trie_node *child =
+		   __atomic_load_n(&idx->slots[i], __ATOMIC_ACQUIRE);
+	   if(first_level_eq(child, level, len))
+		   return &idx->slots[i];
+	}
+	return NULL;
+   }
+
+   size_t mask = idx->capacity - 1;
+   size_t i = hashtable_hash_words(level, len) & mask;
+   struct trie_node *child;
+   while((child = __atomic_load_n(&idx->slots[i], __ATOMIC_ACQUIRE)) &&
+		   !first_level_eq(child, level, len))
+	   i = (i + 1) & mask;
+   return &idx->slots[i];
+}
+
+static struct trie_node *child_get(const struct trie_node *node,
+				   const char *level,
+				   size_t len)
+{
+   struct trie_node **slot = child_slot(node, level, len);
+   return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+}
+
+static void table_put(struct trie_index *idx, struct trie_node *child)
+{
+   size_t mask = idx->capacity - 1;
+   size_t i = hashtable_hash_words(child->label, child->first) & mask;
+   while(idx->slots[i])
+	   i = (i + 1) & mask;
+   __atomic_store_n(&idx->slots[i], child, __ATOMIC_RELEASE);
+   idx->nchildren++;
+}
+
+/*
+ * New index of capacity slots holding the children of old plus child,
+ * hashed once past TRIE_INLINE_CHILDREN; tables are kept under half full.
+ */
+static struct trie_index *index_copy(Trie *trie,
+				     const struct trie_index *old,
+				     size_t capacity,
+				     struct trie_node *child)
+{
+   int hashed = capacity > TRIE_INLINE_CHILDREN;
+   struct trie_index *idx = trie_index_create(trie, capacity, hashed);
+   if(!idx)
+	   return NULL;
+
+   size_t n = old ? (old->hashed ? old->capacity : old->nchildren) : 0;
+   for(size_t i = 0; i < n; i++)
+   {
+	if(!old->slots[i])
+		continue;
+	if(hashed)
+		table_put(idx, old->slots[i]);
+	else
+		idx->slots[idx->nchildren++] = old->slots[i];
+   }
+   if(hashed)
+	   table_put(idx, child);
+   else
+	   idx->slots[idx->nchildren++] = child;
+   return idx;
+}
+
+static int child_add(Trie *trie, struct trie_node *node, struct trie_node *child)
+{
+   struct trie_index *idx = node->children;
+
+   if(idx && !idx->hashed && idx->nchildren < idx->capacity)
+   {
+	idx->slots[idx->nchildren] = child;
+	__atomic_store_n(&idx->nchildren, idx->nchildren + 1, __ATOMIC_RELEASE);
+	return 0;
+   }
+   if(idx && idx->hashed && (idx->nchildren + 1) * 2 <= idx->capacity)
+   {
+	table_put(idx, child);
+	return 0;
+   }
+
+   size_t capacity;
+   if(!idx)
+	   capacity = 2;
+   else if(!idx->hashed && idx->capacity < TRIE_INLINE_CHILDREN)
+	   capacity = idx->capacity * 2;
+   else if(!idx->hashed)
+	   capacity = TRIE_INLINE_CHILDREN * 4;
+   else
+	   capacity = idx->capacity * 2;
+
+   struct trie_index *copy = index_copy(trie, idx, capacity, child);
+   if(!copy)
+	   return -1;
+   __atomic_store_n(&node->children, copy, __ATOMIC_RELEASE);
+   trie_index_retire(trie, idx);
+   return 0;
+}
+
+/* Length of the run of exact levels of filter starting at pos */
+static size_t exact_run(const char *filter, size_t len, size_t pos)
+{
+   size_t end = pos + level_len(filter, len, pos);
+   for(size_t p = end + 1; p <= len; p = end + 1)
+   {
+	size_t levellen = level_len(filter, len, p);
+	if(is_wildcard(filter + p, levellen))
+		break;
+	end = p + levellen;
+   }
+   return end - pos;
+}
+
+/*
+ * Length of the prefix of the node label made of whole levels equal to
+ * the ones of filter at pos; the first level is known to match.
+ */
+static size_t common_levels(const struct trie_node *node,
+			    const char *filter,
+			    size_t len,
+			    size_t pos)
+{
+   size_t i = 0, common = 0;
+   while(i < node->len && pos + i < len && node->label[i] == filter[pos + i])
+   {
+	if(node->label[i] == '/')
+		common = i;
+	i++;
+   }
+   if(pos + i == len || (pos + i < len && filter[pos + i] == '/'))
+	   if(i == node->len || node->label[i] == '/')
+		   common = i;
+   return common;
+}
+
+/* Whole label of node equal to the levels of topic at pos */
+static int label_matches(const struct trie_node *node,
+			 const char *topic,
+			 size_t len,
+			 size_t pos)
+{
+   size_t end = pos + node->len;
+   return end <= len && memcmp(node->label, topic + pos, node->len) == 0 &&
+	   (end == len || topic[end] == '/');
+}
+
+/*
+ * Cut node after its first common bytes: the head and the rest of the
+ * label become two new nodes, the rest taking over children and data,
+ * and the head replaces node in its slot, under the same first level.
+ * Readers already on node keep seeing it whole until it is reclaimed.
+ */
+static struct trie_node *node_split(Trie *trie,
+				    struct trie_node **slot,
+				    size_t common)
+{
+   struct trie_node *node = *slot;
+   const char *rest = node->label + common + 1;
+   size_t restlen = node->len - common - 1;
+
+   struct trie_node *head = trie_node_create(trie, node->label, common,
+					     node->first);
+   struct trie_node *tail = trie_node_create(trie, rest, restlen,
+					     level_len(rest, restlen, 0));
+   if(!head || !tail || child_add(trie, head, tail) < 0)
+   {
+	if(head)
+		trie_node_destroy(trie, head);
+	if(tail)
+		trie_node_destroy(trie, tail);
+	return NULL;
+   }
+   tail->children = node->children;
+   tail->plus = node->plus;
+   tail->hash = node->hash;
+   tail->data = node->data;
+
+   __atomic_store_n(slot, head, __ATOMIC_RELEASE);
+   stats_add(trie, -1, -(long long)(sizeof(*node) + node->len + 1));
+   epoch_retire(node, free);
+   return head;
+}
+
+static struct trie_node *wildcard_add(Trie *trie,
+				      struct trie_node **child,
+				      const char *level)
+{
+   if(!*child)
+	   __atomic_store_n(child, trie_node_create(trie, level, 1, 1),
+			    __ATOMIC_RELEASE);
+   return *child;
+}
+
+/*
+ * Create the path of a topic filter, '+' and '#' levels included, and
+ * return the slot holding its data, to be set with a release store. A new
+ * branch takes every exact level up to the next wildcard in a single
+ * node. Writers must be serialized by the caller.
+ */
+void **trie_insert(Trie *trie, const char *filter, size_t len)
+{
+   struct trie_node *node = trie->root;
+   size_t pos = 0;
+
+   while(node && pos <= len)
+   {
+	const char *level = filter + pos;
+	size_t levellen = level_len(filter, len, pos);
+	if(levellen == 1 && level[0] == '+')
+	{
+	   node = wildcard_add(trie, &node->plus, level);
+	   pos += 2;
+	   continue;
+	}
+	if(levellen == 1 && level[0] == '#')
+	{
+	   node = wildcard_add(trie, &node->hash, level);
+	   pos += 2;
+	   continue;
+	}
+
+	struct trie_node **slot = child_slot(node, level, levellen);
+	if(!slot || !*slot)
+	{
+	   size_t run = exact_run(filter, len, pos);
+	   struct trie_node *child = trie_node_create(trie, level, run, levellen);
+	   if(child && child_add(trie, node, child) < 0)
+	   {
+		trie_node_destroy(trie, child);
+		child = NULL;
+	   }
+	   node = child;
+	   pos += run + 1;
+	   continue;
+	}
+
+	size_t common = common_levels(*slot, filter, len, pos);
+	node = common < (*slot)->len ? node_split(trie, slot, common) : *slot;
+	pos += common + 1;
+   }
+   return node ? &node->data : NULL;
+}
+
+static int node_empty(const struct trie_node *node)
+{
+   return !node->data && !node->plus && !node->hash &&
+	   (!node->children || node->children->nchildren == 0);
+}
+
+static void node_retire(Trie *trie, struct trie_node *node)
+{
+   stats_add(trie, -1, -(long long)(sizeof(*node) + node->len + 1));
+   epoch_retire(node, free);
+}
+
+/* Publish the index of node without child, none once it was the last */
+static int child_del(Trie *trie, struct trie_node *node, struct trie_node *child)
+{
+   struct trie_index *old = node->children;
+   struct trie_index *idx = NULL;
+
+   if(old->nchildren > 1)
+   {
+	size_t capacity = old->capacity;
+	if(old->hashed && old->nchildren - 1 <= TRIE_INLINE_CHILDREN)
+		capacity = TRIE_INLINE_CHILDREN;
+	idx = trie_index_create(trie, capacity, capacity > TRIE_INLINE_CHILDREN);
+	if(!idx)
+		return -1;
+	size_t n = old->hashed ? old->capacity : old->nchildren;
+	for(size_t i = 0; i < n; i++)
+	{
+	   if(!old->slots[i] || old->slots[i] == child)
+		   continue;
+	   if(idx->hashed)
+		   table_put(idx, old->slots[i]);
+	   else
+		   idx->slots[idx->nchildren++] = old->slots[i];
+	}
+   }
+   __atomic_store_n(&node->children, idx, __ATOMIC_RELEASE);
+   trie_index_retire(trie, old);
+   return 0;
+}
+
+/*
+ * Merge node, left with no data and a single exact child, with that child
+ * into a new node taking its place in slot, the run of exact levels
+ * being back in one node as if it had been inserted that way.
+ */
+static void node_merge(Trie *trie, struct trie_node **slot)
+{
+   struct trie_node *node = *slot;
+   struct trie_node *child = node->children->slots[0];
+   if(node->children->hashed)
+	   for(unsigned i = 0; !child; i++)
+		   child = node->children->slots[i];
+
+   size_t len = node->len + 1 + child->len;
+   struct trie_node *merged = trie_node_create(trie, NULL, len, node->first);
+   if(!merged)
+	   return;
+   memcpy(merged->label, node->label, node->len);
+   merged->label[node->len] = '/';
+   memcpy(merged->label + node->len + 1, child->label, child->len);
+   merged->children = child->children;
+   merged->plus = child->plus;
+   merged->hash = child->hash;
+   merged->data = child->data;
+
+   __atomic_store_n(slot, merged, __ATOMIC_RELEASE);
+   trie_index_retire(trie, node->children);
+   node_retire(trie, node);
+   node_retire(trie, child);
+}
+
+static int node_mergeable(const struct trie_node *node)
+{
+   return !node->data && !node->plus && !node->hash && node->children &&
+	   node->children->nchildren == 1;
+}
+
+/*
+ * Clear the data slot of a filter and unlink the nodes it leaves with no
+ * data and no children, bottom up, retiring them; a node left with a
+ * single exact child is merged with it. Returns -1 when filter is not in
+ * the trie. Writers must be serialized by the caller.
+ */
+int trie_remove(Trie *trie, const char *filter, size_t len)
+{
+   size_t depth = 2;
+   for(size_t i = 0; i < len; i++)
+	   depth += filter[i] == '/';
+   /* Each node on the path and the slot holding it in its parent */
+   struct trie_node ***slots = malloc(depth * sizeof(*slots));
+   if(!slots)
+	   return -1;
+
+   struct trie_node **slot = &trie->root;
+   size_t pos = 0, n = 0;
+   while(*slot && pos <= len)
+   {
+	struct trie_node *node = *slot;
+	slots[n++] = slot;
+	const char *level = filter + pos;
+	size_t levellen = level_len(filter, len, pos);
+	if(levellen == 1 && level[0] == '+')
+		slot = &node->plus;
+	else if(levellen == 1 && level[0] == '#')
+		slot = &node->hash;
+	else if(!(slot = child_slot(node, level, levellen)) || (*slot &&
+			   !label_matches(*slot, filter, len, pos)))
+		break;
+	if(!*slot)
+		break;
+	pos += (*slot)->len + 1;
+   }
+   if(!slot || !*slot || pos <= len || !(*slot)->data)
+   {
+	free(slots);
+	return -1;
+   }
+   slots[n++] = slot;
+
+   __atomic_store_n(&(*slot)->data, NULL, __ATOMIC_RELEASE);
+   /* The root, slots[0], stays whatever is left */
+   while(n > 1 && node_empty(*slots[n - 1]))
+   {
+	struct trie_node *node = *slots[n - 1];
+	struct trie_node *parent = *slots[n - 2];
+	if(slots[n - 1] == &parent->plus || slots[n - 1] == &parent->hash)
+		__atomic_store_n(slots[n - 1], NULL, __ATOMIC_RELEASE);
+	else if(child_del(trie, parent, node) < 0)
+		break;
+	node_retire(trie, node);
+	n--;
+   }
+
+   /* Only exact children of an exact parent merge, never the root */
+   struct trie_node **last = slots[n - 1];
+   if(n > 1 && node_mergeable(*last) && !is_wildcard((*last)->label, (*last)->len)
+		   && last != &(*slots[n - 2])->plus && last != &(*slots[n - 2])->hash)
+	   node_merge(trie, last);
+   free(slots);
+   return 0;
+}
+
+/* Exact lookup of a filter, wildcards are matched as plain labels */
+void *trie_find(const Trie *trie, const char *filter, size_t len)
+{
+   const struct trie_node *node = trie->root;
+   size_t pos = 0;
+
+   while(node && pos <= len)
+   {
+	const char *level = filter + pos;
+	size_t levellen = level_len(filter, len, pos);
+	if(levellen == 1 && level[0] == '+')
+		node = __atomic_load_n(&node->plus, __ATOMIC_ACQUIRE);
+	else if(levellen == 1 && level[0] == '#')
+		node = __atomic_load_n(&node->hash, __ATOMIC_ACQUIRE);
+	else
+	{
+	   node = child_get(node, level, levellen);
+	   if(node && !label_matches(node, filter, len, pos))
+		   return NULL;
+	}
+	pos += node ? node->len + 1 : 0;
+   }
+   return node ? __atomic_load_n(&node->data, __ATOMIC_ACQUIRE) : NULL;
+}
+
+/*
+ * Nodes still to visit, each with the position in the topic of the level
+ * following its label. Each node of the trie has a single path to the
+ * root, so it is visited at most once and the walk is bounded by the
+ * number of matching filters.
+ */
+struct visit
+{
+   const struct trie_node *node;
+   size_t pos;
+};
+
+struct frontier
+{
+   struct visit *visits;
+   size_t len;
+   size_t capacity;
+};
+
+static __thread struct frontier frontier;
+
+static void frontier_push(struct frontier *f,
+			  const struct trie_node *node,
+			  size_t pos)
+{
+   if(f->len == f->capacity)
+   {
+	size_t capacity = f->capacity ? f->capacity * 2 : 64;
+	struct visit *visits = realloc(f->visits, capacity * sizeof(*visits));
+	if(!visits)
+		return;
+	f->visits = visits;
+	f->capacity = capacity;
+   }
+   f->visits[f->len].node = node;
+   f->visits[f->len].pos = pos;
+   f->len++;
+}
+
+static void emit(const struct trie_node *node, trie_match_cb *cb, void *arg)
+{
+   void *data = node ? __atomic_load_n(&node->data, __ATOMIC_ACQUIRE) : NULL;
+   if(data)
+	   cb(data, arg);
+}
+
+/*
+ * Call cb on the data of every filter matching topic: a node forwards to
+ * its exact child when the whole child label matches and to its '+'
+ * child, while its '#' child matches right away. Per MQTT 4.7.2 topics
+ * starting with '$' are not matched by a wildcard on the first level.
+ * Must be called inside an epoch.
+ */
+void trie_match(const Trie *trie,
+		const char *topic,
+		size_t len,
+		trie_match_cb *cb,
+		void *arg)
+{
+   struct frontier *f = &frontier;
+   int dollar = len > 0 && topic[0] == '$';
+
+   f->len = 0;
+   frontier_push(f, trie->root, 0);
+
+   while(f->len > 0)
+   {
+	struct visit v = f->visits[--f->len];
+	const struct trie_node *hash =
+		__atomic_load_n(&v.node->hash, __ATOMIC_ACQUIRE);
+	if(v.pos > len)
+	{
+	   /* "a/#" also matches "a" */
+	   emit(v.node, cb, arg);
+	   emit(hash, cb, arg);
+	   continue;
+	}
+
+	const char *level = topic + v.pos;
+	size_t levellen = level_len(topic, len, v.pos);
+	if(v.pos > 0 || !dollar)
+	{
+	   const struct trie_node *plus =
+		   __atomic_load_n(&v.node->plus, __ATOMIC_ACQUIRE);
+	   emit(hash, cb, arg);
+	   if(plus)
+		   frontier_push(f, plus, v.pos + levellen + 1);
+	}
+	const struct trie_node *child = child_get(v.node, level, levellen);
+	if(child && label_matches(child, topic, len, v.pos))
+		frontier_push(f, child, v.pos + child->len + 1);
+   }
+}
+
+void trie_stats(const Trie *trie, struct trie_stats *stats)
+{
+   stats->nodes = __atomic_load_n(&trie->nodes, __ATOMIC_RELAXED);
+   stats->bytes = __atomic_load_n(&trie->bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,70 @@
+#ifndef TRIE_H
+#define TRIE_H
+
+#include <stdio.h>
+
+/*
+ * Path compressed topic trie. A node label holds one or more topic levels,
+ * runs of exact levels with a single child and no data being merged in
+ * one node, and is split when a filter diverges in its middle. Exact
+ * children are indexed by the first level of their label, in a small
+ * array scanned linearly up to TRIE_INLINE_CHILDREN and in an open
+ * addressing table past it; the '+' and '#' children of a node hang off
+ * dedicated pointers so the matcher reaches them without a lookup.
+ *
+ * Lookups take no lock and run inside an epoch (see epoch.h), a single
+ * writer at a time updates the trie: a node or index is only written in
+ * place where a reader cannot see it half done, every other change
+ * publishes a new version and retires the old one.
+ */
+#define TRIE_INLINE_CHILDREN 8
+
+struct trie_index
+{
+   unsigned nchildren;
+   unsigned capacity;	/* array length, or table slots once hashed */
+   int hashed;
+   struct trie_node *slots[];
+};
+
+struct trie_node
+{
+   struct trie_index *children;
+   struct trie_node *plus;
+   struct trie_node *hash;
+   void *data;
+   unsigned len;
+   unsigned first;	/* length of the first level of label */
+   char label[];
+};
+
+struct trie
+{
+   struct trie_node *root;
+   size_t nodes;
+   size_t bytes;
+};
+
+typedef struct trie Trie;
+
+struct trie_stats
+{
+   size_t nodes;
+   size_t bytes;
+};
+
+typedef void trie_match_cb(void *, void *);
+
+int trie_init(Trie *);
+
+void **trie_insert(Trie *, const char *, size_t);
+
+int trie_remove(Trie *, const char *, size_t);
+
+void *trie_find(const Trie *, const char *, size_t);
+
+void trie_match(const Trie *, const char *, size_t, trie_match_cb *, void *);
+
+void trie_stats(const Trie *, struct trie_stats *);
+
+#endif
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+
+static void *ring_map(int fd, size_t size, off_t offset)
+{
+   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, offset);
+   return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/* Returns 0 on success, a negative errno otherwise */
+int ring_init(struct ring *r, unsigned entries)
+{
+   struct io_uring_params p;
+   memset(&p, 0x00, sizeof(p));
+   memset(r, 0x00, sizeof(*r));
+   int rc;
+
+   r->fd = syscall(__NR_io_uring_setup, entries, &p);
+   if(r->fd < 0)
+	   return -errno;
+
+   r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   r->cq_map_size = p.cq_off.cqes +
+	   p.cq_entries * sizeof(struct io_uring_cqe);
+   if(p.features & IORING_FEAT_SINGLE_MMAP)
+   {
+	if(r->cq_map_size > r->sq_map_size)
+		r->sq_map_size = r->cq_map_size;
+	r->cq_map_size = 0;
+   }
+
+   r->sq_map = ring_map(r->fd, r->sq_map_size, IORING_OFF_SQ_RING);
+   if(!r->sq_map)
+	   goto err;
+   r->cq_map = r->cq_map_size == 0 ? r->sq_map :
+	   ring_map(r->fd, r->cq_map_size, IORING_OFF_CQ_RING);
+   if(!r->cq_map)
+	   goto err;
+   r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+   r->sqes = ring_map(r->fd, r->sqes_size, IORING_OFF_SQES);
+   if(!r->sqes)
+	   goto err;
+
+   char *sq = r->sq_map, *cq = r->cq_map;
+   r->sq_entries = p.sq_entries;
+   r->sq_head = (unsigned *) (sq + p.sq_off.head);
+   r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+   r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+   r->sq_array = (unsigned *) (sq + p.sq_off.array);
+   r->cq_head = (unsigned *) (cq + p.cq_off.head);
+   r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+   r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+   r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+   /* SQE i always sits in slot i of the submission array */
+   for(unsigned i = 0; i < r->sq_entries; i++)
+	   r->sq_array[i] = i;
+   r->sqe_tail = *r->sq_tail;
+   return 0;
+
+err:
+   rc = -errno;
+   ring_exit(r);
+   return rc;
+}
+
+void ring_exit(struct ring *r)
+{
+   if(r->sqes)
+	   munmap(r->sqes, r->sqes_size);
+   if(r->cq_map && r->cq_map != r->sq_map)
+	   munmap(r->cq_map, r->cq_map_size);
+   if(r->sq_map)
+	   munmap(r->sq_map, r->sq_map_size);
+   close(r->fd);
+   r->sqes = NULL;
+   r->sq_map = r->cq_map = NULL;
+}
+
+/* NULL when every SQE is taken, ring_submit hands them to the kernel */
+struct io_uring_sqe *ring_get_sqe(struct ring *r)
+{
+   unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+   if(r->sqe_tail - head >= r->sq_entries)
+	   return NULL;
+   struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+   memset(sqe, 0x00, sizeof(*sqe));
+   r->sqe_tail++;
+   return sqe;
+}
+
+/*
+ * Publish the SQEs filled since the last call and wait for at least
+ * wait_nr completions; returns the number of SQEs consumed or a negative
+ * errno.
+ */
+int ring_submit(struct ring *r, unsigned wait_nr)
+{
+   unsigned pending = r->sqe_tail - *r->sq_tail;
+   if(pending == 0 && wait_nr == 0)
+	   return 0;
+   __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+   int rc = syscall(__NR_io_uring_enter, r->fd, pending, wait_nr,
+		    wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+   return rc < 0 ? -errno : rc;
+}
+
+unsigned ring_cq_ready(const struct ring *r)
+{
+   return __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+}
+
+/* The i-th completion past the ring head, i below ring_cq_ready */
+struct io_uring_cqe *ring_cqe_at(const struct ring *r, unsigned i)
+{
+   return &r->cqes[(*r->cq_head + i) & *r->cq_mask];
+}
+
+void ring_cq_advance(struct ring *r, unsigned n)
+{
+   __atomic_store_n(r->cq_head, *r->cq_head + n, __ATOMIC_RELEASE);
+}
+
+void ring_prep_poll_add(struct io_uring_sqe *sqe, int fd,
+			unsigned mask, uint64_t data)
+{
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = fd;
+   sqe->poll32_events = mask;
+   sqe->user_data = data;
+}
+
+/* Change the mask of the poll tagged data, the update itself is tagged 0 */
+void ring_prep_poll_update(struct io_uring_sqe *sqe, uint64_t data,
+			   unsigned mask)
+{
+   sqe->opcode = IORING_OP_POLL_REMOVE;
+   sqe->fd = -1;
+   sqe->addr = data;
+   sqe->len = IORING_POLL_UPDATE_EVENTS;
+   sqe->poll32_events = mask;
+   sqe->user_data = 0;
+}
+
+/* Cancel the request tagged data, the cancel itself is tagged 0 */
+void ring_prep_cancel(struct io_uring_sqe *sqe, uint64_t data)
+{
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->fd = -1;
+   sqe->addr = data;
+   sqe->user_data = 0;
+}
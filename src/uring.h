@@ -0,0 +1,54 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * Bare io_uring submission and completion rings, set up and entered
+ * through the raw system calls. Only what the event loop needs: SQEs are
+ * filled in place and published all together by ring_submit, completions
+ * are read in order from the ring head and consumed with ring_cq_advance.
+ */
+struct ring
+{
+   int fd;
+   unsigned sq_entries;
+   unsigned *sq_head;
+   unsigned *sq_tail;
+   unsigned *sq_mask;
+   unsigned *sq_array;
+   unsigned sqe_tail;
+   struct io_uring_sqe *sqes;
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned *cq_mask;
+   struct io_uring_cqe *cqes;
+   void *sq_map;
+   size_t sq_map_size;
+   void *cq_map;
+   size_t cq_map_size;
+   size_t sqes_size;
+};
+
+int ring_init(struct ring *, unsigned);
+
+void ring_exit(struct ring *);
+
+struct io_uring_sqe *ring_get_sqe(struct ring *);
+
+int ring_submit(struct ring *, unsigned);
+
+unsigned ring_cq_ready(const struct ring *);
+
+struct io_uring_cqe *ring_cqe_at(const struct ring *, unsigned);
+
+void ring_cq_advance(struct ring *, unsigned);
+
+void ring_prep_poll_add(struct io_uring_sqe *, int, unsigned, uint64_t);
+
+void ring_prep_poll_update(struct io_uring_sqe *, uint64_t, unsigned);
+
+void ring_prep_cancel(struct io_uring_sqe *, uint64_t);
+
+#endif
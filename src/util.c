@@ -37,14 +37,14 @@ void sol_log(int level, const char *fmt, ...)
    char msg[MAX_LOG_SIZE + 4];
    if(level < conf->loglevel)
 	   return;
-   va_satrt(ap, fmt);
+   va_start(ap, fmt);
    vsnprintf(msg, sizeof(msg), fmt, ap);
    va_end(ap);
 
    memcpy(msg + MAX_LOG_SIZE, "...", 3);
    msg[MAX_LOG_SIZE + 3] = '\0';
 
-   cosnt char *mark = "#i*!";
+   const char *mark = "#i*!";
 
    FILE *fp = stdout;
    if(!fp)
@@ -95,7 +95,7 @@ char *remove_occur(char *str, char c)
 char *append_string(char *src, char *chunk, size_t chunklen)
 {
    size_t srclen = strlen(src);
-   char *ret = malloc(srclen + chunk + 1);
+   char *ret = malloc(srclen + chunklen + 1);
    memcpy(ret, src, srclen);
    memcpy(ret + srclen, chunk, chunklen);
    ret[srclen + chunklen] = '\0';
@@ -105,8 +105,8 @@ char *append_string(char *src, char *chunk, size_t chunklen)
 int generate_uuid(char *uuid_placeholder)
 {
    uuid_t binuuid;
-   uuid_generaet_random(binuuid);
-   uuid_unprase(bind, uuid_placeholder);
+   uuid_generate_random(binuuid);
+   uuid_unparse(binuuid, uuid_placeholder);
    return 0;
 }
 
@@ -18,7 +18,7 @@ enum log_level
 };
 
 int number_len(size_t);
-int prase_int(const char *);
+int parse_int(const char *);
 int generate_uuid(char *);
 char *remove_occur(char *, char);
 char *append_string(char *, char *, size_t);
@@ -29,9 +29,9 @@ void sol_log(int, const char *, ...);
 
 #define log(...) sol_log(__VA_ARGS__)
 #define sol_debug(...) log(DEBUG, __VA_ARGS__)
-#define sol_warring log(WARRING, __VA_ARGS__)
-#define sol_error log(ERROR, __VA_ARGS__)
-#define sol_info log(INFORMATION, __VA_ARGS__)
+#define sol_warring(...) log(WARING, __VA_ARGS__)
+#define sol_error(...) log(ERROR, __VA_ARGS__)
+#define sol_info(...) log(INFORMATION, __VA_ARGS__)
 
 #define STREQ(s1, s2, len) strncasecmp(s1, s2, len) == 0 ? true : false
 #endif
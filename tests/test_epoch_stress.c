@@ -0,0 +1,221 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "core.h"
+#include "epoch.h"
+#include "config.h"
+
+/*
+ * Publishers match a topic without lock while a writer churns the
+ * subscriptions around it: filters overlapping the topic get subscribers
+ * added and removed, unrelated filters keep splitting trie nodes,
+ * growing child indexes and getting pruned again, every change retiring
+ * the old version through the epoch. Permanent subscribers must be delivered exactly once per
+ * match, churned ones at most once, and nothing retired may be freed
+ * while a publisher can still see it.
+ */
+#define NPUBLISHERS 4
+#define NPERM 50
+#define NCHURN 50
+#define ROUNDS 100000
+#define BOX_ALIVE 0x5A5A5A5A
+
+struct config *conf;
+static struct config config;
+
+static struct sol sol;
+static const struct interned *topic;
+static int stop;
+static long errors;
+static long matches;
+
+static struct sol_client perm[NPERM];
+static struct sol_client churn[NCHURN];
+
+/* Swapped by the writer on every round, checked by the publishers */
+struct box
+{
+   unsigned magic;
+   long round;
+};
+
+static struct box *box;
+static long retired;
+static long freed;
+
+static void box_free(void *ptr)
+{
+   struct box *b = ptr;
+   b->magic = 0;
+   free(b);
+   __atomic_add_fetch(&freed, 1, __ATOMIC_RELAXED);
+}
+
+struct seen
+{
+   int perm[NPERM];
+   int churn[NCHURN];
+};
+
+static void seen_handle(struct seen *s, uint64_t handle)
+{
+   if(handle < NPERM)
+	   s->perm[handle]++;
+   else if(handle - 1000 < NCHURN)
+	   s->churn[handle - 1000]++;
+}
+
+/* Subscribers matched by several filters are counted once per filter */
+static void on_topic(struct topic *t, void *arg)
+{
+   struct seen *s = arg;
+   const struct subscriber_set *set =
+	   __atomic_load_n(&t->subscribers, __ATOMIC_ACQUIRE);
+   if(!set)
+	   return;
+   size_t len = __atomic_load_n(&set->len, __ATOMIC_ACQUIRE);
+   for(size_t i = 0; i < len; i++)
+	   seen_handle(s, set->handles[i]);
+}
+
+static void check(const struct seen *s, int churn_max)
+{
+   int bad = 0;
+   for(int i = 0; i < NPERM; i++)
+	   bad |= s->perm[i] != 1;
+   for(int i = 0; i < NCHURN; i++)
+	   bad |= s->churn[i] > churn_max;
+   if(bad)
+	   __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+}
+
+static void *publisher(void *arg)
+{
+   (void)arg;
+   long n = 0;
+   while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+   {
+	struct seen s;
+
+	/* Straight walk of the trie */
+	memset(&s, 0, sizeof(s));
+	epoch_enter();
+	struct box *b = __atomic_load_n(&box, __ATOMIC_ACQUIRE);
+	sol_topic_match(&sol, topic->name, topic->len, on_topic, &s);
+	if(b->magic != BOX_ALIVE)
+		__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+	epoch_exit();
+	check(&s, 4);
+
+	/* Through the match cache, deduplicated per client */
+	memset(&s, 0, sizeof(s));
+	int hit;
+	const struct match_entry *e = sol_topic_match_cached(&sol, topic, 0, &hit);
+	if(!e)
+		continue;
+	for(size_t i = 0; e->subs && i < e->subs->nsubs; i++)
+		seen_handle(&s, e->subs->handles[i]);
+	check(&s, 1);
+	n++;
+   }
+   __atomic_add_fetch(&matches, n, __ATOMIC_RELAXED);
+   return NULL;
+}
+
+/* To be called with topics_lock held */
+static struct topic *topic_get_or_put(const char *filter)
+{
+   struct topic *t = sol_topic_get(&sol, filter, strlen(filter));
+   if(!t)
+   {
+	t = topic_create(filter, strlen(filter));
+	assert(t && sol_topic_put(&sol, t) == 0);
+   }
+   return t;
+}
+
+int main(void)
+{
+   conf = &config;
+   assert(trie_init(&sol.topics) == 0);
+   pthread_mutex_init(&sol.topics_lock, NULL);
+
+   const char *name = "site/1/dev/2/temp";
+   topic = topic_intern(name, strlen(name));
+   assert(topic);
+
+   struct topic *t = topic_get_or_put(name);
+   for(int i = 0; i < NPERM; i++)
+   {
+	perm[i].handle = i;
+	struct subscriber sub = { .qos = 1, .client = &perm[i] };
+	assert(subscriber_set_add(&t->subscribers, &sub) == 0);
+   }
+   for(int i = 0; i < NCHURN; i++)
+	   churn[i].handle = 1000 + i;
+
+   box = malloc(sizeof(*box));
+   box->magic = BOX_ALIVE;
+   box->round = 0;
+
+   pthread_t threads[NPUBLISHERS];
+   for(int i = 0; i < NPUBLISHERS; i++)
+	   assert(pthread_create(&threads[i], NULL, publisher, NULL) == 0);
+
+   const char *filters[] = {
+	"site/1/dev/2/temp", "site/+/dev/2/temp", "site/1/#", "site/1/dev/+/temp"
+   };
+   char buf[64];
+   for(int r = 0; r < ROUNDS; r++)
+   {
+	/* Odd rounds subscribe, even ones drop what was added 25 rounds earlier */
+	int q = r % 2 ? r / 2 : r / 2 - 25;
+	pthread_mutex_lock(&sol.topics_lock);
+	if(q >= 0)
+	{
+	   struct topic *x = topic_get_or_put(filters[q % 4]);
+	   struct sol_client *c = &churn[q % NCHURN];
+	   struct subscriber sub = { .qos = q % 3, .client = c };
+	   if(r % 2)
+		   subscriber_set_add(&x->subscribers, &sub);
+	   else
+		   subscriber_set_del(&x->subscribers, c->handle);
+	   sol_topic_prune(&sol, x);
+	}
+	/* Splits, merges and index changes next to the matched path */
+	snprintf(buf, sizeof(buf), "site/%d/dev/%d/x/y", r % 97, r % 13);
+	struct topic *y = topic_get_or_put(buf);
+	if(r % 3 == 0)
+		sol_topic_prune(&sol, y);
+	snprintf(buf, sizeof(buf), "site/1/dev/%d", r % 1000);
+	y = topic_get_or_put(buf);
+	if(r % 5 == 0)
+		sol_topic_prune(&sol, y);
+	sol_topics_changed(&sol);
+	pthread_mutex_unlock(&sol.topics_lock);
+
+	struct box *b = malloc(sizeof(*b));
+	b->magic = BOX_ALIVE;
+	b->round = r + 1;
+	struct box *old = __atomic_exchange_n(&box, b, __ATOMIC_ACQ_REL);
+	epoch_retire(old, box_free);
+	retired++;
+   }
+
+   __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+   for(int i = 0; i < NPUBLISHERS; i++)
+	   pthread_join(threads[i], NULL);
+
+   /* With every reader gone, two advances free whatever is left */
+   for(int i = 0; i < EPOCH_LISTS; i++)
+	   epoch_reclaim();
+
+   printf("epoch stress: %ld matches, %ld errors, %ld/%ld boxes freed\n",
+	  matches, errors, freed, retired);
+   assert(errors == 0);
+   assert(matches > 0);
+   assert(freed == retired);
+   return 0;
+}
@@ -0,0 +1,228 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+/* Built in, the tests publish through the static delivery path */
+#include "server.c"
+
+#define NSUBS 10
+#define CHUNK 3
+#define TOPIC "a/b"
+#define PAYLOAD "hello"
+/* Fixed header, topic length, topic and payload of a QoS0 PUBLISH */
+#define PKTLEN (2 + 2 + sizeof(TOPIC) - 1 + sizeof(PAYLOAD) - 1)
+
+struct config *conf;
+static struct config config;
+static struct reactor self;
+static struct closure conns[NSUBS];
+static struct sol_client clients[NSUBS];
+static int peers[NSUBS];
+static size_t counts[NSUBS];
+
+static void subscribe(const char *filter, struct sol_client *c)
+{
+   struct topic *t = sol_topic_get(&sol, filter, strlen(filter));
+   if(!t)
+   {
+	t = topic_create(filter, strlen(filter));
+	assert(t && sol_topic_put(&sol, t) == 0);
+   }
+   struct subscriber sub = { .qos = AT_MOST_ONCE, .client = c };
+   assert(subscriber_set_add(&t->subscribers, &sub) >= 0);
+   sol_topics_changed(&sol);
+}
+
+static void open_client(int i)
+{
+   int sv[2];
+   assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+   assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+   conns[i].fd = sv[0];
+   outqueue_init(&conns[i].outq);
+   assert(conntable_put(&connections, &conns[i]) == 0);
+   clients[i].handle = CONN_HANDLE(conns[i].fd, conns[i].gen);
+   clients[i].reactor = self.id;
+   peers[i] = sv[1];
+}
+
+/* PUBLISH packets that reached the peer of client i */
+static size_t received(int i)
+{
+   char buf[4096];
+   ssize_t n;
+   size_t total = 0;
+   while((n = recv(peers[i], buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+	   total += n;
+   assert(total % PKTLEN == 0);
+   return total / PKTLEN;
+}
+
+/*
+ * Past fanout_chunk subscribers the rest goes out from the inbox, still
+ * reaching everyone exactly once after the cache entry it came from has
+ * been rebuilt; clients matched by two filters are counted once.
+ */
+static void test_chunks(void)
+{
+   for(int i = 0; i < NSUBS; i++)
+   {
+	subscribe(TOPIC, &clients[i]);
+	if(i % 2)
+		subscribe("a/+", &clients[i]);
+   }
+
+   const struct interned *topic = topic_intern(TOPIC, strlen(TOPIC));
+   assert(topic);
+   publish_message(0, topic, strlen(PAYLOAD), (unsigned char *) PAYLOAD);
+
+   size_t first = 0;
+   for(int i = 0; i < NSUBS; i++)
+   {
+	counts[i] += received(i);
+	first += counts[i];
+   }
+   assert(first == CHUNK);
+   assert(self.inbox_head != NULL);
+
+   /* The remainder keeps its own reference to the subscribers */
+   int hit;
+   sol_topics_changed(&sol);
+   assert(sol_topic_match_cached(&sol, topic, self.id, &hit) && !hit);
+
+   int rounds = 0;
+   while(self.inbox_head)
+   {
+	on_handoff(self.loop, &self.inbox);
+	rounds++;
+   }
+   /* One chunk per round */
+   assert(rounds == (NSUBS - 1) / CHUNK);
+
+   for(int i = 0; i < NSUBS; i++)
+   {
+	counts[i] += received(i);
+	assert(counts[i] == 1);
+   }
+   topic_release(topic);
+}
+
+/*
+ * The last subscriber leaving prunes the topic, which gives its name
+ * back to the intern table once reclaimed.
+ */
+static void test_prune(void)
+{
+   const char *filter = "p/q/+";
+   struct sol_client *c = &clients[0];
+   subscribe(filter, c);
+   struct topic *t = sol_topic_get(&sol, filter, strlen(filter));
+   assert(t && sol_client_subscribe(c, t, NULL) == 0);
+   const struct interned *in = topic_lookup(filter, strlen(filter));
+   assert(in && in->refs == 1);
+
+   sol_client_unsubscribe_all(&sol, c);
+   assert(sol_topic_get(&sol, filter, strlen(filter)) == NULL);
+   for(int i = 0; i < EPOCH_LISTS; i++)
+	   epoch_reclaim();
+   assert(in->refs == 0);
+}
+
+/*
+ * A group losing its last member is unlinked and retired, cached matches
+ * pointing to it are rebuilt without it.
+ */
+static void test_share_prune(void)
+{
+   const char *filter = "s/t";
+   struct sol_client *c = &clients[1];
+   struct topic *t = topic_create(filter, strlen(filter));
+   assert(t && sol_topic_put(&sol, t) == 0);
+   struct share_group *g = topic_share_group(t, "g", 1, SHARE_ROUND_ROBIN);
+   struct subscriber sub = { .qos = AT_MOST_ONCE, .client = c };
+   assert(g && subscriber_set_add(&g->members, &sub) == 0);
+   assert(sol_client_subscribe(c, t, g) == 0);
+   sol_topics_changed(&sol);
+
+   const struct interned *topic = topic_intern(filter, strlen(filter));
+   int hit;
+   const struct match_entry *e =
+	   sol_topic_match_cached(&sol, topic, self.id, &hit);
+   assert(e && e->ngroups == 1 && e->groups[0] == g);
+
+   sol_client_unsubscribe_all(&sol, c);
+   assert(sol_topic_get(&sol, filter, strlen(filter)) == NULL);
+   e = sol_topic_match_cached(&sol, topic, self.id, &hit);
+   assert(e && !hit && e->ngroups == 0);
+   for(int i = 0; i < EPOCH_LISTS; i++)
+	   epoch_reclaim();
+   topic_release(topic);
+}
+
+/*
+ * A PUBLISH is only handed to the reactors owning one of its
+ * subscribers, the others are not woken up.
+ */
+static void test_wakeups(void)
+{
+   struct reactor group[3];
+   group[0] = self;
+   for(int i = 1; i < 3; i++)
+   {
+	memset(&group[i], 0x00, sizeof(group[i]));
+	group[i].id = i;
+	pthread_mutex_init(&group[i].inbox_lock, NULL);
+	group[i].inbox.fd = eventfd(0, EFD_NONBLOCK);
+	assert(group[i].inbox.fd >= 0);
+   }
+   reactor = reactors = group;
+   nreactors = 3;
+
+   struct sol_client remote = { .handle = CONN_HANDLE(0, 1), .reactor = 2 };
+   subscribe("w/x", &remote);
+   const struct interned *topic = topic_intern("w/x", 3);
+   assert(topic);
+   publish_message(0, topic, strlen(PAYLOAD), (unsigned char *) PAYLOAD);
+   assert(group[1].inbox_head == NULL);
+   assert(group[2].inbox_head && !group[2].inbox_head->next);
+   handoff_free(group[2].inbox_head);
+   topic_release(topic);
+
+   for(int i = 1; i < 3; i++)
+	   close(group[i].inbox.fd);
+   self = group[0];
+   reactor = reactors = &self;
+   nreactors = 1;
+}
+
+int main(void)
+{
+   config.fanout_chunk = CHUNK;
+   conf = &config;
+   assert(trie_init(&sol.topics) == 0);
+   pthread_mutex_init(&sol.topics_lock, NULL);
+   assert(conntable_init(&connections) == 0);
+
+   self.id = 0;
+   self.loop = evloop_create(EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
+   pthread_mutex_init(&self.inbox_lock, NULL);
+   self.inbox.fd = eventfd(0, EFD_NONBLOCK);
+   assert(self.inbox.fd >= 0);
+   self.inbox.args = &self.inbox;
+   self.inbox.call = on_handoff;
+   evloop_add_callback(self.loop, &self.inbox);
+   reactor = &self;
+   reactors = &self;
+   nreactors = 1;
+
+   for(int i = 0; i < NSUBS; i++)
+	   open_client(i);
+
+   test_chunks();
+   test_prune();
+   test_share_prune();
+   test_wakeups();
+
+   printf("fanout: ok\n");
+   return 0;
+}
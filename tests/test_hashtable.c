@@ -0,0 +1,237 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+/* Built in, the tests look at the control bytes and the two arrays */
+#include "hashtable.c"
+
+#define NKEYS 20000
+
+static char *keys[NKEYS];
+static int present[NKEYS];
+static size_t destroyed;
+
+/* Keys are owned by the test, the destructor only counts */
+static int count_entry(struct hashtable_entry *e)
+{
+   (void)e;
+   destroyed++;
+   return HASHTABLE_OK;
+}
+
+/* Every key on the same probe sequence, groups fill up and erase leaves tombstones */
+static uint64_t hash_collide(const char *key, size_t len)
+{
+   (void)key;
+   (void)len;
+   return 0x2A;
+}
+
+static void check_model(HashTable *t)
+{
+   size_t n = 0;
+   for(int i = 0; i < NKEYS; i++)
+   {
+	void *val = hashtable_get(t, keys[i]);
+	assert(present[i] ? val == &present[i] : val == NULL);
+	n += present[i];
+   }
+   assert(hashtable_size(t) == n);
+}
+
+/*
+ * Random puts, deletes and reinserts, checked against a model; the table
+ * grows through many incremental rehashes meanwhile and operations keep
+ * landing on both arrays.
+ */
+static void test_model(hashtable_hash_fn *hash, int nkeys, int rounds)
+{
+   HashTable *t = hashtable_create(count_entry);
+   assert(hashtable_set_hash(t, hash) == HASHTABLE_OK);
+   memset(present, 0, sizeof(present));
+   destroyed = 0;
+
+   int saw_rehash = 0;
+   size_t dels = 0;
+   for(int r = 0; r < rounds; r++)
+   {
+	int i = rand() % nkeys;
+	switch(rand() % 4)
+	{
+	   case 0:
+	   case 1:
+		assert(hashtable_put(t, keys[i], &present[i]) == HASHTABLE_OK);
+		present[i] = 1;
+		break;
+	   case 2:
+		if(present[i])
+		{
+		   assert(hashtable_del(t, keys[i]) == HASHTABLE_OK);
+		   dels++;
+		}
+		else
+		   assert(hashtable_del(t, keys[i]) == -HASHTABLE_ERR);
+		present[i] = 0;
+		break;
+	   default:
+		assert((hashtable_get(t, keys[i]) != NULL) == present[i]);
+		break;
+	}
+	saw_rehash |= hashtable_rehashing(t);
+	if(r % 5000 == 0)
+		check_model(t);
+   }
+
+   assert(saw_rehash);
+   assert(destroyed == dels);
+   while(hashtable_rehash_step(t, SIZE_MAX) != HASHTABLE_OK)
+	   ;
+   check_model(t);
+   hashtable_release(t);
+}
+
+/* Deletes and reinserts hitting both arrays while a migration is under way */
+static void test_rehash(hashtable_hash_fn *hash)
+{
+   /* Large enough for the migration to span many operations */
+   HashTable *t = hashtable_create_sized(count_entry, 8000);
+   assert(hashtable_set_hash(t, hash) == HASHTABLE_OK);
+   memset(present, 0, sizeof(present));
+
+   int n = 0;
+   while(!hashtable_rehashing(t))
+   {
+	assert(hashtable_put(t, keys[n], &present[n]) == HASHTABLE_OK);
+	present[n++] = 1;
+   }
+
+   /* Keep the migration going while both arrays hold keys */
+   int old = 0, moved = 0;
+   for(int i = 0; i < n && hashtable_rehashing(t); i++)
+   {
+	int which;
+	size_t len = strlen(keys[i]);
+	long long idx = hashtable_find(t, keys[i], len, t->hash(keys[i], len),
+				       &which);
+	assert(idx >= 0);
+	if(!hashtable_rehashing(t))
+		break;
+	if(which == 0)
+		old++;
+	else
+		moved++;
+
+	assert(hashtable_del(t, keys[i]) == HASHTABLE_OK);
+	present[i] = 0;
+	assert(hashtable_get(t, keys[i]) == NULL);
+	if(i % 2 == 0)
+	{
+	   assert(hashtable_put(t, keys[i], &present[i]) == HASHTABLE_OK);
+	   present[i] = 1;
+	}
+	/* A reinsert never leaves a copy behind in the old array */
+	if(hashtable_rehashing(t) && present[i])
+		assert(t->tabs[0].size == 0 ||
+		       htab_find(&t->tabs[0], keys[i], len,
+			         t->hash(keys[i], len)) < 0);
+   }
+   assert(old > 0 && moved > 0);
+   check_model(t);
+
+   while(hashtable_rehash_step(t, SIZE_MAX) != HASHTABLE_OK)
+	   ;
+   assert(!hashtable_rehashing(t));
+   check_model(t);
+   hashtable_release(t);
+}
+
+/*
+ * With every key colliding, erasing from a full group leaves a tombstone,
+ * which the next insert on the probe sequence takes back without eating
+ * into growth_left; steady churn then never grows the table.
+ */
+static void test_tombstones(void)
+{
+   HashTable *t = hashtable_create_sized(count_entry, 50);
+   assert(hashtable_set_hash(t, hash_collide) == HASHTABLE_OK);
+   memset(present, 0, sizeof(present));
+
+   struct htab *h = &t->tabs[0];
+   size_t table_size = h->table_size;
+   /* The first groups of the probe sequence end up full */
+   int n = 40;
+   assert(n > 2 * HASHTABLE_GROUP && (size_t) n < max_load(table_size));
+   for(int i = 0; i < n; i++)
+   {
+	assert(hashtable_put(t, keys[i], &present[i]) == HASHTABLE_OK);
+	present[i] = 1;
+   }
+   assert(!hashtable_rehashing(t));
+
+   size_t growth = h->growth_left;
+   long long idx = htab_find(h, keys[0], strlen(keys[0]), 0x2A);
+   assert(idx >= 0);
+   assert(hashtable_del(t, keys[0]) == HASHTABLE_OK);
+   present[0] = 0;
+   assert(h->ctrl[idx] == CTRL_DELETED);
+   assert(h->growth_left == growth);
+
+   /* The tombstone is the first free slot of the shared probe sequence */
+   assert(hashtable_put(t, keys[n], &present[n]) == HASHTABLE_OK);
+   present[n] = 1;
+   assert(h->ctrl[idx] == h2(0x2A));
+   assert(h->growth_left == growth);
+   check_model(t);
+
+   for(int r = 0; r < 50 * n; r++)
+   {
+	int out = rand() % (n + 1);
+	if(!present[out])
+		continue;
+	int in = n + 1 + rand() % 64;
+	if(present[in])
+		continue;
+	assert(hashtable_del(t, keys[out]) == HASHTABLE_OK);
+	present[out] = 0;
+	assert(hashtable_put(t, keys[in], &present[in]) == HASHTABLE_OK);
+	present[in] = 1;
+   }
+   while(hashtable_rehash_step(t, SIZE_MAX) != HASHTABLE_OK)
+	   ;
+   assert(t->tabs[0].table_size == table_size);
+   check_model(t);
+   hashtable_release(t);
+}
+
+int main(void)
+{
+   for(int i = 0; i < NKEYS; i++)
+   {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "topic/%d/key", i);
+	keys[i] = strdup(buf);
+   }
+
+   hashtable_hash_fn *backends[] = {
+	hashtable_hash_words,
+#if defined(__x86_64__)
+	__builtin_cpu_supports("sse4.2") ? hashtable_hash_crc32c : NULL,
+#endif
+   };
+
+   srand(7);
+   for(size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+   {
+	if(!backends[b])
+		continue;
+	test_model(backends[b], NKEYS, 200000);
+	test_model(backends[b], 300, 50000);
+	test_rehash(backends[b]);
+   }
+   test_model(hash_collide, 200, 20000);
+   test_tombstones();
+
+   for(int i = 0; i < NKEYS; i++)
+	   free(keys[i]);
+   printf("hashtable: ok\n");
+   return 0;
+}
@@ -0,0 +1,87 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "intern.h"
+
+static const struct interned *intern(const char *name)
+{
+   return topic_intern(name, strlen(name));
+}
+
+/* One copy and one id per name, for as long as it is referenced */
+static void test_shared(void)
+{
+   const struct interned *a = intern("sensors/1/temp");
+   const struct interned *b = intern("sensors/1/temp");
+   assert(a && a == b && a->id != 0);
+   assert(strcmp(a->name, "sensors/1/temp") == 0 && a->len == 14);
+   assert(topic_by_id(a->id) == a);
+   topic_release(a);
+   topic_release(b);
+}
+
+/*
+ * Past the sweep threshold unreferenced names are freed and their ids
+ * handed out again, referenced ones keep both; the reclaim generation
+ * moves before any id is reused.
+ */
+static void test_sweep(void)
+{
+   char buf[64];
+   unsigned kept[16];
+   const struct interned *keep[16];
+   unsigned max_id = 0;
+
+   /* Just short of the threshold, the next new name sweeps */
+   int n = INTERN_SWEEP_MIN - topic_interned_count();
+   for(int i = 0; i < n; i++)
+   {
+	snprintf(buf, sizeof(buf), "sweep/%d", i);
+	const struct interned *t = intern(buf);
+	assert(t);
+	if(t->id > max_id)
+		max_id = t->id;
+	if(i % (n / 16) == 0 && i / (n / 16) < 16)
+	{
+	   keep[i / (n / 16)] = t;
+	   kept[i / (n / 16)] = t->id;
+	}
+	else
+	   topic_release(t);
+   }
+
+   unsigned long long gen = topic_reclaim_gen();
+   const struct interned *t = intern("after/sweep");
+   assert(t);
+   assert(topic_reclaim_gen() > gen);
+   assert(topic_interned_count() < 64);
+   assert(t->id <= max_id);
+   topic_release(t);
+
+   for(int i = 0; i < 16; i++)
+   {
+	snprintf(buf, sizeof(buf), "sweep/%d", i * (n / 16));
+	assert(topic_by_id(kept[i]) == keep[i]);
+	const struct interned *again = intern(buf);
+	assert(again == keep[i] && again->id == kept[i]);
+	topic_release(again);
+	topic_release(keep[i]);
+   }
+
+   /* Freed ids go to new names, no new id is needed */
+   for(int i = 0; i < 1000; i++)
+   {
+	snprintf(buf, sizeof(buf), "reuse/%d", i);
+	const struct interned *r = intern(buf);
+	assert(r && r->id <= max_id);
+	topic_release(r);
+   }
+}
+
+int main(void)
+{
+   test_shared();
+   test_sweep();
+   printf("intern: ok\n");
+   return 0;
+}
@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "mqtt.h"
+
+static long long parse(const unsigned char *buf, size_t len)
+{
+   struct mqtt_parser parser;
+   mqtt_parser_init(&parser);
+   return mqtt_parse_frame(&parser, buf, len, 1024);
+}
+
+/* Server to client packets are refused on their first byte */
+static void test_parse_types(void)
+{
+   const unsigned char pingreq[] = { PINGREQ << 4, 0 };
+   assert(parse(pingreq, sizeof(pingreq)) == sizeof(pingreq));
+
+   const unsigned char disconnect[] = { DISCONNECT << 4, 0 };
+   assert(parse(disconnect, sizeof(disconnect)) == sizeof(disconnect));
+
+   const unsigned char refused[] = { 0, CONNACK, SUBACK, UNSUBACK, PINGRESP, 15 };
+   for(size_t i = 0; i < sizeof(refused); i++)
+   {
+	const unsigned char frame[] = { refused[i] << 4, 0 };
+	assert(parse(frame, sizeof(frame)) == -MQTT_PARSE_ERR);
+   }
+}
+
+/* A frame the parser let through never reaches a missing unpack handler */
+static void test_unpack_types(void)
+{
+   union mqtt_packet pkt;
+   const unsigned char suback[] = { SUBACK << 4, 3, 0, 1, 0 };
+   assert(unpack_mqtt_packet(suback, &pkt) < 0);
+   const unsigned char unsuback[] = { UNSUBACK << 4, 2, 0, 1 };
+   assert(unpack_mqtt_packet(unsuback, &pkt) < 0);
+}
+
+/*
+ * Every length prefix is checked against what is left of the packet, in
+ * both decoding modes: short packets fail instead of reading past them.
+ */
+static void test_unpack_bounds(void)
+{
+   union mqtt_packet pkt;
+
+   for(int view = 0; view < 2; view++)
+   {
+	int (*unpack)(const unsigned char *, union mqtt_packet *) =
+		view ? unpack_mqtt_packet_view : unpack_mqtt_packet;
+
+	const unsigned char publish[] = { PUBLISH << 4, 7, 0, 3, 'a', '/', 'b', 'h', 'i' };
+	assert(unpack(publish, &pkt) == 7);
+	assert(pkt.publish.topiclen == 3 && pkt.publish.payloadlen == 2);
+	assert(memcmp(pkt.publish.payload, "hi", 2) == 0);
+	if(view)
+		mqtt_packet_release_view(&pkt, PUBLISH);
+	else
+		mqtt_packet_release(&pkt, PUBLISH);
+
+	/* Topic longer than the packet */
+	const unsigned char long_topic[] = { PUBLISH << 4, 4, 0, 9, 'a', 'b' };
+	assert(unpack(long_topic, &pkt) < 0);
+
+	/* QoS 1 without room for the packet id */
+	const unsigned char no_id[] = { (PUBLISH << 4) | 2, 3, 0, 1, 'a' };
+	assert(unpack(no_id, &pkt) < 0);
+
+	const unsigned char subscribe[] = {
+		(SUBSCRIBE << 4) | 2, 12, 0, 1,
+		0, 3, 'a', '/', '#', 1,
+		0, 1, '+', 0
+	};
+	assert(unpack(subscribe, &pkt) == 12);
+	assert(pkt.subscribe.pkt_id == 1 && pkt.subscribe.tuples_len == 2);
+	assert(pkt.subscribe.tuples[0].topic_len == 3);
+	assert(pkt.subscribe.tuples[0].qos == 1);
+	assert(pkt.subscribe.tuples[1].topic_len == 1);
+	if(view)
+		mqtt_packet_release_view(&pkt, SUBSCRIBE);
+	else
+		mqtt_packet_release(&pkt, SUBSCRIBE);
+
+	/* Second filter missing its QoS byte */
+	const unsigned char no_qos[] = {
+		(SUBSCRIBE << 4) | 2, 9, 0, 1,
+		0, 1, 'a', 1,
+		0, 1, 'b'
+	};
+	assert(unpack(no_qos, &pkt) < 0);
+
+	/* Filter length past the end, and a lone byte left over */
+	const unsigned char sub_long[] = { (SUBSCRIBE << 4) | 2, 5, 0, 1, 0, 200, 'a' };
+	assert(unpack(sub_long, &pkt) < 0);
+	const unsigned char sub_odd[] = { (SUBSCRIBE << 4) | 2, 3, 0, 1, 0 };
+	assert(unpack(sub_odd, &pkt) < 0);
+	const unsigned char sub_empty[] = { (SUBSCRIBE << 4) | 2, 2, 0, 1 };
+	assert(unpack(sub_empty, &pkt) < 0);
+	const unsigned char sub_short[] = { (SUBSCRIBE << 4) | 2, 1, 0 };
+	assert(unpack(sub_short, &pkt) < 0);
+
+	const unsigned char unsubscribe[] = {
+		(UNSUBSCRIBE << 4) | 2, 7, 0, 2, 0, 1, 'a', 0, 0
+	};
+	assert(unpack(unsubscribe, &pkt) == 7);
+	assert(pkt.unsubscribe.tuples_len == 2);
+	if(view)
+		mqtt_packet_release_view(&pkt, UNSUBSCRIBE);
+	else
+		mqtt_packet_release(&pkt, UNSUBSCRIBE);
+
+	const unsigned char unsub_long[] = {
+		(UNSUBSCRIBE << 4) | 2, 7, 0, 2, 0, 1, 'a', 0, 5
+	};
+	assert(unpack(unsub_long, &pkt) < 0);
+
+	const unsigned char connect[] = {
+		CONNECT << 4, 15,
+		0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, 60,
+		0, 3, 'c', 'i', 'd'
+	};
+	assert(unpack(connect, &pkt) == 15);
+	assert(pkt.connect.payload.keepalive == 60);
+	assert(pkt.connect.payload.client_id_len == 3);
+	if(view)
+		mqtt_packet_release_view(&pkt, CONNECT);
+	else
+		mqtt_packet_release(&pkt, CONNECT);
+
+	/* Username flag set, but nothing past the client id */
+	const unsigned char no_user[] = {
+		CONNECT << 4, 15,
+		0, 4, 'M', 'Q', 'T', 'T', 4, 0x82, 0, 60,
+		0, 3, 'c', 'i', 'd'
+	};
+	assert(unpack(no_user, &pkt) < 0);
+
+	const unsigned char short_connect[] = { CONNECT << 4, 3, 0, 4, 'M' };
+	assert(unpack(short_connect, &pkt) < 0);
+
+	const unsigned char short_ack[] = { PUBACK << 4, 1, 0 };
+	assert(unpack(short_ack, &pkt) < 0);
+   }
+}
+
+int main(void)
+{
+   test_parse_types();
+   test_unpack_types();
+   test_unpack_bounds();
+   printf("mqtt: ok\n");
+   return 0;
+}
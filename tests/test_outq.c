@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+/* Built in, the tests drive the static queueing helpers directly */
+#include "server.c"
+
+#define HWM 4096
+#define LWM 1024
+#define FACTOR 4
+#define PKT 512
+
+struct config *conf;
+static struct config config;
+static struct reactor self;
+static struct bytestring *body;
+
+/* A connection whose peer does not read until told to */
+static void open_client(struct closure *cb, int *peer)
+{
+   int sv[2];
+   assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+   assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+   cb->fd = sv[0];
+   cb->paused = 0;
+   outqueue_init(&cb->outq);
+   assert(conntable_put(&connections, cb) == 0);
+   *peer = sv[1];
+}
+
+static void close_client(struct closure *cb, int peer)
+{
+   outqueue_clear(&cb->outq);
+   conntable_del(&connections, cb);
+   close(cb->fd);
+   close(peer);
+}
+
+static int enqueue(struct closure *cb, int droppable)
+{
+   struct outbuf *ob = outbuf_create(bytestring_ref(body));
+   assert(ob && outbuf_add(ob, body->data, PKT) == 0);
+   return enqueue_outbuf(cb, ob, droppable);
+}
+
+/* Bytes that reached the peer, -1 once it saw the end of the stream */
+static ssize_t drain(int peer)
+{
+   char buf[8192];
+   ssize_t n, total = 0;
+   while((n = recv(peer, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+	   total += n;
+   return n == 0 ? -1 : total;
+}
+
+/* Reads pause at the high watermark and resume below the low one */
+static void test_pause_resume(void)
+{
+   struct closure cb;
+   int peer;
+   open_client(&cb, &peer);
+
+   for(int i = 0; i < HWM / PKT - 1; i++)
+   {
+	assert(enqueue(&cb, 0) == 0);
+	assert(!cb.paused);
+   }
+   assert(enqueue(&cb, 0) == 0);
+   assert(cb.paused);
+   assert(cb.outq.bytes == HWM);
+   assert(conntable_backlog(&connections,
+			    CONN_HANDLE(cb.fd, cb.gen)) == HWM);
+
+   /* QoS0 past the high watermark is kept unless told otherwise */
+   assert(enqueue(&cb, 1) == 0);
+   config.outq_drop_qos0 = 1;
+   long long dropped = self.info.messages_dropped;
+   assert(enqueue(&cb, 1) < 0);
+   assert(self.info.messages_dropped == dropped + 1);
+   config.outq_drop_qos0 = 0;
+
+   /* Everything fits the socket buffer, so one flush empties the queue */
+   assert(flush_outbound(&cb) == 0);
+   assert(cb.outq.bytes == 0 && cb.outq.len == 0);
+   assert(!cb.paused);
+   assert(drain(peer) == HWM + PKT);
+
+   close_client(&cb, peer);
+}
+
+/*
+ * Nobody reads: the queue grows past the high watermark up to the hard
+ * limit, where QoS0 is dropped and anything else shuts the client down.
+ */
+static void test_limit(void)
+{
+   struct closure cb;
+   int peer;
+   open_client(&cb, &peer);
+
+   for(int i = 0; i < HWM * FACTOR / PKT; i++)
+	   assert(enqueue(&cb, i % 2) == 0);
+   assert(cb.paused);
+   assert(cb.outq.bytes == outq_limit());
+
+   long long dropped = self.info.messages_dropped;
+   assert(enqueue(&cb, 1) < 0);
+   assert(self.info.messages_dropped == dropped + 1);
+   assert(cb.outq.bytes == outq_limit());
+   assert(drain(peer) == 0);
+
+   assert(enqueue(&cb, 0) < 0);
+   assert(self.info.messages_dropped == dropped + 2);
+   assert(cb.outq.bytes == outq_limit());
+   /* Nothing was ever flushed, the peer sees the end of the stream */
+   assert(drain(peer) == -1);
+
+   close_client(&cb, peer);
+}
+
+int main(void)
+{
+   config.outq_hwm = HWM;
+   config.outq_lwm = LWM;
+   config.outq_max_factor = FACTOR;
+   conf = &config;
+   reactor = &self;
+   assert(conntable_init(&connections) == 0);
+   body = bytestring_create(PKT);
+   assert(body);
+   memset(body->data, 'x', PKT);
+
+   test_pause_resume();
+   test_limit();
+
+   bytestring_release(body);
+   printf("outq: ok\n");
+   return 0;
+}
@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "timer.h"
+
+#define NTIMERS 4096
+#define SPAN (1ULL << (TIMER_WHEEL_BITS * 3 + 1))
+
+struct probe
+{
+   struct timer timer;
+   struct timer_wheel *wheel;
+   unsigned long long fired_at;
+   unsigned long long want;
+   int fired;
+   int rearm;
+};
+
+static void on_probe(struct timer *t)
+{
+   struct probe *p = t->args;
+   p->fired++;
+   p->fired_at = p->wheel->now;
+   if(p->rearm > 0)
+   {
+	p->rearm--;
+	p->want = p->wheel->now + 1 + rand() % 300;
+	timer_wheel_add(p->wheel, t, p->want);
+   }
+}
+
+static struct probe probes[NTIMERS];
+
+static void probe_add(struct timer_wheel *w, struct probe *p,
+		      unsigned long long expires)
+{
+   timer_init(&p->timer, on_probe, p);
+   p->wheel = w;
+   p->want = expires;
+   p->fired = 0;
+   p->rearm = 0;
+   timer_wheel_add(w, &p->timer, expires);
+}
+
+/*
+ * Expirations spread over the first three levels fire exactly on their
+ * tick, whatever level they were filed in and however many times they
+ * were cascaded down.
+ */
+static void test_cascade(unsigned long long start)
+{
+   struct timer_wheel w;
+   timer_wheel_init(&w, start);
+
+   for(int i = 0; i < NTIMERS; i++)
+	   probe_add(&w, &probes[i], start + 1 + rand() % SPAN);
+   assert(w.count == NTIMERS);
+
+   while(w.count > 0)
+   {
+	long long next = timer_wheel_next(&w);
+	assert(next > 0 && next <= TIMER_WHEEL_SLOTS);
+	timer_wheel_advance(&w, w.now + next);
+   }
+
+   for(int i = 0; i < NTIMERS; i++)
+   {
+	assert(probes[i].fired == 1);
+	assert(probes[i].fired_at == probes[i].want);
+   }
+}
+
+/* Deleted timers never fire, re-added ones only fire at their new tick */
+static void test_readd_del(void)
+{
+   struct timer_wheel w;
+   timer_wheel_init(&w, 1000);
+
+   for(int i = 0; i < NTIMERS; i++)
+	   probe_add(&w, &probes[i], w.now + 1 + rand() % SPAN);
+
+   timer_wheel_advance(&w, w.now + SPAN / 4);
+
+   for(int i = 0; i < NTIMERS; i++)
+   {
+	struct probe *p = &probes[i];
+	if(p->fired)
+		continue;
+	switch(i % 3)
+	{
+	   case 0:
+		timer_wheel_del(&w, &p->timer);
+		assert(!timer_pending(&p->timer));
+		timer_wheel_del(&w, &p->timer);
+		break;
+	   case 1:
+		p->want = w.now + 1 + rand() % SPAN;
+		timer_wheel_add(&w, &p->timer, p->want);
+		break;
+	   default:
+		/* Reschedules itself from its own callback a few times */
+		p->rearm = 3;
+		break;
+	}
+   }
+
+   timer_wheel_advance(&w, w.now + 2 * SPAN);
+   assert(w.count == 0);
+   assert(timer_wheel_next(&w) == -1);
+
+   for(int i = 0; i < NTIMERS; i++)
+   {
+	struct probe *p = &probes[i];
+	if(i % 3 == 0 && p->fired == 0)
+		continue;
+	assert(p->fired >= 1);
+	assert(p->fired_at == p->want);
+	assert(!timer_pending(&p->timer));
+	if(i % 3 == 2 && p->fired > 1)
+		assert(p->rearm == 0);
+   }
+}
+
+/*
+ * Past the last wheel, expirations are filed at its end and filed again
+ * from there, until they are close enough to fire on their own tick.
+ */
+static void test_far(void)
+{
+   struct timer_wheel w;
+   timer_wheel_init(&w, 0);
+   unsigned long long max = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+
+   probe_add(&w, &probes[0], max * 2 + 5);
+   timer_wheel_advance(&w, max * 2 + 4);
+   assert(probes[0].fired == 0);
+   timer_wheel_advance(&w, max * 2 + 5);
+   assert(probes[0].fired == 1);
+   assert(probes[0].fired_at == max * 2 + 5);
+}
+
+/* Adding in the past fires on the next tick */
+static void test_past(void)
+{
+   struct timer_wheel w;
+   timer_wheel_init(&w, 500);
+
+   probe_add(&w, &probes[0], 10);
+   assert(timer_wheel_next(&w) == 1);
+   timer_wheel_advance(&w, 501);
+   assert(probes[0].fired == 1 && probes[0].fired_at == 501);
+}
+
+int main(void)
+{
+   srand(42);
+   test_cascade(0);
+   test_cascade(12345);
+   test_cascade((1ULL << 40) - 77);
+   test_readd_del();
+   test_far();
+   test_past();
+   printf("timer: ok\n");
+   return 0;
+}
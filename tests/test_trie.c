@@ -0,0 +1,308 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+/* Built in, the tests look at node labels and child indexes */
+#include "trie.c"
+
+#define NFILTERS 2000
+#define NTOPICS 5000
+
+static char *filters[NFILTERS];
+static int ids[NFILTERS];
+static int matched[NFILTERS];
+
+static void **insert(Trie *t, const char *filter)
+{
+   return trie_insert(t, filter, strlen(filter));
+}
+
+static void *find(Trie *t, const char *filter)
+{
+   return trie_find(t, filter, strlen(filter));
+}
+
+static const struct trie_node *child(const struct trie_node *node,
+				     const char *level)
+{
+   return child_get(node, level, strlen(level));
+}
+
+/* Exact levels merge in one node and split where a filter diverges */
+static void test_split(void)
+{
+   Trie t;
+   assert(trie_init(&t) == 0);
+
+   *insert(&t, "a/b/c/d") = &ids[0];
+   const struct trie_node *n = child(t.root, "a");
+   assert(n && strcmp(n->label, "a/b/c/d") == 0 && n->first == 1);
+   assert(t.nodes == 2);
+   assert(find(&t, "a/b") == NULL);
+
+   /* Diverging after "a/b": head keeps the slot, tail takes the data */
+   *insert(&t, "a/b/x") = &ids[1];
+   n = child(t.root, "a");
+   assert(n && strcmp(n->label, "a/b") == 0 && n->data == NULL);
+   const struct trie_node *tail = child(n, "c");
+   assert(tail && strcmp(tail->label, "c/d") == 0 && tail->first == 1);
+   assert(tail->data == &ids[0]);
+   assert(child(n, "x") && child(n, "x")->data == &ids[1]);
+   assert(find(&t, "a/b/c/d") == &ids[0]);
+   assert(find(&t, "a/b/x") == &ids[1]);
+
+   /* A filter ending inside a label splits it too */
+   *insert(&t, "a/b/c") = &ids[2];
+   assert(find(&t, "a/b/c") == &ids[2]);
+   assert(find(&t, "a/b/c/d") == &ids[0]);
+   assert(strcmp(child(n, "c")->label, "c") == 0);
+
+   /* Same first bytes, different levels: no split */
+   *insert(&t, "ab/c") = &ids[3];
+   assert(strcmp(child(t.root, "a")->label, "a/b") == 0);
+   assert(strcmp(child(t.root, "ab")->label, "ab/c") == 0);
+
+   /* Wildcards end an exact run */
+   *insert(&t, "q/r/+/s/t") = &ids[4];
+   n = child(t.root, "q");
+   assert(strcmp(n->label, "q/r") == 0 && n->plus);
+   assert(strcmp(child(n->plus, "s")->label, "s/t") == 0);
+   assert(find(&t, "q/r/+/s/t") == &ids[4]);
+   assert(find(&t, "q/r") == NULL);
+   assert(find(&t, "a/b/c/d/e") == NULL);
+   assert(find(&t, "a/b/c/") == NULL);
+}
+
+static int trie_del(Trie *t, const char *filter)
+{
+   return trie_remove(t, filter, strlen(filter));
+}
+
+/* Emptied nodes go away and the runs they broke merge again */
+static void test_remove(void)
+{
+   Trie t;
+   assert(trie_init(&t) == 0);
+   size_t bytes = t.bytes;
+
+   *insert(&t, "a/b/c/d") = &ids[0];
+   *insert(&t, "a/b/x") = &ids[1];
+   *insert(&t, "q/+/s") = &ids[2];
+   assert(trie_del(&t, "a/b") == -1);
+   assert(trie_del(&t, "a/b/x/y") == -1);
+   assert(trie_del(&t, "q/#") == -1);
+
+   assert(trie_del(&t, "a/b/x") == 0);
+   const struct trie_node *n = child(t.root, "a");
+   assert(n && strcmp(n->label, "a/b/c/d") == 0 && n->data == &ids[0]);
+   assert(!n->children);
+   assert(find(&t, "a/b/x") == NULL && find(&t, "a/b/c/d") == &ids[0]);
+
+   assert(trie_del(&t, "q/+/s") == 0);
+   assert(child(t.root, "q") == NULL);
+   assert(trie_del(&t, "a/b/c/d") == 0);
+   assert(!t.root->children);
+   assert(t.nodes == 1 && t.bytes == bytes);
+
+   /* A node keeping its data keeps its place */
+   *insert(&t, "a/b") = &ids[0];
+   *insert(&t, "a/b/c") = &ids[1];
+   assert(trie_del(&t, "a/b/c") == 0);
+   assert(strcmp(child(t.root, "a")->label, "a/b") == 0);
+   assert(find(&t, "a/b") == &ids[0]);
+   epoch_reclaim();
+}
+
+/* Past TRIE_INLINE_CHILDREN children the index turns into a table */
+static void test_hashed(void)
+{
+   Trie t;
+   assert(trie_init(&t) == 0);
+   char buf[32];
+
+   for(int i = 0; i < TRIE_INLINE_CHILDREN; i++)
+   {
+	snprintf(buf, sizeof(buf), "room-%d/temp", i);
+	*insert(&t, buf) = &ids[i];
+   }
+   assert(!t.root->children->hashed);
+   assert(t.root->children->nchildren == TRIE_INLINE_CHILDREN);
+
+   snprintf(buf, sizeof(buf), "room-%d/temp", TRIE_INLINE_CHILDREN);
+   *insert(&t, buf) = &ids[TRIE_INLINE_CHILDREN];
+   assert(t.root->children->hashed);
+   assert(t.root->children->capacity == TRIE_INLINE_CHILDREN * 4);
+
+   /* And keeps growing under half full */
+   for(int i = TRIE_INLINE_CHILDREN + 1; i < 1000; i++)
+   {
+	snprintf(buf, sizeof(buf), "room-%d/temp", i);
+	*insert(&t, buf) = &ids[i];
+   }
+   const struct trie_index *idx = t.root->children;
+   assert(idx->hashed && idx->nchildren == 1000);
+   assert(idx->nchildren * 2 <= idx->capacity);
+
+   for(int i = 0; i < 1000; i++)
+   {
+	snprintf(buf, sizeof(buf), "room-%d/temp", i);
+	assert(find(&t, buf) == &ids[i]);
+	snprintf(buf, sizeof(buf), "room-%d/hum", i);
+	assert(find(&t, buf) == NULL);
+   }
+
+   /* Back to an array once few enough children are left */
+   for(int i = 3; i < 1000; i++)
+   {
+	snprintf(buf, sizeof(buf), "room-%d/temp", i);
+	assert(trie_del(&t, buf) == 0);
+   }
+   idx = t.root->children;
+   assert(!idx->hashed && idx->nchildren == 3);
+   for(int i = 0; i < 3; i++)
+   {
+	snprintf(buf, sizeof(buf), "room-%d/temp", i);
+	assert(find(&t, buf) == &ids[i]);
+   }
+   epoch_reclaim();
+}
+
+/* Filter and topic from the same few levels, so they overlap a lot */
+static const char *levels[] = { "a", "b", "ab", "c", "$x", "" };
+#define NLEVELS (sizeof(levels) / sizeof(levels[0]))
+
+static void random_name(char *buf, size_t size, int filter)
+{
+   int depth = 1 + rand() % 5;
+   buf[0] = '\0';
+   for(int i = 0; i < depth; i++)
+   {
+	const char *level = levels[rand() % NLEVELS];
+	if(i > 0 && strcmp(level, "$x") == 0)
+		level = "x";
+	if(filter && rand() % 4 == 0)
+		level = "+";
+	if(filter && i == depth - 1 && rand() % 5 == 0)
+		level = "#";
+	snprintf(buf + strlen(buf), size - strlen(buf), "%s%s",
+		 i > 0 ? "/" : "", level);
+   }
+}
+
+/* MQTT 4.7, level by level */
+static int reference_match(const char *filter, const char *topic)
+{
+   if(topic[0] == '$' && (filter[0] == '+' || filter[0] == '#'))
+	   return 0;
+   for(;;)
+   {
+	if(strcmp(filter, "#") == 0)
+		return 1;
+	const char *fend = strchr(filter, '/');
+	const char *tend = strchr(topic, '/');
+	size_t flen = fend ? (size_t)(fend - filter) : strlen(filter);
+	size_t tlen = tend ? (size_t)(tend - topic) : strlen(topic);
+	if(!(flen == 1 && filter[0] == '+') &&
+			(flen != tlen || memcmp(filter, topic, flen) != 0))
+		return 0;
+	if(!tend)
+		return !fend || strcmp(fend + 1, "#") == 0;
+	if(!fend)
+		return 0;
+	filter = fend + 1;
+	topic = tend + 1;
+   }
+}
+
+static void on_match(void *data, void *arg)
+{
+   (void)arg;
+   matched[(int *) data - ids]++;
+}
+
+/* '+', '#' and '$' against a brute force matcher on random filters */
+static void test_match(void)
+{
+   Trie t;
+   assert(trie_init(&t) == 0);
+   char buf[64];
+   int n = 0;
+
+   const char *fixed[] = { "#", "+", "+/#", "$x/#", "a/#", "$x/+", "+/+" };
+   for(size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+	   filters[n++] = strdup(fixed[i]);
+   while(n < NFILTERS)
+   {
+	random_name(buf, sizeof(buf), 1);
+	if(buf[0] == '\0')
+		continue;
+	int dup = 0;
+	for(int i = 0; i < n && !dup; i++)
+		dup = strcmp(filters[i], buf) == 0;
+	if(!dup)
+		filters[n++] = strdup(buf);
+   }
+   for(int i = 0; i < n; i++)
+   {
+	ids[i] = i;
+	void **slot = insert(&t, filters[i]);
+	assert(slot && !*slot);
+	*slot = &ids[i];
+   }
+   for(int i = 0; i < n; i++)
+	   assert(find(&t, filters[i]) == &ids[i]);
+
+   epoch_enter();
+   for(int r = 0; r < NTOPICS; r++)
+   {
+	if(r < 4)
+		strcpy(buf, (const char *[]){ "a", "$x", "$x/a", "a/b/c" }[r]);
+	else
+		random_name(buf, sizeof(buf), 0);
+	if(buf[0] == '\0')
+		continue;
+	memset(matched, 0, sizeof(matched));
+	trie_match(&t, buf, strlen(buf), on_match, NULL);
+	for(int i = 0; i < n; i++)
+		assert(matched[i] == reference_match(filters[i], buf));
+   }
+   epoch_exit();
+
+   /* Half of the filters gone, the others match as before */
+   for(int i = 0; i < n; i += 2)
+	   assert(trie_del(&t, filters[i]) == 0);
+   epoch_enter();
+   for(int r = 0; r < NTOPICS; r++)
+   {
+	random_name(buf, sizeof(buf), 0);
+	if(buf[0] == '\0')
+		continue;
+	memset(matched, 0, sizeof(matched));
+	trie_match(&t, buf, strlen(buf), on_match, NULL);
+	for(int i = 0; i < n; i++)
+		assert(matched[i] == (i % 2 && reference_match(filters[i], buf)));
+   }
+   epoch_exit();
+   for(int i = 1; i < n; i += 2)
+	   assert(find(&t, filters[i]) == &ids[i]);
+
+   for(int i = 1; i < n; i += 2)
+	   assert(trie_del(&t, filters[i]) == 0);
+   assert(t.nodes == 1);
+   assert(!t.root->plus && !t.root->hash);
+   assert(!t.root->children || t.root->children->nchildren == 0);
+   epoch_reclaim();
+
+   for(int i = 0; i < n; i++)
+	   free(filters[i]);
+}
+
+int main(void)
+{
+   srand(11);
+   test_split();
+   test_remove();
+   test_hashed();
+   test_match();
+   printf("trie: ok\n");
+   return 0;
+}
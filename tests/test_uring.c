@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+/* Built in, the tests run the io_uring backend one batch at a time */
+#include "network.c"
+
+struct config *conf;
+static struct config config;
+
+struct probe
+{
+   struct closure cb;
+   int calls;
+   int errors;
+};
+
+static void on_event(struct evloop *loop, void *arg)
+{
+   (void)loop;
+   struct probe *p = arg;
+   char buf[16];
+   p->calls++;
+   while(read(p->cb.fd, buf, sizeof(buf)) > 0)
+	   ;
+}
+
+static void on_error(struct evloop *loop, void *arg)
+{
+   struct probe *p = arg;
+   p->errors++;
+   evloop_del_callback(loop, &p->cb);
+}
+
+static void probe_open(struct probe *p, int *peer)
+{
+   int sv[2];
+   assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+   assert(set_nonblocking(sv[0]) == 0);
+   memset(p, 0x00, sizeof(*p));
+   p->cb.fd = sv[0];
+   p->cb.args = p;
+   p->cb.call = on_event;
+   p->cb.on_error = on_error;
+   *peer = sv[1];
+}
+
+/* A readable socket completes its poll once and needs a rearm */
+static void test_read(struct evloop *loop)
+{
+   struct probe p;
+   int peer;
+   probe_open(&p, &peer);
+
+   evloop_add_callback(loop, &p.cb);
+   assert(p.cb.armed == POLLIN);
+   assert(write(peer, "x", 1) == 1);
+   assert(uring_run_once(loop) == 0);
+   assert(p.calls == 1 && p.cb.armed == 0);
+
+   assert(evloop_rearm_callback_read(loop, &p.cb) == 0);
+   assert(write(peer, "y", 1) == 1);
+   assert(uring_run_once(loop) == 0);
+   assert(p.calls == 2);
+
+   evloop_del_callback(loop, &p.cb);
+   close(p.cb.fd);
+   close(peer);
+}
+
+/* Rearming with another mask updates the poll in flight, no second one */
+static void test_update(struct evloop *loop)
+{
+   struct probe p;
+   int peer;
+   probe_open(&p, &peer);
+
+   evloop_add_callback(loop, &p.cb);
+   assert(evloop_rearm_callback_rw(loop, &p.cb) == 0);
+   assert(p.cb.armed == (POLLIN | POLLOUT));
+   /* The socket is writable right away */
+   assert(uring_run_once(loop) == 0);
+   assert(p.calls == 1 && p.cb.armed == 0);
+
+   assert(evloop_rearm_callback_write(loop, &p.cb) == 0);
+   assert(evloop_rearm_callback_write(loop, &p.cb) == 0);
+   assert(uring_run_once(loop) == 0);
+   assert(p.calls == 2);
+
+   evloop_del_callback(loop, &p.cb);
+   close(p.cb.fd);
+   close(peer);
+}
+
+/* A deleted closure is never called, its poll is cancelled */
+static void test_cancel(struct evloop *loop)
+{
+   struct probe p;
+   int peer;
+   probe_open(&p, &peer);
+
+   evloop_add_callback(loop, &p.cb);
+   evloop_del_callback(loop, &p.cb);
+   assert(p.cb.armed == 0 && p.cb.watch == 0);
+   assert(write(peer, "x", 1) == 1);
+   assert(uring_run_once(loop) == 0);
+   assert(p.calls == 0 && p.errors == 0);
+
+   close(p.cb.fd);
+   close(peer);
+}
+
+/* A hang-up goes to the owner error path */
+static void test_hangup(struct evloop *loop)
+{
+   struct probe p;
+   int peer;
+   probe_open(&p, &peer);
+
+   evloop_add_callback(loop, &p.cb);
+   close(peer);
+   assert(uring_run_once(loop) == 0);
+   assert(p.errors == 1 && p.calls == 0);
+
+   close(p.cb.fd);
+}
+
+int main(void)
+{
+   config.io_backend = EVLOOP_URING;
+   conf = &config;
+   alarm(10);
+
+   struct evloop *loop = evloop_create(64, -1);
+   if(loop->backend != EVLOOP_URING)
+   {
+	printf("uring: skipped, no io_uring\n");
+	evloop_free(loop);
+	return 0;
+   }
+
+   test_read(loop);
+   test_update(loop);
+   test_cancel(loop);
+   test_hangup(loop);
+
+   evloop_free(loop);
+   printf("uring: ok\n");
+   return 0;
+}